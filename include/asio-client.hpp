@@ -3,11 +3,27 @@
 #include "audio-player.hpp"
 #include "client-protocol.hpp"
 #include "protocol.hpp"
+#include "shm-ring.hpp"
+#include "track-cache.hpp"
+#include "udp-stream.hpp"
 
 #include <absl/functional/any_invocable.h>
 #include <asio.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/generic/stream_protocol.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/ip/udp.hpp>
+#include <asio/local/stream_protocol.hpp>
+#if defined(__linux__)
+#  include <asio/posix/stream_descriptor.hpp>
+#endif
+#include <asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
 #include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace asio {
 struct io_context;
@@ -15,45 +31,232 @@ struct io_context;
 
 namespace am {
 
+/// Streams a track over TCP or a unix socket into the player's buffer.
+/**
+ * A connection that drops before the end of the track is made again, after
+ * first_reconnect_delay doubling up to max_reconnect_delay, and the track
+ * continues from the first frame after the bytes the player already has.
+ * What the player decoded keeps playing meanwhile.
+ */
 struct TcpClientConnection : std::enable_shared_from_this<TcpClientConnection> {
 
   using Pointer = std::shared_ptr<TcpClientConnection>;
+  static constexpr auto first_reconnect_delay = std::chrono::milliseconds(200);
+  static constexpr auto max_reconnect_delay = std::chrono::seconds(5);
+  // failed attempts in a row before the track is given up
+  static constexpr std::size_t max_reconnects = 8;
 
+  // host names the server in cache, which may be null
   static TcpClientConnection::Pointer create(asio::io_context &io_context,
                                              asio::io_context::strand &strand,
-                                             Mp3Stream &mp3_stream);
+                                             Mp3Stream &mp3_stream,
+                                             std::string track,
+                                             RangeRequest range,
+                                             std::string host = {},
+                                             TrackCache *cache = nullptr);
+  ~TcpClientConnection();
 
+  // tries endpoints in order, with TCP Fast Open where the platform has it
+  void connect(asio::ip::tcp::resolver::results_type endpoints);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+  // a server on the same host, past the TCP/IP stack
+  void connect(asio::local::stream_protocol::endpoint endpoint);
+#endif
   void on_connect();
+  // pause, resume or report the buffer level while streaming. after stop the
+  // connection is not made again
+  void send_control(Control control);
 
-  asio::ip::tcp::socket &socket();
+  asio::generic::stream_protocol::socket &socket();
 
 private:
   TcpClientConnection(asio::io_context &io_context,
-                      asio::io_context::strand &strand, Mp3Stream &mp3_stream);
+                      asio::io_context::strand &strand, Mp3Stream &mp3_stream,
+                      std::string track, RangeRequest range, std::string host,
+                      TrackCache *cache);
 
-  void
-  receive(std::function<void(const asio::error_code &)> &&on_error);
+  void connect(asio::ip::tcp::resolver::results_type endpoints,
+               asio::ip::tcp::resolver::results_type::iterator next);
+  // the connection dropped or could not be made, true if it is made again
+  bool reconnect();
+  // forgets the dropped connection and asks for the rest of the track
+  void resume();
+  /// Sends the requests, then reads until the server closes.
+  /**
+   * The frame is allocated once per connection and holds it. Messages are
+   * read into the connection's own buffer, the decoder hands mp3 payloads
+   * to the player's buffer. While that is full it waits on wake_, a timer
+   * cancelled by the buffer's not full callback, before reading more.
+   */
+  asio::awaitable<void> run(Pointer self);
+  // tells the server what to stream and where to start from. with a copy of
+  // the track the range request waits for the server's hello
+  asio::awaitable<bool> send_requests();
+  // offers the copy's tag if the server knows tags, and sends the range
+  void on_hello();
+  // plays the copy if the server confirmed its tag, else starts a new one
+  void on_range(RangeReply range);
+  /// Copies what the player has room for from the copy of the track.
+  /**
+   * Reads straight into the player's buffer, and again whenever it drained
+   * below its low watermark, until the end of the copy.
+   */
+  void play_cached();
+  // writes the write buffer until it is empty, false if the socket failed
+  asio::awaitable<bool> flush();
+  // same for flushes nobody awaits, self keeps the connection
+  asio::awaitable<bool> flush(Pointer self);
+  // reads into _read_buffer, over a unix socket with recvmsg so descriptors
+  // sent along are kept in received_fds_
+  asio::awaitable<std::size_t> receive(asio::error_code &ec);
+#if defined(__linux__)
+  // maps the ring the server sent and lets the decoder read from it
+  void on_shm_ring(ShmRingInfo info);
+  /// Moves what the server wrote into the ring to the decoder.
+  /**
+   * Waits on the ring's eventfd only after announcing it in the ring, see
+   * shm-ring.hpp, until the server finished the track or closed.
+   */
+  asio::awaitable<void> read_shm(Pointer self);
+  // takes new bytes of the ring and tells the server what the decoder is
+  // done with
+  void sync_shm();
+#endif
 
   void handle();
+  // copies what fits into the player's buffer
+  std::size_t take_mp3(buffers_2<bytes_view> bytes);
   asio::io_context::strand &strand_;
-  asio::ip::tcp::socket _socket;
+  // TCP, or a unix socket
+  asio::generic::stream_protocol::socket _socket;
+  asio::steady_timer wake_;
   // FIX lifetime
   Mp3Stream &mp3_stream_;
+  // empty for the server's default track
+  std::string track_;
+  RangeRequest range_;
+  // only small control messages, one page is the smallest ring buffer
+  RingBuffer _write_buffer{4096, 1024, 2048};
+  RingBuffer _read_buffer{65535, 20000, 40000};
+  // the decoder left mp3 bytes in _read_buffer
+  bool mp3_full_{false};
+  std::string host_;
+  TrackCache *cache_;
+  // the copy of the track and its tag, until the server's tag differs or the
+  // copy played to its end
+  fhandle cached_{};
+  std::string cached_tag_{};
+  // sent by the server before the range, empty without capability::etag
+  std::string server_tag_{};
+  // keeps what the server streams from the start of the track
+  std::unique_ptr<TrackCacheWriter> cache_writer_{};
+  // the range request goes once the server's hello came
+  bool range_deferred_{false};
+  // offset in the track of the next mp3 byte for the player, and the size
+  // of the track, once the server's range came
+  std::uint64_t stream_pos_{0};
+  std::optional<std::uint64_t> total_{};
+  // of the first connection, a resumed one must stream the same track
+  std::string first_tag_{};
+  // the server refused the track or the player stopped it
+  bool refused_{false};
+  bool stopped_{false};
+  // failed attempts since the last range came
+  std::size_t reconnects_{0};
+  asio::steady_timer reconnect_timer_;
+  // where to connect again
+  asio::ip::tcp::resolver::results_type endpoints_{};
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+  asio::local::stream_protocol::endpoint local_endpoint_{};
+#endif
+  bool connected_{false};
+  bool writing_{false};
+  // over a unix socket the hello offers a shared memory ring
+  bool local_{false};
+  std::vector<int> received_fds_{};
+#if defined(__linux__)
+  std::unique_ptr<ShmRing> shm_ring_{};
+  // the ring's data ready eventfd
+  std::optional<asio::posix::stream_descriptor> shm_data_{};
+  // bytes of the current ring taken so far
+  std::uint64_t shm_seen_{0};
+  // a not full callback of the player's buffer is pending
+  bool shm_waiting_for_room_{false};
+#endif
   ClientEncoder _client_encoder{};
   ClientDecoder _client_decoder;
   DestructionSignaller _destruction_signaller{"TcpClientConnection"};
 };
 
+/// Plays a track streamed over UDP, see udp-stream.hpp.
+/**
+ * Packets go through a jitter buffer that reorders them and restores losses
+ * from parity, payloads are copied into the player's buffer as it has room.
+ */
+struct UdpClientConnection
+    : std::enable_shared_from_this<UdpClientConnection> {
+  using Pointer = std::shared_ptr<UdpClientConnection>;
+  static constexpr auto keepalive_interval = std::chrono::seconds(1);
+  // packets a loss waits for reordering or parity before it is given up
+  static constexpr std::size_t jitter_depth = 32;
+
+  static Pointer create(asio::io_context &io_context,
+                        asio::io_context::strand &strand,
+                        Mp3Stream &mp3_stream, std::string track,
+                        RangeRequest range);
+
+  void start(asio::ip::udp::endpoint server);
+  // tells the server and stops listening
+  void stop();
+
+private:
+  UdpClientConnection(asio::io_context &io_context,
+                      asio::io_context::strand &strand, Mp3Stream &mp3_stream,
+                      std::string track, RangeRequest range);
+
+  asio::awaitable<void> receive(Pointer self);
+  asio::awaitable<void> keepalive(Pointer self);
+  asio::awaitable<void> send(UdpRequestKind kind);
+  // moves what the player has room for out of the jitter buffer
+  void drain();
+
+  asio::io_context::strand &strand_;
+  asio::ip::udp::socket socket_;
+  asio::steady_timer keepalive_timer_;
+  Mp3Stream &mp3_stream_;
+  std::string track_;
+  RangeRequest range_;
+  // the server's answer to a request, sent back with the next
+  std::uint64_t cookie_{0};
+  JitterBuffer jitter_{jitter_depth};
+  // a not full callback of the player's buffer is pending
+  bool waiting_for_room_{false};
+  bool stopped_{false};
+  DestructionSignaller _destruction_signaller{"UdpClientConnection"};
+};
+
 struct AsioClient {
+  // tracks streamed over TCP or unix sockets are kept in cache, and played
+  // from it while the server confirms they did not change. null keeps none
   AsioClient(asio::io_context &io_context, asio::io_context::strand &strand,
-             Mp3Stream &mp3_stream);
-  void connect(std::string_view host);
+             Mp3Stream &mp3_stream, TrackCache *cache = nullptr);
+  // host "udp:name" streams over UDP, "unix:path" connects to a server on
+  // the same host through a unix socket
+  void connect(std::string_view host, std::string track = {},
+               RangeRequest range = {});
+  // to the last connection, dropped if it is gone. over UDP only stop is
+  // sent, the others are dropped
+  void send_control(Control control);
 
 private:
   asio::io_context &io_context_;
   asio::io_context::strand &strand_;
   Mp3Stream &mp3_stream_;
+  TrackCache *cache_;
   asio::ip::tcp::resolver resolver_;
+  asio::ip::udp::resolver udp_resolver_;
+  std::weak_ptr<TcpClientConnection> connection_;
+  std::weak_ptr<UdpClientConnection> udp_connection_;
 };
 
 } // namespace am
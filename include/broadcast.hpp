@@ -0,0 +1,95 @@
+#pragma once
+
+#include "catalog.hpp"
+#include "media-cache.hpp"
+#include "mp3-index.hpp"
+#include "util.hpp"
+
+#include <absl/functional/any_invocable.h>
+#include <asio.hpp>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace am {
+
+/// A run of whole frames of the live stream, about 100ms of audio.
+/**
+ * Points into the mapped track, owner keeps the bytes alive while listeners
+ * still send them after the chunk left the ring.
+ */
+struct BroadcastChunk {
+  std::uint64_t seq;
+  std::shared_ptr<const void> owner;
+  std::span<const char> bytes;
+  std::chrono::microseconds duration;
+};
+
+/// Radio channel playing the catalog in order, in a loop.
+/**
+ * One per worker io_context, so listeners and the producer never need a lock.
+ * Chunks are released in real time from a shared epoch, so channels of all
+ * workers are at the same position and number their chunks the same way.
+ * A listener is only a cursor into the ring of released chunks and sends each
+ * one straight from the mapped file.
+ */
+class Broadcast {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t ring_size = 128;
+  static constexpr auto chunk_duration = std::chrono::milliseconds(100);
+
+  Broadcast(asio::io_context &io_context, MediaCache &cache,
+            const Catalog &catalog, clock::time_point epoch);
+
+  // false if no track of the catalog can be broadcast. releases the chunks
+  // due by now, later ones are released as their time comes
+  bool start(clock::time_point now = clock::now());
+  void stop();
+
+  // next chunk to be released
+  std::uint64_t live_edge() const { return next_seq_; }
+  /// Where a new listener starts.
+  /**
+   * The live edge minus up to lead of released audio, so the listener's
+   * buffer fills right away. Always the start of a chunk, so of a frame.
+   */
+  std::uint64_t join_position(std::chrono::milliseconds lead) const;
+  // nullopt once the chunk left the ring or before it is released
+  std::optional<BroadcastChunk> chunk(std::uint64_t seq) const;
+  // on_released runs once the next chunk is released, dropped on stop
+  void wait(absl::AnyInvocable<void()> on_released);
+
+private:
+  struct Track {
+    std::shared_ptr<const MediaFile> file;
+    std::shared_ptr<const Mp3Index> index;
+    std::size_t frame{};
+  };
+
+  bool open_next_track();
+  BroadcastChunk next_chunk();
+  void schedule();
+  void release(clock::time_point now);
+
+  asio::io_context &io_context_;
+  MediaCache &cache_;
+  const Catalog &catalog_;
+  asio::steady_timer timer_;
+  clock::time_point next_release_;
+  std::uint32_t next_track_id_{0};
+  std::optional<Track> track_{};
+  std::vector<BroadcastChunk> ring_;
+  std::uint64_t next_seq_{0};
+  std::vector<absl::AnyInvocable<void()>> waiters_;
+  bool stopped_{true};
+  DestructionSignaller signaller_{"Broadcast"};
+};
+
+} // namespace am
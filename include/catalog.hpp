@@ -0,0 +1,46 @@
+#pragma once
+
+#include "media-cache.hpp"
+
+#include <absl/container/flat_hash_map.h>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace am {
+
+struct CatalogTrack {
+  std::uint32_t id;
+  // path relative to the library without the extension, "album/track"
+  std::string name;
+  fs::path path;
+};
+
+/// Tracks of a media library, scanned once at startup.
+/**
+ * Ids are positions in the sorted list of track paths, so they stay the same
+ * between restarts as long as the library does. Lookups by id or name never
+ * touch the disk.
+ */
+class Catalog {
+public:
+  // all .mp3 files under dir, recursively
+  static Catalog scan(const fs::path &dir);
+
+  // track named key, or with id key when key is a number, nullptr if none
+  const CatalogTrack *find(std::string_view key) const;
+  const CatalogTrack *by_id(std::uint32_t id) const;
+  const CatalogTrack *by_name(std::string_view name) const;
+
+  std::size_t size() const { return tracks_.size(); }
+  bool empty() const { return tracks_.empty(); }
+
+private:
+  std::vector<CatalogTrack> tracks_;
+  absl::flat_hash_map<std::string, std::uint32_t> by_name_;
+};
+
+} // namespace am
@@ -3,6 +3,9 @@
 #include "protocol.hpp"
 #include <absl/functional/any_invocable.h>
 #include <asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -14,19 +17,55 @@ using const_buffers = std::vector<asio::const_buffer>;
 using bytes_view = std::span<const char>;
 
 struct ClientDecoder : Decoder {
+  // the time, errors and tags are read whole, the buffer grows up to this
+  static constexpr std::size_t max_buffer_size = 1 << 20;
+
   ClientDecoder(absl::AnyInvocable<void(buffers_2<std::string_view>)> &&on_time,
-                absl::AnyInvocable<void(RingBuffer &)> &&on_mp3_bytes)
+                absl::AnyInvocable<void(RangeReply)> &&on_range,
+                absl::AnyInvocable<std::size_t(buffers_2<bytes_view>)>
+                    &&on_mp3_bytes,
+                absl::AnyInvocable<void(std::string)> &&on_error)
       : on_time_(std::move(on_time))
-      , on_mp3_bytes_(std::move(on_mp3_bytes)) {}
+      , on_range_(std::move(on_range))
+      , on_mp3_bytes_(std::move(on_mp3_bytes))
+      , on_error_(std::move(on_error)) {}
 
+  // mp3 bytes stay in state while on_mp3_bytes_ takes none of them. a
+  // message read whole but bigger than max_buffer_size fails the decoder
   void try_read_client(RingBuffer &state);
+  // a new connection to the server starts in v1, with no hello and nothing
+  // of a message read yet
+  void reset_connection();
+
+  // what the server's hello enabled
+  std::uint32_t _capabilities{};
+  // bytes of the current mp3 message taken so far
+  std::uint64_t _mp3_read{};
 
   absl::AnyInvocable<void(buffers_2<std::string_view>)> on_time_;
-  absl::AnyInvocable<void(RingBuffer &)> on_mp3_bytes_;
+  absl::AnyInvocable<void(RangeReply)> on_range_;
+  // returns how many of the bytes it took, from the front
+  absl::AnyInvocable<std::size_t(buffers_2<bytes_view>)> on_mp3_bytes_;
+  absl::AnyInvocable<void(std::string)> on_error_;
+  // rings are ignored without it
+  absl::AnyInvocable<void(ShmRingInfo)> on_shm_ring_{};
+  // the server's answer to the hello, once _version and _capabilities are set
+  absl::AnyInvocable<void()> on_hello_{};
+  // the tag of the track, ignored without it
+  absl::AnyInvocable<void(std::string)> on_etag_{};
 };
 
 struct ClientEncoder : Encoder {
+  // offers version and capabilities. a server that answers hellos speaks v2
+  // at least, so the encoder switches to v2 right after it
+  void fill_hello(Hello hello, RingBuffer &buff);
   void fill_message(std::string_view msg, RingBuffer &buff);
+  void fill_range_request(RangeRequest request, RingBuffer &buff);
+  void fill_control(Control control, RingBuffer &buff);
+  // track name or id, must come before the range request
+  void fill_track_request(std::string_view track, RingBuffer &buff);
+  // the tag of the client's copy of the track, before the range request
+  void fill_etag(std::string_view tag, RingBuffer &buff);
 };
 
 } // namespace am
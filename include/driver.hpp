@@ -3,16 +3,21 @@
 #include "asio-client.hpp"
 #include "audio-player.hpp"
 #include "protocol.hpp"
+#include "track-cache.hpp"
 #include <asio/executor.hpp>
 #include <asio/executor_work_guard.hpp>
 #include <asio/io_context.hpp>
 
+#include <chrono>
 #include <optional>
 
 namespace am {
 
 struct Song {
+  // catalog name or id, empty for the server's default track
   std::string name;
+  // where playback starts
+  std::chrono::milliseconds start{0};
 };
 
 class Driver {
@@ -27,6 +32,8 @@ private:
   asio::io_context::strand &strand_;
   asio::executor_work_guard<decltype(context_.get_executor())> work_guard_;
   std::string host_;
+  // tracks played before, none without a cache directory
+  std::optional<TrackCache> cache_{};
 
   Mp3Stream mp3_stream_;
   std::optional<AsioClient> asio_client_{};
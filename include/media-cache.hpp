@@ -0,0 +1,90 @@
+#pragma once
+
+#include "metrics.hpp"
+#include "util.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+namespace am {
+
+namespace fs = std::filesystem;
+
+struct file_deleter {
+  void operator()(std::FILE *fp) { std::fclose(fp); }
+};
+
+using fhandle = std::unique_ptr<std::FILE, file_deleter>;
+
+/// Read only media file shared by all streams of the same track.
+/**
+ * The file position of the underlying descriptor is never used, all reads are
+ * offset based, so one descriptor serves any number of concurrent streams.
+ * On posix the file is also mapped, so small reads are plain memcpy.
+ */
+struct MediaFile {
+  static std::shared_ptr<const MediaFile> open(const fs::path &filepath);
+
+  MediaFile(const MediaFile &) = delete;
+  MediaFile(MediaFile &&) = delete;
+  MediaFile &operator=(const MediaFile &) = delete;
+  MediaFile &operator=(MediaFile &&) = delete;
+  ~MediaFile();
+
+  std::size_t size() const { return size_; }
+  std::FILE *handle() const { return fd_.get(); }
+  const fs::path &path() const { return path_; }
+  // empty when the platform does not support mapping
+  std::span<const char> mapped() const { return {mapped_, mapped_size_}; }
+
+  // pread style read, returns bytes read, 0 at the end of file
+  std::size_t read_at(std::size_t offset, std::span<char> out) const;
+
+private:
+  MediaFile(fs::path path, fhandle fd, std::size_t size);
+
+  fs::path path_;
+  fhandle fd_;
+  std::size_t size_;
+  const char *mapped_{};
+  std::size_t mapped_size_{};
+};
+
+class Mp3Index;
+
+/// Process wide cache of open media files.
+/**
+ * Shared between server workers. Files stay open while some stream uses them
+ * and up to `capacity` idle files are kept open for the next listener.
+ * Frame indexes are cached the same way.
+ */
+struct MediaCache {
+  explicit MediaCache(std::size_t capacity = 64);
+
+  // nullptr if the file does not exist or can not be opened
+  std::shared_ptr<const MediaFile> get(const fs::path &filepath);
+  // frame index of file, loaded from its sidecar or built on first use,
+  // nullptr if file has no mp3 frames
+  std::shared_ptr<const Mp3Index> index(const MediaFile &file);
+
+  void log_stat();
+
+private:
+  void evict_idle_locked();
+
+  std::size_t capacity_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const MediaFile>> files_;
+  std::unordered_map<std::string, std::shared_ptr<const Mp3Index>> indexes_;
+  Metric<long> metric_hits_ = Metric<long>::create_counter("media cache hits");
+  Metric<long> metric_misses_ =
+      Metric<long>::create_counter("media cache misses");
+};
+
+} // namespace am
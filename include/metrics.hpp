@@ -1,8 +1,12 @@
 #pragma once
 
 #include <absl/strings/str_format.h>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <concepts>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <string>
 #include <string_view>
@@ -57,13 +61,73 @@ struct MetricSimpleValue {
   	}
 };
 
+/// Counts of values per power of two, for percentiles of latencies.
+/**
+ * Value v lands in bucket bit_width(v), which holds v up to 2^bucket - 1, so
+ * a percentile is known to within a factor of two. Negative values count as
+ * 0.
+ */
+template <std::integral T>
+struct MetricHistogramValue {
+	static constexpr std::size_t buckets = 65;
+
+	void add(T val) {
+		auto v = val > 0 ? static_cast<std::uint64_t>(val) : std::uint64_t{0};
+		counts_[std::bit_width(v)].fetch_add(1, std::memory_order_relaxed);
+		auto max = max_.load(std::memory_order_relaxed);
+		while (val > max && !max_.compare_exchange_weak(max, val, std::memory_order_relaxed)) {
+		}
+	}
+	void reset() {
+		for (auto &count : counts_) {
+			count.store(0, std::memory_order_relaxed);
+		}
+		max_.store(0, std::memory_order_relaxed);
+	}
+	std::uint64_t count() const {
+		std::uint64_t sum = 0;
+		for (auto &count : counts_) {
+			sum += count.load(std::memory_order_relaxed);
+		}
+		return sum;
+	}
+	// upper bound of the bucket holding the percent-th value, at most max
+	T percentile(double percent) const {
+		auto total = count();
+		if (total == 0) {
+			return 0;
+		}
+		auto rank = static_cast<std::uint64_t>(percent / 100 * static_cast<double>(total - 1)) + 1;
+		std::uint64_t seen = 0;
+		for (std::size_t bucket = 0; bucket < buckets; bucket++) {
+			seen += counts_[bucket].load(std::memory_order_relaxed);
+			if (seen >= rank) {
+				auto bound = bucket >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << bucket) - 1;
+				auto max = static_cast<std::uint64_t>(max_.load(std::memory_order_relaxed));
+				return static_cast<T>(bound < max ? bound : max);
+			}
+		}
+		return max_.load(std::memory_order_relaxed);
+	}
+	std::array<std::atomic<std::uint64_t>, buckets> counts_{};
+	std::atomic<T> max_{};
+
+	template <typename Sink>
+	friend void AbslStringify(Sink &sink, const MetricHistogramValue &metric) {
+		absl::Format(&sink, "p50 %v p90 %v p99 %v max %v (%v)", metric.percentile(50),
+			metric.percentile(90), metric.percentile(99),
+			metric.max_.load(std::memory_order_relaxed), metric.count());
+	}
+};
+
 template<class>
 inline constexpr bool always_false_v = false;
 
 template <std::integral T>
 struct Metric {
 
-	using Variants = std::variant<MetricAverageValue<T>, MetricSimpleValue<T>>;
+	using Variants = std::variant<MetricAverageValue<T>, MetricSimpleValue<T>,
+		MetricHistogramValue<T>>;
 	std::string name_;
 	Variants val_;
 	void add(T val) {
@@ -73,6 +137,8 @@ struct Metric {
 				arg.add(val);
 			} else if constexpr (std::is_same_v<V, MetricSimpleValue<T>>) {
 				arg.add(val);
+			} else if constexpr (std::is_same_v<V, MetricHistogramValue<T>>) {
+				arg.add(val);
 			} else {
 				static_assert(always_false_v<V>, "non-exhaustive visitor!");
 			}
@@ -85,6 +151,8 @@ struct Metric {
 				arg.reset();
 			} else if constexpr (std::is_same_v<V, MetricSimpleValue<T>>) {
 				arg.reset();
+			} else if constexpr (std::is_same_v<V, MetricHistogramValue<T>>) {
+				arg.reset();
 			} else {
 				static_assert(always_false_v<V>, "non-exhaustive visitor!");
 			}
@@ -98,6 +166,8 @@ struct Metric {
 				absl::Format(&sink, "metric: %s %v", metric.name_, std::get<MetricAverageValue<T>>(metric.val_));
 			} else if constexpr (std::is_same_v<V, MetricSimpleValue<T>>) {
 				absl::Format(&sink, "metric: %s %v", metric.name_, std::get<MetricSimpleValue<T>>(metric.val_));
+			} else if constexpr (std::is_same_v<V, MetricHistogramValue<T>>) {
+				absl::Format(&sink, "metric: %s %v", metric.name_, std::get<MetricHistogramValue<T>>(metric.val_));
 			} else {
 				static_assert(always_false_v<V>, "non-exhaustive visitor!");
 			}
@@ -111,6 +181,11 @@ struct Metric {
 		return {
 			std::string(name), Variants{std::in_place_type<MetricAverageValue<T>>}};
 	};
+
+	static Metric<T> create_histogram(std::string_view name) {
+		return {
+			std::string(name), Variants{std::in_place_type<MetricHistogramValue<T>>}};
+	};
 };
 
 } // namespace am
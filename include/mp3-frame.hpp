@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+namespace am {
+
+/// Fields of a MPEG audio frame header, enough to walk frames without
+/// decoding them.
+struct Mp3FrameHeader {
+  // 10 for MPEG 1, 20 for MPEG 2, 25 for MPEG 2.5
+  int version;
+  int layer;
+  int bitrate_kbps;
+  int sample_rate;
+  int channels;
+  int samples_per_frame;
+  std::size_t frame_bytes;
+
+  // bytes per second of audio at this frame's bitrate
+  std::size_t byte_rate() const { return bitrate_kbps * 1000u / 8; }
+  bool same_stream(const Mp3FrameHeader &other) const {
+    return version == other.version && layer == other.layer &&
+           sample_rate == other.sample_rate;
+  }
+};
+
+// parses 4 header bytes, nullopt for anything that is not a valid frame
+// header, including free format frames
+std::optional<Mp3FrameHeader> parse_frame_header(std::span<const char> bytes);
+
+// size of the ID3v2 tag at the start of data, 0 if there is none
+std::size_t id3v2_size(std::span<const char> data);
+
+/// Offset of the first frame at or after from.
+/**
+ * A sync word only counts if the frame it describes is followed by another
+ * header of the same stream, or by the end of data, so sync bytes inside
+ * audio data or tags are skipped.
+ */
+std::optional<std::size_t> find_frame(std::span<const char> data,
+                                      std::size_t from);
+
+/// Frame count of a Xing/Info or VBRI header in the frame starting at data.
+/**
+ * Encoders put these headers in an otherwise silent first frame. nullopt when
+ * the frame is a regular audio frame, 0 when the header has no frame count.
+ */
+std::optional<std::uint32_t> vbr_header_frames(std::span<const char> frame,
+                                               const Mp3FrameHeader &header);
+
+} // namespace am
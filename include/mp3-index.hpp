@@ -0,0 +1,119 @@
+#pragma once
+
+#include "media-cache.hpp"
+#include "util.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace am {
+
+struct Mp3IndexEntry {
+  std::uint64_t offset;
+  std::uint32_t frame_bytes;
+  std::uint16_t bitrate_kbps;
+  std::uint16_t samples;
+};
+
+/// The version of a track on disk an index was built from.
+/**
+ * Size and mtime change with ordinary edits. A copy keeping the times, like
+ * cp -p, or a rewrite within the mtime's resolution still changes the ctime,
+ * and replacing the file changes the inode. Times are nanoseconds, ctime and
+ * inode are 0 where the platform does not report them.
+ */
+struct Mp3IndexSource {
+  std::uint64_t size;
+  std::int64_t mtime;
+  std::int64_t ctime;
+  std::uint64_t inode;
+
+  static Mp3IndexSource of(const fs::path &track, std::uint64_t size);
+  bool operator==(const Mp3IndexSource &) const = default;
+};
+
+/// Sidecar file layout, the header is followed by frame_count entries.
+struct Mp3IndexHeader {
+  static constexpr std::uint32_t current_version = 3;
+
+  char magic[4];
+  std::uint32_t version;
+  // the track the index was built from, a mismatch means it is stale
+  Mp3IndexSource source;
+  std::uint32_t sample_rate;
+  std::uint32_t samples_per_frame;
+  std::uint64_t frame_count;
+  // of the whole track, hashed during the same scan
+  ContentHash::Digest content_hash;
+};
+
+/// Offsets of every audio frame of a track.
+/**
+ * Built by walking frame headers once, without decoding. A Xing/Info or VBRI
+ * frame is metadata, it is left out of the index and its frame count is only
+ * used to cross check the scan. Saved next to the track as a sidecar that is
+ * mapped on the next start instead of scanning again.
+ *
+ * All frames of one stream have the same number of samples, so mapping a
+ * time to a frame is a division.
+ */
+class Mp3Index {
+public:
+  // nullopt if file has no frames
+  static std::optional<Mp3Index> build(const MediaFile &file,
+                                       const Mp3IndexSource &source);
+  // nullopt if the sidecar is missing, corrupt or built from another source
+  static std::optional<Mp3Index> load(const fs::path &sidecar,
+                                      const Mp3IndexSource &source);
+  /// Loads the sidecar of track, scans and writes it when that fails.
+  /**
+   * A sidecar that can not be written, for example in a read only library,
+   * is not an error, the index then lives in memory only.
+   */
+  static std::optional<Mp3Index> load_or_build(const MediaFile &track);
+
+  Mp3Index(Mp3Index &&) = default;
+  Mp3Index &operator=(Mp3Index &&) = default;
+  Mp3Index(const Mp3Index &) = delete;
+  Mp3Index &operator=(const Mp3Index &) = delete;
+
+  static fs::path sidecar_path(const fs::path &track);
+
+  bool write(const fs::path &sidecar) const;
+
+  std::span<const Mp3IndexEntry> entries() const { return entries_; }
+  std::size_t frame_count() const { return entries_.size(); }
+  std::uint32_t sample_rate() const { return header_.sample_rate; }
+  std::size_t audio_start() const { return entries_.front().offset; }
+  std::size_t audio_end() const;
+  std::chrono::milliseconds duration() const;
+  // average over the whole track, the right rate for pacing vbr files
+  std::size_t byte_rate() const;
+  // ContentHash tag of the track
+  std::string etag() const;
+
+  // offset of the frame playing at offset, audio_end() past the last one
+  std::size_t byte_at_time(std::chrono::milliseconds offset) const;
+  // offset of the first frame at or after offset, audio_end() if none
+  std::size_t frame_at_byte(std::size_t offset) const;
+
+private:
+  Mp3Index(Mp3IndexHeader header, std::vector<Mp3IndexEntry> entries);
+  Mp3Index(Mp3IndexHeader header, std::shared_ptr<const MediaFile> sidecar,
+           std::span<const Mp3IndexEntry> entries);
+
+  Mp3IndexHeader header_;
+  // either owns the entries or keeps the mapped sidecar alive
+  std::vector<Mp3IndexEntry> owned_;
+  std::shared_ptr<const MediaFile> sidecar_;
+  std::span<const Mp3IndexEntry> entries_;
+};
+
+} // namespace am
@@ -1,11 +1,14 @@
 #pragma once
 
+#include "media-cache.hpp"
+#include "metrics.hpp"
 #include "util.hpp"
 #include <absl/functional/any_invocable.h>
 #include <asio.hpp>
-#include <asio/ip/tcp.hpp>
+#include <asio/generic/stream_protocol.hpp>
 #include <cstddef>
 #include <cstdio>
+#include <memory>
 
 #if defined(__linux__) || defined(__APPLE__)
 #  include <sys/types.h>
@@ -21,6 +24,18 @@ namespace am {
 struct SendFilePosix {
   void cancel(){}
 };
+#  if defined(__linux__)
+struct UringSendService;
+struct UringSendOp;
+
+struct SendFileUring {
+  void cancel();
+
+  UringSendService *service_{};
+  // in flight send, owned by the service
+  UringSendOp *op_{};
+};
+#  endif
 #elif defined(_WIN32) || defined(_WIN64)
 struct SendFileWin {
   SendFileWin() = default;
@@ -38,18 +53,47 @@ struct SendFileWin {
 };
 #endif
 
+// server connections, TCP or a unix socket from the same host
+using StreamSocket = asio::generic::stream_protocol::socket;
+
 struct SendFile;
 using OnChunkSent =
     absl::AnyInvocable<void(std::size_t bytes_left, SendFile &inprogress)>;
 struct SendFile {
-  SendFile(asio::io_context &io_context, asio::ip::tcp::socket &socket,
-           std::FILE *file, std::size_t size, OnChunkSent &&on_chunk_sent);
-  void call();
+  /// Syscall family moving file bytes to sockets, picked once at startup.
+  /**
+   * io_uring sends from the mapped file, batching submissions of all
+   * connections of an io_context. It falls back to sendfile when the kernel
+   * or the file does not support it.
+   */
+  enum class Backend { sendfile, io_uring };
+  // bytes per io_uring send, the socket buffer takes what it can anyway
+  static constexpr std::size_t uring_chunk_size = 1 << 20;
+  static void set_backend(Backend backend);
+  static Backend backend();
+
+  // sends file from offset to its end
+  SendFile(asio::io_context &io_context, StreamSocket &socket,
+           std::shared_ptr<const MediaFile> file, std::size_t offset,
+           OnChunkSent &&on_chunk_sent);
+  SendFile(const SendFile &) = delete;
+  SendFile &operator=(const SendFile &) = delete;
+  ~SendFile();
+  // sends at most max_len bytes, reports through on_chunk_sent
+  void call(std::size_t max_len = unlimited);
   void cancel();
+
+  static constexpr std::size_t unlimited = static_cast<std::size_t>(-1);
 private:
+  void call_sendfile(std::size_t max_len);
+#if defined(__linux__)
+  friend struct UringSendService;
+  void on_uring_sent(int res);
+#endif
+
   asio::io_context &io_context_;
-  asio::ip::tcp::socket &socket_;
-  std::FILE *file_;
+  StreamSocket &socket_;
+  std::shared_ptr<const MediaFile> file_;
   std::size_t cur_;
   std::size_t size_;
   OnChunkSent on_chunk_sent_;
@@ -57,8 +101,22 @@ private:
   SendFilePosix platform_{};
 #elif defined(_WIN32) || defined(_WIN64)
   SendFileWin platform_{};
+#endif
+#if defined(__linux__)
+  SendFileUring uring_{};
 #endif
   DestructionSignaller sigaller_{"SendFile"};
 };
 
+/// Bytes and syscalls of all SendFile backends, to compare syscalls per GB.
+struct SendFileStats {
+  static SendFileStats &instance();
+
+  void add(long syscalls, long bytes);
+  void log_stat();
+
+  Metric<long> metric_syscalls_ = Metric<long>::create_counter("send syscalls");
+  Metric<long> metric_bytes_ = Metric<long>::create_counter("send bytes");
+};
+
 } // namespace am
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "media-cache.hpp"
+#include "mp3-index.hpp"
 #include "mp3-system.hpp"
 #include "util.hpp"
 #include <absl/functional/any_invocable.h>
@@ -7,38 +9,66 @@
 #include <asio.hpp>
 #include <asio/error_code.hpp>
 #include <asio/io_context.hpp>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <filesystem>
 #include <memory>
 #include <optional>
+#include <span>
 
 namespace am {
 
-namespace fs = std::filesystem;
-
-struct file_deleter {
-  void operator()(std::FILE *fp) { std::fclose(fp); }
-};
-
-using fhandle = std::unique_ptr<std::FILE, file_deleter>;
-
 struct Mp3 {
 
-  static Mp3 create(fs::path filepath);
+  // nullopt if the file can not be opened
+  static std::optional<Mp3> create(MediaCache &cache, fs::path filepath);
   std::size_t size() const;
-  bool send(asio::io_context &io_context, const asio::ip::tcp::socket &socket,
-            OnChunkSent &&on_chunk_sent);
+  // average bytes per second, from the first frame when there is no index,
+  // 0 if no frame was found
+  std::size_t byte_rate() const { return byte_rate_; }
+  // offset of the first audio frame, after the ID3v2 tag
+  std::size_t audio_start() const { return audio_start_; }
+  // 0 when the track could not be indexed
+  std::chrono::milliseconds duration() const;
+  // ContentHash tag from the index, empty when the track could not be indexed
+  std::string etag() const;
+
+  /// Frame aligned offset to stream from when asked to start at offset.
+  /**
+   * 0 stays 0 so the whole file, tags included, is sent. Anything inside the
+   * tag moves to the first frame, anything else to the next frame header at
+   * or after offset. Offsets past the end give size().
+   */
+  std::size_t frame_at_byte(std::size_t offset) const;
+  // same for a time offset, exact with an index, estimated from the bitrate
+  // of the first frame without one
+  std::size_t frame_at_time(std::chrono::milliseconds offset) const;
+
+  // starts sending from offset with at most first_chunk bytes, the rest is
+  // driven by on_chunk_sent
+  bool send(asio::io_context &io_context, const StreamSocket &socket,
+            OnChunkSent &&on_chunk_sent, std::size_t offset = 0,
+            std::size_t first_chunk = SendFile::unlimited);
+  const MediaFile &file() const { return *file_; }
+  // copies bytes from offset into out, how many, 0 at the end of the file
+  std::size_t read_at(std::size_t offset, std::span<char> out) const;
   void precancel();
   void cancel();
 
 private:
-  Mp3(fhandle fd, size_t size)
-      : fd_(std::move(fd))
-      , size_(size){};
+  Mp3(std::shared_ptr<const MediaFile> file,
+      std::shared_ptr<const Mp3Index> index, std::size_t audio_start,
+      std::size_t byte_rate)
+      : file_(std::move(file))
+      , index_(std::move(index))
+      , audio_start_(audio_start)
+      , byte_rate_(byte_rate){};
 
-  fhandle fd_;
-  std::size_t size_;
+  std::shared_ptr<const MediaFile> file_;
+  std::shared_ptr<const Mp3Index> index_;
+  std::size_t audio_start_;
+  std::size_t byte_rate_;
   bool _started{false};
   std::unique_ptr<SendFile> send_file_{};
   DestructionSignaller signaller_{"Mp3"};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+
+namespace am {
+
+enum class PacingMode {
+  // send as fast as the socket takes it
+  off,
+  // send at the track bitrate plus a lead, driven by a timer
+  app,
+  // leave it to the kernel through SO_MAX_PACING_RATE, linux only
+  kernel
+};
+
+struct PacingOptions {
+  PacingMode mode = PacingMode::off;
+  // audio sent ahead of real time, lets clients fill their buffers quickly
+  std::chrono::milliseconds lead{2000};
+  // percent above the bitrate we may send at, covers vbr and clock drift
+  int margin_percent = 5;
+};
+
+/// Keeps a stream at most lead ahead of real time playback.
+struct Pacer {
+  using clock = std::chrono::steady_clock;
+
+  Pacer(std::size_t byte_rate, const PacingOptions &options,
+        clock::time_point start = clock::now());
+
+  // bytes that may be sent at now, given sent bytes were sent already
+  std::size_t allowance(std::size_t sent, clock::time_point now) const;
+  // when another chunk_size bytes can be sent
+  clock::time_point ready_at(std::size_t sent) const;
+  // smallest send worth waking up for, 100ms of audio but at least 4 KiB.
+  // 100ms only above 40960 B/s, 327.68 kbit/s, so mp3 streams, 320 kbit/s
+  // at most, always get 4 KiB: 256ms at 128 kbit/s, 102ms at 320 kbit/s
+  std::size_t chunk_size() const { return chunk_size_; }
+  // time between pause and resume does not count as played
+  void pause(clock::time_point now);
+  void resume(clock::time_point now);
+
+private:
+  double bytes_per_second_;
+  std::size_t lead_bytes_;
+  std::size_t chunk_size_;
+  clock::time_point start_;
+  std::optional<clock::time_point> paused_at_{};
+};
+
+} // namespace am
@@ -1,26 +1,91 @@
 #pragma once
 
+#include "metrics.hpp"
+
 #include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 namespace am {
 
+struct LinearMemInfo;
+struct LinearMemRecycler;
+// returns the mapping to LinearMemPool instead of unmapping it
+using LinearMemHandle = std::unique_ptr<LinearMemInfo, LinearMemRecycler>;
+
+/// Two adjacent views of the same memory, so ring buffer data is linear.
+/**
+ * On linux backed by memfd_create, on mac by
+ * posix shm, on windows by a pagefile backed file mapping. A shared mapping
+ * keeps its descriptor, so another process can map the same memory.
+ */
 struct LinearMemInfo {
-  LinearMemInfo(std::size_t);
+  LinearMemInfo(std::size_t, bool shared = false);
+#if defined(__APPLE__) || defined(__linux__)
+  // maps len bytes of fd, memory another process shared, and owns fd.
+  // nullptr if it can not be mapped
+  static LinearMemHandle map_shared(int fd, std::size_t len);
+#endif
   ~LinearMemInfo();
   LinearMemInfo(const LinearMemInfo &) = delete;
   LinearMemInfo(LinearMemInfo &&) = delete;
   LinearMemInfo &operator=(const LinearMemInfo &) = delete;
   LinearMemInfo &operator=(LinearMemInfo &&) = delete;
 
-  int init(std::size_t);
+  int init(std::size_t, bool shared);
+  int map_mirrored(int fd, std::size_t len);
 
   int res_{};
   std::string shname_{};
   void *file_handle_{};
   char *p1_{};
   char *p2_{};
+  // open while the mapping is shared, -1 otherwise
+  int fd_{-1};
 
   std::size_t len_{};
+
+private:
+  LinearMemInfo() = default;
+};
+
+struct LinearMemRecycler {
+  void operator()(LinearMemInfo *info) const;
+};
+
+/// Process wide free lists of ready to use mirrored mappings.
+/**
+ * Creating a LinearMemInfo costs memfd_create, ftruncate and three mmaps, so
+ * released mappings are kept per size class and handed out again, except
+ * shared ones, another process may still write to them. Size
+ * classes are power of two multiples of the page size, idle mappings are
+ * kept up to max_idle_bytes in total.
+ */
+struct LinearMemPool {
+  static constexpr std::size_t max_idle_bytes = 256u << 20;
+
+  static LinearMemPool &instance();
+  static std::size_t size_class(std::size_t minsize);
+
+  LinearMemHandle acquire(std::size_t minsize);
+  void release(LinearMemInfo *info);
+
+  long hits() const;
+  long misses() const;
+  void log_stat();
+
+private:
+  LinearMemPool() = default;
+
+  std::mutex mutex_;
+  // keyed by size
+  std::map<std::size_t, std::vector<std::unique_ptr<LinearMemInfo>>> free_;
+  std::size_t idle_bytes_{};
+  Metric<long> metric_hits_ = Metric<long>::create_counter("linear mem pool hits");
+  Metric<long> metric_misses_ =
+      Metric<long>::create_counter("linear mem pool misses");
 };
 
 std::size_t system_page_size();
@@ -10,6 +10,7 @@
 #include <asio/buffer.hpp>
 #include <asio/error_code.hpp>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <functional>
@@ -24,9 +25,47 @@
 Protocol:
 
 client connects
-server sends time
-client asks to send offset
-server sends mp3 offset
+client may say hello (9) with the newest version and the capabilities it has
+server sends time (1), a hello gets the server's hello first, picking the
+version and capabilities both have, then time in that version
+client may pick a track by name or id (6), or gets the default one
+client asks to send offset (4)
+server sends the frame aligned offset it starts from (5)
+server sends mp3 from offset (2)
+
+a broadcast server ignores track requests and offsets, its mp3 (2) announces
+INT_MAX bytes and runs until the connection closes
+
+clients may send their requests right after connecting, without waiting for
+the time. requests already there when the server accepts, sent with the SYN
+by TCP Fast Open for one, get the time, offset and first mp3 bytes in one
+flight
+
+clients may send text messages (3) and control messages (8) at any time,
+the server reads them while it streams. pause holds the stream until resume,
+a buffer level tells how much audio the client holds so the server sends no
+further ahead than its lead, stop ends the stream and the connection. a seek
+before the stream started works as a range request in milliseconds
+server sends an error (7) before closing a connection it can not serve
+
+both hellos go in v1 framing, everything after them in the picked version.
+clients without a hello stay in v1, and get an error for tracks past 2GiB
+
+with chunked mp3 the server sends no mp3 (2), the offset (5) is followed by
+mp3 chunks (10) of up to 64KiB and a zero size chunk ends the track. other
+messages may come between chunks, and a seek while streaming answers with
+a new offset (5) and continues the chunks from there
+
+with a shared memory ring the offset (5) is followed by the ring (11), mp3
+bytes go through the ring and the connection only carries control messages.
+the server marks the ring finished at the end of the track. a seek while
+streaming is not supported
+
+with etags the server sends the tag of the track (12), a hash of its bytes,
+right before the offset (5). a client that kept a copy of the track sends
+the copy's tag (12) before its range request, and waits for the server's
+hello to do so. when the tags match the offset is all the server sends, it
+closes and the client plays its copy from there
 
  */
 
@@ -84,6 +123,7 @@ private:
 
 struct LinnearArray {
   LinnearArray(std::size_t size);
+  explicit LinnearArray(LinearMemHandle mapped);
   std::size_t size() const;
   inline char &at(std::size_t pos) { return *(ptr_ + pos); }
   inline const char &at(std::size_t pos) const { return *(ptr_ + pos); }
@@ -96,7 +136,8 @@ struct LinnearArray {
 private:
   char *ptr_;
   std::size_t len_;
-  LinearMemInfo mapped_;
+  // recycled through LinearMemPool, ring buffers can swap in a bigger one
+  LinearMemHandle mapped_;
 };
 
 struct Channel;
@@ -110,6 +151,23 @@ struct RingBuffer {
 
   void reset();
 
+  /// Grow the buffer to hold at least size bytes, keeping the filled sequence.
+  /**
+   * Capacity only grows, a smaller size is a no op. Filled sequence is moved
+   * to the start of the new buffer, so all views taken before are invalid.
+   */
+  void reserve(std::size_t size);
+  std::size_t capacity() const;
+
+  /// Makes mapped the buffer, keeping the filled sequence.
+  /**
+   * The filled sequence is copied to the end of mapped, so the nonfilled
+   * sequence starts at position 0. A writer that counts its bytes from 0,
+   * like the other side of a shared memory ring, writes at its count modulo
+   * capacity. Filled sequence must fit in mapped.
+   */
+  void adopt(LinearMemHandle mapped);
+
   /// Reduce filled sequence by marking first size bytes of filled sequence as
   /// nonfilled sequence.
   /**
@@ -154,6 +212,7 @@ struct RingBuffer {
   }
 
   void check(int len, std::string_view method) const;
+  void check_write(std::size_t len, std::string_view method) const;
   inline char char_at(std::size_t pos) const;
   int peek_int() const;
   buffers_2<std::string_view> peek_string_view(int len) const;
@@ -193,24 +252,160 @@ struct Channel {
 };
 
 
+/// Layout of envelopes and message fields on the wire.
+/**
+ * v1 sends the envelope as two host order ints and message fields as host
+ * order ints, so sizes and offsets end at INT_MAX. v2 sends the envelope as
+ * two LEB128 varints, the type and the size, and message fields as little
+ * endian ints, with sizes and offsets 64 bit. Every connection starts in v1,
+ * the hello (9) moves both sides to the version they agree on.
+ */
+enum class WireVersion : std::uint32_t { v1 = 1, v2 = 2 };
+
+// newest version this build speaks
+inline constexpr WireVersion wire_version_latest = WireVersion::v2;
+
+// optional features offered in the hello, a connection uses the ones both
+// sides offered
+namespace capability {
+// time (1) is microseconds since the unix epoch instead of ctime text
+inline constexpr std::uint32_t binary_time = 1u << 0;
+// mp3 comes in chunks (10) instead of one message (2)
+inline constexpr std::uint32_t chunked_mp3 = 1u << 1;
+// mp3 goes through a ring in shared memory (11) instead of the connection,
+// for clients on a unix socket, see shm-ring.hpp
+inline constexpr std::uint32_t shm_ring = 1u << 2;
+// tracks are tagged with their ContentHash (12), clients keep copies by it
+inline constexpr std::uint32_t etag = 1u << 3;
+} // namespace capability
+
+inline constexpr std::uint32_t capabilities_supported =
+    capability::binary_time | capability::chunked_mp3 | capability::etag
+#if defined(__linux__)
+    | capability::shm_ring
+#endif
+    ;
+
+// biggest mp3 chunk the server sends, one sendfile range
+inline constexpr std::size_t mp3_chunk_max_size = 64 * 1024;
+
+// bytes of a size or offset field
+constexpr std::size_t size_field_bytes(WireVersion version) {
+  return version == WireVersion::v1 ? 4 : 8;
+}
+
+// v1 envelope bytes, a v2 envelope takes 2 to 15
+inline constexpr std::size_t envelope_v1_size = 8;
+
 struct Envelope {
   void log();
   int message_type;
-  int message_size;
+  std::uint64_t message_size;
 };
 
-enum class DecoderState { before_envelope = 0, have_envelope };
+// message type 9, sent in v1 framing with little endian fields by both sides,
+// the client's offer first and the server's choice back
+struct Hello {
+  static constexpr std::size_t wire_size = 8;
+  WireVersion version;
+  std::uint32_t capabilities;
+};
+
+enum class RangeUnit : int { bytes = 0, milliseconds = 1 };
+
+// message type 4, where the client wants the stream to start
+struct RangeRequest {
+  static constexpr std::size_t wire_size(WireVersion version) {
+    return 4 + size_field_bytes(version);
+  }
+  RangeUnit unit;
+  std::uint64_t offset;
+};
+
+// message type 5, where the stream actually starts, on a frame boundary
+struct RangeReply {
+  static constexpr std::size_t wire_size(WireVersion version) {
+    return 2 * size_field_bytes(version) + 4;
+  }
+  std::uint64_t start;
+  std::uint64_t total;
+  // length of the track, 0 if the server could not index it
+  int duration_ms;
+};
+
+enum class ControlCommand : int {
+  pause = 0,
+  resume = 1,
+  // value is where to continue from, in milliseconds
+  seek = 2,
+  // value is the audio the client holds, in milliseconds
+  buffer_level = 3,
+  stop = 4
+};
+
+// message type 11, server to client with the ring's descriptors attached,
+// only in v2
+struct ShmRingInfo {
+  static constexpr std::size_t wire_size = 8;
+  // bytes of the ring
+  std::uint64_t size;
+};
+
+// message type 8, client's playback state while streaming
+struct Control {
+  static constexpr std::size_t wire_size = 8;
+  ControlCommand command;
+  int value;
+};
+
+// writes message fields laid out for a wire version
+struct FieldWriter {
+  void put_int(std::int32_t value);
+  void put_u32(std::uint32_t value);
+  // an int in v1, the caller checks it fits
+  void put_size(std::uint64_t value);
+
+  WireVersion version;
+  RingBuffer &buff;
+};
+
+// reads message fields laid out for a wire version, the caller checks the
+// whole message is ready
+struct FieldReader {
+  std::int32_t get_int();
+  std::uint32_t get_u32();
+  std::uint64_t get_size();
+
+  WireVersion version;
+  RingBuffer &buff;
+};
+
+enum class DecoderState { before_envelope = 0, have_envelope, failed };
 
 struct Decoder {
   DecoderState _state{};
   Envelope _envelope{};
+  WireVersion _version{WireVersion::v1};
 
+  // false until a whole envelope is read, or for good once the stream is
+  // malformed, see failed()
   bool try_read(RingBuffer &state);
+  bool failed() const;
   void reset();
+  FieldReader fields(RingBuffer &state);
 };
 
 struct Encoder {
-  void fill_envelope(Envelope envelope, RingBuffer &buff);
+  WireVersion _version{WireVersion::v1};
+
+  // the most bytes fill_envelope writes, a v2 varint type and size
+  static constexpr std::size_t max_envelope_size = 5 + 10;
+
+  // false, writing nothing, if message_size does not fit the version
+  bool fill_envelope(Envelope envelope, RingBuffer &buff);
+  FieldWriter fields(RingBuffer &buff);
+  // grows buff, if needed, so a message of size bytes and its envelope fit
+  void reserve_message(std::size_t size, RingBuffer &buff);
 };
 
 class infinite_timer {
@@ -4,21 +4,66 @@
 #include "protocol.hpp"
 #include <asio.hpp>
 #include <asio/buffer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
 
 namespace am {
 
 struct ServerDecoder : Decoder {
+  // track names are paths in the media directory, tags are a lot shorter
+  static constexpr std::size_t max_name_size = 4096;
+
   ServerDecoder(
-      absl::AnyInvocable<void(buffers_2<std::string_view>)> on_message)
-      : on_message_(std::move(on_message)) {}
+      absl::AnyInvocable<void(buffers_2<std::string_view>)> on_message,
+      absl::AnyInvocable<void(std::string)> on_track_request,
+      absl::AnyInvocable<void(RangeRequest)> on_range_request,
+      absl::AnyInvocable<void(Control)> on_control,
+      absl::AnyInvocable<void(Hello)> on_hello, std::size_t max_buffer_size)
+      : on_message_(std::move(on_message))
+      , on_track_request_(std::move(on_track_request))
+      , on_range_request_(std::move(on_range_request))
+      , on_control_(std::move(on_control))
+      , on_hello_(std::move(on_hello))
+      , max_buffer_size_(max_buffer_size) {}
 
-  void try_read_server(RingBuffer &state);
+  // grows state when the announced message does not fit in it, returns false
+  // if the client announced a message bigger than max_buffer_size, a track
+  // name or tag bigger than max_name_size, or sent a message type it should
+  // not. after a hello the decoder reads the version
+  // it answers with, on_hello_ gets that answer
+  bool try_read_server(RingBuffer &state);
   absl::AnyInvocable<void(buffers_2<std::string_view>)> on_message_;
+  absl::AnyInvocable<void(std::string)> on_track_request_;
+  absl::AnyInvocable<void(RangeRequest)> on_range_request_;
+  absl::AnyInvocable<void(Control)> on_control_;
+  absl::AnyInvocable<void(Hello)> on_hello_;
+  std::size_t max_buffer_size_;
+  // the tag of the client's copy of the track, ignored without it
+  absl::AnyInvocable<void(std::string)> on_etag_{};
 };
 
+// fill functions returning bool write nothing and return false when the
+// message does not fit the wire version
 struct ServerEncoder : Encoder {
 
+  // answer to the client's hello, the encoder speaks its version after it
+  void fill_hello(Hello hello, RingBuffer &buff);
   void fill_time(std::string_view time, RingBuffer &buf);
-  void fill_mp3(Mp3 &file, RingBuffer &buff);
+  // for clients with capability::binary_time
+  void fill_time(std::chrono::system_clock::time_point time, RingBuffer &buff);
+  bool fill_range(RangeReply range, RingBuffer &buff);
+  void fill_error(std::string_view error, RingBuffer &buff);
+  // envelope for the mp3 bytes from start to the end of file
+  bool fill_mp3(Mp3 &file, std::size_t start, RingBuffer &buff);
+  // envelope for a broadcast, it has no end
+  void fill_live_mp3(RingBuffer &buff);
+  // envelope for the next size bytes of mp3, 0 ends the track
+  void fill_mp3_chunk(std::size_t size, RingBuffer &buff);
+  // the ring's descriptors go along with the first byte of the message
+  void fill_shm_ring(ShmRingInfo ring, RingBuffer &buff);
+  // the track's tag, for clients with capability::etag
+  void fill_etag(std::string_view tag, RingBuffer &buff);
 };
 } // namespace am
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "protocol-system.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+/*
+
+Shared memory transport:
+
+a client on a unix socket offers capability::shm_ring in its hello. the
+server answers the range request with the offset (5) as usual, then sends a
+ring (11) with four descriptors attached: the ring's memory, its control
+block and two eventfds. mp3 bytes go into the ring from then on, the
+connection only carries control messages
+
+the ring is a mirrored mapping like every RingBuffer, the client's input
+channel adopts it and the decoder reads the server's bytes in place. both
+sides count bytes from 0, the server what it wrote, the client what it is
+done with. a side that has to wait says so in the control block and waits on
+its eventfd, the other side writes the eventfd only then, so a stream that
+keeps up costs no syscalls besides the reads of the file
+
+ */
+
+namespace am {
+
+// lives in its own page shared by both processes
+struct ShmRingControl {
+  // bytes the server wrote so far
+  std::atomic<std::uint64_t> written{0};
+  // bytes the client is done with, the server writes no further than
+  // read plus the ring size
+  std::atomic<std::uint64_t> read{0};
+  std::atomic<std::uint32_t> reader_waiting{0};
+  std::atomic<std::uint32_t> writer_waiting{0};
+  // the client mapped the ring and set read, nothing is written before
+  std::atomic<std::uint32_t> attached{0};
+  // written is the end of the track
+  std::atomic<std::uint32_t> finished{0};
+};
+
+/// One writer, one reader ring in memory shared with another process.
+/**
+ * The server creates it and passes fds() over the unix socket, the client
+ * opens it from the descriptors it received. Positions are only published
+ * through the control block, with sequentially consistent atomics, so a
+ * side that checks again after announcing it waits never misses the
+ * other's wakeup.
+ */
+class ShmRing {
+public:
+  static constexpr std::size_t default_size = 256 * 1024;
+  // memory, control block, data ready eventfd, space ready eventfd
+  using Fds = std::array<int, 4>;
+
+  // nullptr where there is no memfd or eventfd
+  static std::unique_ptr<ShmRing> create(std::size_t size);
+  // takes ownership of fds, nullptr if they are not a ring of size bytes
+  static std::unique_ptr<ShmRing> open(Fds fds, std::size_t size);
+
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+  ~ShmRing();
+
+  // still owned by the ring
+  Fds fds() const;
+  std::size_t size() const { return size_; }
+  // readable once the writer wrote or finished while the reader waited
+  int data_ready_fd() const { return data_ready_; }
+  // readable once the reader attached or read while the writer waited
+  int space_ready_fd() const { return space_ready_; }
+  // clears an eventfd that woke its waiter
+  static void drain_eventfd(int fd);
+
+  // writer side
+
+  // the reader released for the first time
+  bool attached() const;
+  // 0 until the reader attached
+  std::size_t writable() const;
+  // writable() bytes at the write position, linear through the mirror
+  std::span<char> write_span();
+  // publishes len written bytes and wakes a waiting reader
+  void commit_write(std::size_t len);
+  // nothing more comes, wakes a waiting reader
+  void finish();
+  // false if space showed up meanwhile, true if the writer waits for
+  // space_ready_fd()
+  bool writer_wait();
+
+  // reader side
+
+  std::uint64_t written() const;
+  bool finished() const;
+  // the reader is done with everything before read, attaches on the first
+  // call and wakes a waiting writer
+  void release(std::uint64_t read);
+  // false if more than seen was written or the ring finished meanwhile,
+  // true if the reader waits for data_ready_fd()
+  bool reader_wait(std::uint64_t seen);
+  // the ring's memory, for the reader's RingBuffer to adopt, see
+  // RingBuffer::adopt
+  LinearMemHandle take_data();
+
+private:
+  ShmRing() = default;
+
+  std::size_t size_{};
+  LinearMemHandle data_{};
+  int control_fd_{-1};
+  ShmRingControl *control_{};
+  int data_ready_{-1};
+  int space_ready_{-1};
+};
+
+// sendmsg of bytes with fds attached, what was sent or -1 with errno set
+long send_with_fds(int socket, std::span<const char> bytes,
+                   std::span<const int> fds);
+// recvmsg into out, descriptors that came along are appended to fds. what
+// was read, 0 at the end of the stream or -1 with errno set
+long receive_with_fds(int socket, std::span<char> out, std::vector<int> &fds);
+
+} // namespace am
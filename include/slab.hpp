@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace am {
+
+/// Unordered set of pointers with O(1) insert and removal by slot.
+/**
+ * Removed slots are reused by later inserts, so the storage stays as big as
+ * the most entries there ever were at once. Not thread safe, a slab belongs
+ * to one io_context.
+ */
+template <typename T> class Slab {
+public:
+  using slot_type = std::size_t;
+
+  slot_type insert(T *value) {
+    size_++;
+    if (!free_.empty()) {
+      auto slot = free_.back();
+      free_.pop_back();
+      slots_[slot] = value;
+      return slot;
+    }
+    slots_.push_back(value);
+    return slots_.size() - 1;
+  }
+
+  void erase(slot_type slot) {
+    slots_[slot] = nullptr;
+    free_.push_back(slot);
+    size_--;
+  }
+
+  // f may erase any entry, entries it inserts may or may not be visited
+  template <typename F> void for_each(F &&f) const {
+    for (std::size_t slot = 0; slot < slots_.size(); slot++) {
+      if (auto value = slots_[slot]) {
+        f(*value);
+      }
+    }
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  std::vector<T *> slots_;
+  std::vector<slot_type> free_;
+  std::size_t size_{0};
+};
+
+} // namespace am
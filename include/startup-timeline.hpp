@@ -0,0 +1,73 @@
+#pragma once
+
+#include "metrics.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace am {
+
+// steps from a play request to its first audio, in the order they happen
+enum class Milestone : std::size_t {
+  // Driver::play
+  play = 0,
+  // AsioClient::connect knows where the server is
+  resolved,
+  // TcpClientConnection::on_connect, or the UDP socket is ready
+  connected,
+  // the first mp3 bytes reached the decoder's input
+  first_byte,
+  // Mp3Stream decoded its first frame
+  first_frame,
+  // Player::start, the decoded audio reached the low watermark
+  device_started,
+  // the first SDL callback that played decoded audio instead of silence
+  first_audio,
+  count
+};
+
+/// When the current playback reached each milestone towards its first audio.
+/**
+ * Milestones are marked from the io context and from SDL's audio thread,
+ * only the first mark of each since begin() counts, so a reconnect or a
+ * restarted device does not move them. Once the first audio played, report()
+ * logs the playback's steps and adds each to a histogram of microseconds
+ * kept over all playbacks of the process, logged along.
+ */
+class StartupTimeline {
+public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr std::size_t milestones =
+      static_cast<std::size_t>(Milestone::count);
+
+  static StartupTimeline &instance();
+
+  // a new playback starts now, the last one's marks are forgotten
+  void begin();
+  // true for the first mark of milestone since begin()
+  bool mark(Milestone milestone);
+  // logs once per playback, after its first audio. not from the audio thread
+  void report();
+
+private:
+  StartupTimeline() = default;
+
+  // since the clock's epoch, 0 until reached
+  std::array<std::atomic<std::int64_t>, milestones> marks_{};
+  std::atomic<bool> reported_{true};
+  // one per step between two milestones, and one from play to first audio
+  std::array<Metric<long>, milestones> histograms_{
+      Metric<long>::create_histogram("startup resolve us"),
+      Metric<long>::create_histogram("startup connect us"),
+      Metric<long>::create_histogram("startup first byte us"),
+      Metric<long>::create_histogram("startup first frame us"),
+      Metric<long>::create_histogram("startup device start us"),
+      Metric<long>::create_histogram("startup first audio us"),
+      Metric<long>::create_histogram("startup total us")};
+};
+
+} // namespace am
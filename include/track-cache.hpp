@@ -0,0 +1,83 @@
+#pragma once
+
+#include "media-cache.hpp"
+#include "util.hpp"
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace am {
+
+class TrackCacheWriter;
+
+/// Copies of tracks the client downloaded, stored by their tag.
+/**
+ * A copy is named after the ContentHash tag of its bytes, so the same track
+ * from another host or under another name is one copy. What a track name of
+ * a host pointed to last is kept in a small file per name. Copies are only
+ * kept once their bytes hashed to the tag the server sent, and a copy is
+ * only played once the server confirmed the tag again.
+ */
+class TrackCache {
+public:
+  // copies go straight into dir, names into dir/names
+  explicit TrackCache(fs::path dir);
+
+  // $XDG_CACHE_HOME or ~/.cache, under mp3playerasio, empty if neither is set
+  static fs::path default_dir();
+
+  // tag of the copy of track from host, empty if there is none
+  std::string lookup(std::string_view host, std::string_view track) const;
+  // the copy with tag, opened for reading, nullptr if it is gone
+  fhandle open(std::string_view tag) const;
+  // a copy of a download of size bytes, nullptr if it can not be written
+  std::unique_ptr<TrackCacheWriter> store(std::string_view host,
+                                          std::string_view track,
+                                          std::string tag, std::size_t size);
+
+private:
+  fs::path copy_path(std::string_view tag) const;
+  fs::path name_path(std::string_view host, std::string_view track) const;
+
+  fs::path dir_;
+};
+
+/// Writes a download into the cache as it arrives.
+/**
+ * The copy is written next to its final name and moved there once size
+ * bytes came and hashed to the tag, the track name then points to it. A
+ * writer dropped before that removes what it wrote.
+ */
+class TrackCacheWriter {
+public:
+  TrackCacheWriter(fhandle file, fs::path part, fs::path copy, fs::path name,
+                   std::string tag, std::size_t size);
+  TrackCacheWriter(const TrackCacheWriter &) = delete;
+  TrackCacheWriter &operator=(const TrackCacheWriter &) = delete;
+  ~TrackCacheWriter();
+
+  // the next bytes of the track, the copy is kept after the last of them
+  void append(std::span<const char> bytes);
+  // the copy was kept
+  bool done() const { return done_; }
+
+private:
+  void finish();
+
+  fhandle file_;
+  fs::path part_;
+  fs::path copy_;
+  fs::path name_;
+  std::string tag_;
+  std::size_t size_;
+  std::size_t written_{0};
+  ContentHash hash_{};
+  bool failed_{false};
+  bool done_{false};
+};
+
+} // namespace am
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <absl/functional/any_invocable.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+/*
+
+UDP transport:
+
+client sends a request datagram with the track, unit and offset, then a
+keepalive about every second while it listens, and stop when it is done
+server answers a request from an address it has not verified with a cookie
+packet, smaller than the request, and streams once a request echoes the
+cookie. a spoofed source never sees its cookie, so it can not make the
+server send more than it was sent
+server sends data packets of whole mp3 frames, at real time plus a lead,
+numbered from 0. after every group of data packets it sends a parity
+packet, the XOR of the group, so the client restores one lost packet per
+group without asking again. a few end packets carry the number of data
+packets once the track is sent. a session the server does not hear from
+for a while is dropped
+
+all fields are little endian
+
+ */
+
+namespace am {
+
+enum class UdpRequestKind : std::uint8_t { request = 1, keepalive = 2, stop = 3 };
+
+// client to server datagram
+struct UdpRequest {
+  static constexpr std::size_t header_size = 20;
+
+  UdpRequestKind kind;
+  // RangeUnit
+  std::uint8_t unit;
+  std::uint64_t offset;
+  // the server's cookie for the client's address, 0 before it has one
+  std::uint64_t cookie;
+  // requests only, empty for the default track
+  std::string track;
+
+  std::vector<char> encode() const;
+  // nullopt if datagram is not a request
+  static std::optional<UdpRequest> decode(std::span<const char> datagram);
+};
+
+enum class UdpPacketKind : std::uint8_t {
+  data = 0,
+  // XOR of the data packets [seq, seq + count)
+  parity = 1,
+  // seq is the number of data packets of the track
+  end = 2,
+  // payload says why the server can not stream
+  error = 3,
+  // payload is the cookie to send the request again with
+  cookie = 4
+};
+
+// server to client datagram
+struct UdpPacket {
+  static constexpr std::size_t header_size = 8;
+  // payload of a data packet, whole frames up to about a 1500 byte MTU. a
+  // frame longer than that goes alone
+  static constexpr std::size_t max_payload = 1200;
+
+  std::uint32_t seq;
+  UdpPacketKind kind;
+  // data packets of the group a parity packet covers, the group size of the
+  // stream for data packets, 0 without parity
+  std::uint8_t count;
+  // payload length, for parity the XOR of the lengths of the group
+  std::uint16_t length;
+  std::vector<char> payload;
+
+  static UdpPacket make_cookie(std::uint64_t cookie);
+  // the payload of a cookie packet
+  std::uint64_t cookie() const;
+
+  std::vector<char> encode() const;
+  // nullopt if datagram is not a packet
+  static std::optional<UdpPacket> decode(std::span<const char> datagram);
+};
+
+/// Adds a parity packet after every group of data packets.
+class FecEncoder {
+public:
+  // group 0 sends no parity
+  explicit FecEncoder(std::uint8_t group);
+
+  // the data packet for payload, and the parity packet when it ends a group
+  std::vector<UdpPacket> add(std::span<const char> payload);
+  // parity of a last group that is not full, if there is one
+  std::optional<UdpPacket> flush();
+  // data packets so far, the seq of the end packet
+  std::uint32_t next_seq() const { return next_seq_; }
+
+private:
+  UdpPacket parity();
+
+  std::uint8_t group_;
+  std::uint32_t next_seq_{0};
+  std::uint32_t group_start_{0};
+  std::uint16_t length_xor_{0};
+  std::vector<char> xor_{};
+};
+
+/// Reorders data packets and restores lost ones from parity.
+/**
+ * Payloads are delivered in sequence order. A packet that is still missing
+ * once depth newer packets arrived, or the end of the track did, is given up
+ * and delivery continues after it. Packets carry whole frames, so the
+ * decoder only loses the audio of the missing packet.
+ */
+class JitterBuffer {
+public:
+  struct Stats {
+    std::size_t received{0};
+    std::size_t recovered{0};
+    std::size_t lost{0};
+    // older than what was delivered already, or seen twice
+    std::size_t late{0};
+  };
+
+  // depth more than the parity group, so parity arrives before a loss of
+  // its group is given up
+  explicit JitterBuffer(std::size_t depth);
+
+  void add(UdpPacket packet);
+  /// Passes payloads in order to sink until it refuses one.
+  /**
+   * sink returns false when it has no room for the payload, which then
+   * stays for the next drain. Returns the payload bytes sink took.
+   */
+  std::size_t drain(absl::AnyInvocable<bool(std::span<const char>)> sink);
+  // the end arrived and everything before it was delivered or given up
+  bool finished() const;
+  const Stats &stats() const { return stats_; }
+
+private:
+  void recover(std::uint32_t group_start);
+
+  std::size_t depth_;
+  std::uint32_t next_{0};
+  std::optional<std::uint32_t> end_{};
+  std::uint32_t highest_{0};
+  // data packets per parity group, from the packets
+  std::uint8_t group_{0};
+  std::map<std::uint32_t, std::vector<char>> data_{};
+  // parity packets by the first seq of their group
+  std::map<std::uint32_t, UdpPacket> parity_{};
+  Stats stats_{};
+};
+
+} // namespace am
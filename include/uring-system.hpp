@@ -0,0 +1,92 @@
+#pragma once
+
+#if defined(__linux__)
+
+#  include "media-cache.hpp"
+
+#  include <array>
+#  include <asio.hpp>
+#  include <asio/io_context.hpp>
+#  include <asio/posix/stream_descriptor.hpp>
+#  include <cstddef>
+#  include <memory>
+#  include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace am {
+
+struct SendFile;
+
+struct UringSendOp {
+  // null once the send completed or its SendFile went away
+  SendFile *owner_{};
+  // keeps the mapped bytes alive until the kernel is done with them
+  std::shared_ptr<const MediaFile> file_{};
+};
+
+/// One io_uring per io_context, shared by all SendFiles running on it.
+/**
+ * Sends are queued as SQEs and submitted with a single io_uring_enter once
+ * the handlers of the current round ran, so all connections woken up together
+ * share one syscall. Completions are signalled through an eventfd watched by
+ * the io_context. Uses IORING_OP_SEND_ZC when the kernel supports it.
+ */
+struct UringSendService : asio::execution_context::service {
+  static asio::execution_context::id id;
+  static constexpr unsigned entries = 256;
+
+  explicit UringSendService(asio::execution_context &context);
+  ~UringSendService() override;
+
+  bool available() const { return ring_fd_ >= 0; }
+  UringSendOp *send(SendFile &owner, std::shared_ptr<const MediaFile> file,
+                    int socket, const char *data, std::size_t len);
+  // the owner is gone, completion of op is dropped. a send not submitted
+  // yet is turned into a no op, so it is safe to close the socket after
+  void detach(UringSendOp *op);
+
+private:
+  void shutdown() override;
+  bool setup();
+  void close_ring();
+  void schedule_flush();
+  void submit();
+  // takes back the sends not submitted yet, their owners get res
+  void fail_queued(int res);
+  void wait_completions();
+  void reap();
+  UringSendOp *alloc_op();
+  void free_op(UringSendOp *op);
+
+  asio::io_context &io_context_;
+  asio::posix::stream_descriptor eventfd_;
+  std::array<char, 8> eventfd_buf_{};
+  int ring_fd_{-1};
+  bool send_zc_{};
+  void *sq_ptr_{};
+  std::size_t sq_size_{};
+  void *cq_ptr_{};
+  std::size_t cq_size_{};
+  io_uring_sqe *sqes_{};
+  std::size_t sqes_size_{};
+  unsigned *sq_head_{};
+  unsigned *sq_tail_{};
+  unsigned *sq_mask_{};
+  unsigned *sq_array_{};
+  unsigned sq_entries_{};
+  unsigned *cq_head_{};
+  unsigned *cq_tail_{};
+  unsigned *cq_mask_{};
+  io_uring_cqe *cqes_{};
+  unsigned queued_{};
+  bool flush_scheduled_{};
+  bool waiting_{};
+  std::vector<std::unique_ptr<UringSendOp>> ops_;
+  std::vector<UringSendOp *> free_ops_;
+};
+
+} // namespace am
+
+#endif
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
 #include <string>
 
 namespace am {
@@ -12,5 +16,33 @@ struct DestructionSignaller {
   ~DestructionSignaller();
 };
 
+/// SHA-256 of a track's bytes, fed in any number of pieces.
+/**
+ * Server and client hash the same way, the tag names a track by its content
+ * so a client's copy of it is found whatever the track is called. Tags key
+ * copies of a whole catalog, so the hash is one two tracks do not share.
+ */
+struct ContentHash {
+  using Digest = std::array<std::uint8_t, 32>;
+  static constexpr std::size_t tag_size = 64;
+
+  void update(std::span<const char> bytes);
+  // of the bytes so far, more can be added after
+  Digest digest() const;
+  // tag_size lowercase hex digits
+  std::string tag() const { return to_tag(digest()); }
+  static std::string to_tag(const Digest &digest);
+
+private:
+  void compress(const char *block);
+
+  std::array<std::uint32_t, 8> state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+  std::array<char, 64> block_{};
+  std::size_t block_used_{};
+  std::uint64_t length_{};
+};
+
 
 }
@@ -3,127 +3,813 @@
 #include <absl/strings/escaping.h>
 
 #include <asio.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
 #include <asio/connect.hpp>
+#include <asio/detached.hpp>
 #include <asio/detail/socket_ops.hpp>
 #include <asio/error.hpp>
 #include <asio/error_code.hpp>
 #include <asio/io_context.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/local/stream_protocol.hpp>
+#if defined(__linux__)
+#  include <asio/posix/stream_descriptor.hpp>
+#endif
+#include <asio/redirect_error.hpp>
 #include <asio/registered_buffer.hpp>
+#include <asio/steady_timer.hpp>
 #include <asio/strand.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/write.hpp>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
 #include <memory>
+#include <string>
 #include <string_view>
+#include <tuple>
 #include <utility>
 
+#if defined(__APPLE__) || defined(__linux__)
+#  include <unistd.h>
+#endif
+
 #include "asio-client.hpp"
 #include "audio-player.hpp"
 #include "client-protocol.hpp"
 #include "protocol.hpp"
+#include "shm-ring.hpp"
+#include "startup-timeline.hpp"
+#include "track-cache.hpp"
+#include "udp-stream.hpp"
 
 using asio::ip::tcp;
+using asio::ip::udp;
 
 namespace am {
 
 TcpClientConnection::Pointer
 TcpClientConnection::create(asio::io_context &io_context,
                             asio::io_context::strand &strand,
-                            Mp3Stream &mp3_stream) {
+                            Mp3Stream &mp3_stream, std::string track,
+                            RangeRequest range, std::string host,
+                            TrackCache *cache) {
   auto res = std::shared_ptr<TcpClientConnection>(
-      new TcpClientConnection(io_context, strand, mp3_stream));
+      new TcpClientConnection(io_context, strand, mp3_stream, std::move(track),
+                              range, std::move(host), cache));
   return res;
 }
 
-void TcpClientConnection::on_connect() {
+void TcpClientConnection::connect(tcp::resolver::results_type endpoints) {
+  endpoints_ = endpoints;
+  auto first = endpoints.begin();
+  connect(std::move(endpoints), first);
+}
+
+void TcpClientConnection::connect(tcp::resolver::results_type endpoints,
+                                  tcp::resolver::results_type::iterator next) {
+  if (next == endpoints.end()) {
+    LOG(ERROR) << "client: could not connect";
+    reconnect();
+    return;
+  }
+  auto endpoint = next->endpoint();
+  asio::error_code ec;
+  _socket.close(ec);
+  _socket.open(endpoint.protocol(), ec);
+  if (ec) {
+    LOG(ERROR) << "client: could not open a socket " << ec;
+    // the next endpoint may be of another family, past the last one the
+    // connection is made again later
+    connect(std::move(endpoints), ++next);
+    return;
+  }
+#if defined(TCP_FASTOPEN_CONNECT)
+  // connect returns at once, the requests written next go with the SYN when
+  // the server gave us a cookie before, with a plain handshake otherwise
+  int enable = 1;
+  if (setsockopt(_socket.native_handle(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                 &enable, sizeof(enable)) != 0) {
+    LOG(INFO) << "client: TCP_FASTOPEN_CONNECT failed " << errno;
+  }
+#endif
   auto ptr = shared_from_this();
-  receive([ptr = std::move(ptr)](auto ec) {
-    if (ec == asio::error::eof) {
-      LOG(INFO) << "client: server closed socket";
-    }
-  });
+  _socket.async_connect(
+      endpoint, [ptr, endpoints = std::move(endpoints),
+                 next](const asio::error_code &ec) mutable {
+        if (ec) {
+          LOG(INFO) << "client: connecting to " << next->endpoint()
+                    << " failed " << ec;
+          ptr->connect(std::move(endpoints), ++next);
+          return;
+        }
+        ptr->on_connect();
+      });
 }
 
-tcp::socket &TcpClientConnection::socket() { return _socket; }
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+void TcpClientConnection::connect(
+    asio::local::stream_protocol::endpoint endpoint) {
+  local_ = true;
+  local_endpoint_ = endpoint;
+  auto ptr = shared_from_this();
+  _socket.async_connect(endpoint,
+                        [ptr, endpoint](const asio::error_code &ec) {
+                          if (ec) {
+                            LOG(ERROR) << "client: connecting to " << endpoint
+                                       << " failed " << ec;
+                            ptr->reconnect();
+                            return;
+                          }
+                          ptr->on_connect();
+                        });
+}
+#endif
+
+void TcpClientConnection::on_connect() {
+  StartupTimeline::instance().mark(Milestone::connected);
+  if (local_) {
+    // receive reads with recvmsg once the socket is readable
+    asio::error_code ec;
+    _socket.native_non_blocking(true, ec);
+  }
+  asio::co_spawn(_socket.get_executor(), run(shared_from_this()),
+                 asio::detached);
+}
+
+asio::generic::stream_protocol::socket &TcpClientConnection::socket() {
+  return _socket;
+}
 
 TcpClientConnection::TcpClientConnection(asio::io_context &io_context,
                                          asio::io_context::strand &strand,
-                                         Mp3Stream &mp3_stream)
+                                         Mp3Stream &mp3_stream,
+                                         std::string track, RangeRequest range,
+                                         std::string host, TrackCache *cache)
     : 
     strand_(strand)
     ,_socket(io_context)
+    , wake_(io_context)
     , mp3_stream_(mp3_stream)
+    , track_(std::move(track))
+    , range_(range)
+    , host_(std::move(host))
+    , cache_(cache)
+    , reconnect_timer_(io_context)
     , _client_decoder(
           [](buffers_2<std::string_view> ts) {
             for (auto sv : ts) {
               LOG(INFO) << "time " << sv;
             }
           },
-          [this](RingBuffer &buff) mutable { mp3_stream_.decode_next(); }) {}
+          [this](RangeReply range) { on_range(range); },
+          [this](buffers_2<bytes_view> bytes) {
+            return take_mp3(bytes);
+          },
+          [this](std::string error) {
+            LOG(ERROR) << "client: server refused " << error;
+            refused_ = true;
+          }) {
+#if defined(__linux__)
+  _client_decoder.on_shm_ring_ = [this](ShmRingInfo info) {
+    on_shm_ring(info);
+  };
+#endif
+  _client_decoder.on_hello_ = [this]() { on_hello(); };
+  _client_decoder.on_etag_ = [this](std::string tag) {
+    server_tag_ = std::move(tag);
+  };
+}
 
-void TcpClientConnection::receive(
-    std::function<void(const asio::error_code &)> &&on_error) {
-  auto ptr = shared_from_this();
-  if (mp3_stream_.buffer().buffer().ready_write_size() == 0) {
-    mp3_stream_.buffer().add_callback_on_buffer_not_full(
-      OnBufferNotFullSz {
-      strand_.wrap([ptr, on_error=std::move(on_error)]() mutable {
-        ptr->receive(std::move(on_error));
-      }),
-      1 // as soon as 1 byte is available
-    });
+TcpClientConnection::~TcpClientConnection() {
+#if defined(__APPLE__) || defined(__linux__)
+  // descriptors of a ring that never came
+  for (auto fd : received_fds_) {
+    ::close(fd);
+  }
+#endif
+}
+
+asio::awaitable<bool> TcpClientConnection::send_requests() {
+  auto capabilities = capabilities_supported;
+  if (!local_) {
+    capabilities &= ~capability::shm_ring;
+  }
+  if (cache_) {
+    cached_tag_ = cache_->lookup(host_, track_);
+    if (!cached_tag_.empty()) {
+      cached_ = cache_->open(cached_tag_);
+    }
   } else {
-  _socket.async_read_some(
-      mp3_stream_.buffer().buffer().prepared(),
-      [this, ptr = std::move(ptr), on_error = std::move(on_error)](
-          const asio::error_code &ec, const size_t bytes_transferred) mutable {
-        if (ec) {
-          LOG(INFO) << "client: received " << mp3_stream_.buffer().buffer() << " error "
-                    << ec << " bytes available " << _socket.available();
-          on_error(ec);
-          // we did not parse the whole read_buffer yet, we schedule a callback
-          // to be called once the consumer commits more of read_buffer. make
-          // sure connection is alive at this point
-
-          // currently connection is alive because
-          // res->_mp3_stream.set_on_low_watermark([res](){
-          //   res->handle();
-          // });
-          // set on low watermark retains tcp connection strongly forever.
-        } else {
-          ptr->mp3_stream_.buffer().buffer().consume(bytes_transferred);
-          LOG(INFO) << "client: received " << bytes_transferred
-                    << " from network " << mp3_stream_.buffer().buffer();
-          handle();
-          receive(std::move(on_error));
+    capabilities &= ~capability::etag;
+  }
+  _client_encoder.fill_hello(Hello{wire_version_latest, capabilities},
+                             _write_buffer);
+  if (!track_.empty()) {
+    _client_encoder.fill_track_request(track_, _write_buffer);
+  }
+  // a server that does not know tags would fail on one, so with a copy the
+  // range waits for the server's hello, a round trip saved a download
+  range_deferred_ = cached_ != nullptr;
+  if (!range_deferred_) {
+    _client_encoder.fill_range_request(range_, _write_buffer);
+  }
+  auto sent = co_await flush();
+  connected_ = true;
+  co_return sent;
+}
+
+void TcpClientConnection::on_hello() {
+  if (!range_deferred_) {
+    return;
+  }
+  range_deferred_ = false;
+  if (_client_decoder._capabilities & capability::etag) {
+    _client_encoder.fill_etag(cached_tag_, _write_buffer);
+  } else {
+    cached_.reset();
+  }
+  _client_encoder.fill_range_request(range_, _write_buffer);
+  if (!writing_) {
+    asio::co_spawn(_socket.get_executor(), flush(shared_from_this()),
+                   asio::detached);
+  }
+}
+
+void TcpClientConnection::on_range(RangeReply range) {
+  LOG(INFO) << "client: streaming from " << range.start << " of "
+            << range.total << " bytes, track is " << range.duration_ms
+            << "ms";
+  // a later range is a seek, the download is no copy of the track anymore
+  cache_writer_.reset();
+  if (first_tag_.empty()) {
+    first_tag_ = server_tag_;
+  } else if (!server_tag_.empty() && server_tag_ != first_tag_) {
+    LOG(ERROR) << "client: the track changed on the server, stopping";
+    refused_ = true;
+    asio::error_code ec;
+    _socket.close(ec);
+    return;
+  }
+  if (cached_ && server_tag_ == cached_tag_) {
+    if (std::fseek(cached_.get(), static_cast<long>(range.start), SEEK_SET) !=
+        0) {
+      LOG(ERROR) << "client: the copy of " << cached_tag_ << " is unreadable";
+      cached_.reset();
+      return;
+    }
+    LOG(INFO) << "client: playing " << cached_tag_ << " from the cache";
+    // nothing more comes from the server
+    total_.reset();
+    play_cached();
+    return;
+  }
+  cached_.reset();
+  stream_pos_ = range.start;
+  total_ = range.total;
+  reconnects_ = 0;
+  // over a ring the bytes never pass take_mp3
+  if (cache_ && !server_tag_.empty() && range.start == 0 &&
+      !(_client_decoder._capabilities & capability::shm_ring)) {
+    cache_writer_ = cache_->store(host_, track_, server_tag_, range.total);
+  }
+}
+
+void TcpClientConnection::play_cached() {
+  auto &buffer = mp3_stream_.buffer().buffer();
+  // the decoder may take all of it at once, the buffer is then filled again
+  // as no commit is left to call back
+  while (buffer.ready_write_size() > 0) {
+    auto prepared = *buffer.prepared().begin();
+    auto len = std::fread(prepared.data(), 1, prepared.size(), cached_.get());
+    buffer.consume(len);
+    if (len > 0) {
+      mp3_stream_.decode_next();
+    }
+    if (len < prepared.size()) {
+      LOG(INFO) << "client: end of track";
+      cached_.reset();
+      return;
+    }
+  }
+  mp3_stream_.buffer().add_callback_on_buffer_not_full(OnBufferNotFullSz{
+      strand_.wrap([self = shared_from_this()]() { self->play_cached(); }),
+      1});
+}
+
+void TcpClientConnection::send_control(Control control) {
+  if (control.command == ControlCommand::stop) {
+    stopped_ = true;
+    reconnect_timer_.cancel();
+  }
+  _client_encoder.fill_control(control, _write_buffer);
+  // before the requests went out, or while writing, the message goes with
+  // what is being written
+  if (connected_ && !writing_) {
+    asio::co_spawn(_socket.get_executor(), flush(shared_from_this()),
+                   asio::detached);
+  }
+}
+
+asio::awaitable<bool> TcpClientConnection::flush(Pointer self) {
+  co_return co_await flush();
+}
+
+asio::awaitable<bool> TcpClientConnection::flush() {
+  writing_ = true;
+  asio::error_code ec;
+  while (!_write_buffer.empty()) {
+    auto bytes = co_await _socket.async_write_some(
+        _write_buffer.data(), asio::redirect_error(asio::use_awaitable, ec));
+    _write_buffer.commit(bytes);
+    if (ec) {
+      LOG(ERROR) << "client: sending to the server failed " << ec;
+      break;
+    }
+  }
+  writing_ = false;
+  co_return !ec;
+}
+
+asio::awaitable<void> TcpClientConnection::run(Pointer self) {
+  auto sent = co_await send_requests();
+  if (!sent) {
+    co_return;
+  }
+  asio::error_code ec;
+  while (true) {
+    if (mp3_full_) {
+      // the player frees space from its own thread, the callback only
+      // comes back through the strand once we wait
+      mp3_full_ = false;
+      mp3_stream_.buffer().add_callback_on_buffer_not_full(OnBufferNotFullSz{
+          strand_.wrap([self]() { self->wake_.cancel(); }),
+          1 // as soon as 1 byte is available
+      });
+      wake_.expires_at(asio::steady_timer::time_point::max());
+      co_await wake_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+      handle();
+      continue;
+    }
+    auto bytes_transferred = co_await receive(ec);
+    if (ec) {
+      if (ec == asio::error::eof) {
+        LOG(INFO) << "client: server closed socket";
+      } else {
+        LOG(INFO) << "client: received " << _read_buffer << " error " << ec;
+      }
+#if defined(__linux__)
+      if (shm_data_) {
+        // the ring holds what the server wrote before it closed
+        shm_data_->cancel(ec);
+      }
+#endif
+      reconnect();
+      co_return;
+    }
+    _read_buffer.consume(bytes_transferred);
+    LOG(INFO) << "client: received " << bytes_transferred << " from network "
+              << _read_buffer;
+    handle();
+  }
+}
+
+asio::awaitable<std::size_t>
+TcpClientConnection::receive(asio::error_code &ec) {
+  if (!local_) {
+    co_return co_await _socket.async_read_some(
+        _read_buffer.prepared(), asio::redirect_error(asio::use_awaitable, ec));
+  }
+  while (!ec) {
+    co_await _socket.async_wait(
+        asio::generic::stream_protocol::socket::wait_read,
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+      break;
+    }
+    auto prepared = *_read_buffer.prepared().begin();
+    auto res = receive_with_fds(
+        _socket.native_handle(),
+        std::span(static_cast<char *>(prepared.data()), prepared.size()),
+        received_fds_);
+    if (res > 0) {
+      co_return static_cast<std::size_t>(res);
+    }
+    if (res == 0) {
+      ec = asio::error::eof;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ec = asio::error_code(errno, asio::error::get_system_category());
+    }
+  }
+  co_return 0;
+}
+
+#if defined(__linux__)
+void TcpClientConnection::on_shm_ring(ShmRingInfo info) {
+  asio::error_code ec;
+  if (received_fds_.size() < std::tuple_size_v<ShmRing::Fds>) {
+    LOG(ERROR) << "client: ring came without its descriptors, closing";
+    _socket.close(ec);
+    return;
+  }
+  // the ring's are the last ones, anything before is stale
+  ShmRing::Fds fds{};
+  auto first = received_fds_.end() - fds.size();
+  std::copy(first, received_fds_.end(), fds.begin());
+  for (auto it = received_fds_.begin(); it != first; ++it) {
+    ::close(*it);
+  }
+  received_fds_.clear();
+  auto ring = ShmRing::open(fds, info.size);
+  if (!ring) {
+    _socket.close(ec);
+    return;
+  }
+  LOG(INFO) << "client: streaming through a shared ring of " << info.size
+            << " bytes";
+  auto &buffer = mp3_stream_.buffer().buffer();
+  buffer.adopt(ring->take_data());
+  shm_data_.emplace(_socket.get_executor(), ::dup(ring->data_ready_fd()));
+  shm_ring_ = std::move(ring);
+  shm_seen_ = 0;
+  asio::co_spawn(_socket.get_executor(), read_shm(shared_from_this()),
+                 asio::detached);
+}
+
+asio::awaitable<void> TcpClientConnection::read_shm(Pointer self) {
+  asio::error_code ec;
+  while (true) {
+    sync_shm();
+    if (shm_ring_->finished() && shm_ring_->written() == shm_seen_) {
+      LOG(INFO) << "client: end of track";
+      break;
+    }
+    auto waits = shm_ring_->reader_wait(shm_seen_);
+    if (!waits) {
+      continue;
+    }
+    co_await shm_data_->async_wait(
+        asio::posix::stream_descriptor::wait_read,
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+      // the server closed, what it wrote before is still taken
+      sync_shm();
+      break;
+    }
+    ShmRing::drain_eventfd(shm_data_->native_handle());
+  }
+}
+
+void TcpClientConnection::sync_shm() {
+  if (!shm_ring_) {
+    // a not full callback of a ring given up on reconnecting
+    return;
+  }
+  auto &buffer = mp3_stream_.buffer().buffer();
+  auto written = shm_ring_->written();
+  if (written != shm_seen_) {
+    // the bytes are in the adopted mapping already
+    buffer.consume(written - shm_seen_);
+    stream_pos_ += written - shm_seen_;
+    shm_seen_ = written;
+    mp3_stream_.decode_next();
+  }
+  // what the input held before the ring stays in front of the server's
+  // bytes, so the first release may be below 0
+  shm_ring_->release(shm_seen_ - buffer.ready_size());
+  if (!shm_waiting_for_room_ && !shm_ring_->finished()) {
+    // the decoder frees the ring at the player's pace, the server hears about
+    // it once the input drained to its low watermark
+    shm_waiting_for_room_ = true;
+    mp3_stream_.buffer().add_callback_on_buffer_not_full(OnBufferNotFullSz{
+        strand_.wrap([self = shared_from_this()]() {
+          self->shm_waiting_for_room_ = false;
+          self->sync_shm();
+        }),
+        1});
+  }
+}
+#endif
+
+std::size_t TcpClientConnection::take_mp3(buffers_2<bytes_view> bytes) {
+  auto &buffer = mp3_stream_.buffer().buffer();
+  std::size_t taken = 0;
+  for (auto part : bytes) {
+    auto len = std::min(part.size(), buffer.ready_write_size());
+    buffer.memcpy_in(part.data(), len);
+    if (cache_writer_) {
+      cache_writer_->append(part.first(len));
+    }
+    taken += len;
+  }
+  stream_pos_ += taken;
+  if (taken < bytes.size()) {
+    mp3_full_ = true;
+  }
+  if (taken > 0) {
+    mp3_stream_.decode_next();
+  }
+  return taken;
+}
+
+bool TcpClientConnection::reconnect() {
+  // only a track that started streaming is continued
+  if (!total_ || stream_pos_ >= *total_ || refused_ || stopped_) {
+    return false;
+  }
+#if defined(__linux__)
+  if (shm_ring_ && shm_ring_->finished()) {
+    // the rest is in the ring, read_shm takes it
+    return false;
+  }
+#endif
+  if (reconnects_ == max_reconnects) {
+    LOG(ERROR) << "client: giving up after " << reconnects_ << " reconnects";
+    return false;
+  }
+  auto delay = std::min<std::chrono::milliseconds>(
+      first_reconnect_delay * (1 << reconnects_), max_reconnect_delay);
+  reconnects_++;
+  LOG(INFO) << "client: reconnecting in " << delay.count()
+            << "ms to continue from " << stream_pos_ << " of " << *total_;
+  reconnect_timer_.expires_after(delay);
+  reconnect_timer_.async_wait(
+      [self = shared_from_this()](const asio::error_code &ec) {
+        if (!ec && !self->stopped_) {
+          self->resume();
         }
       });
+  return true;
+}
+
+void TcpClientConnection::resume() {
+  asio::error_code ec;
+  _socket.close(ec);
+  _read_buffer.reset();
+  _write_buffer.reset();
+  _client_decoder.reset_connection();
+  _client_encoder._version = WireVersion::v1;
+  mp3_full_ = false;
+  connected_ = false;
+  server_tag_.clear();
+  cache_writer_.reset();
+#if defined(__APPLE__) || defined(__linux__)
+  for (auto fd : received_fds_) {
+    ::close(fd);
+  }
+#endif
+  received_fds_.clear();
+#if defined(__linux__)
+  // read_shm took the ring's last bytes when the socket closed
+  shm_data_.reset();
+  shm_ring_.reset();
+  shm_seen_ = 0;
+#endif
+  // the server starts at the next frame, the decoder skips the rest of the
+  // frame the player has the start of
+  range_ = RangeRequest{RangeUnit::bytes, stream_pos_};
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+  if (local_) {
+    connect(local_endpoint_);
+    return;
   }
+#endif
+  connect(endpoints_);
 }
 
 void TcpClientConnection::handle() {
-  _client_decoder.try_read_client(mp3_stream_.buffer().buffer());
-  // LOG(INFO) << "client: handled " << mp3_stream_.buffer().buffer();
+  _client_decoder.try_read_client(_read_buffer);
+  if (_client_decoder.failed()) {
+    LOG(ERROR) << "client: bad server message, closing";
+    asio::error_code ec;
+    _socket.close(ec);
+  }
 }
 
-void AsioClient::connect(std::string_view host) {
+UdpClientConnection::Pointer
+UdpClientConnection::create(asio::io_context &io_context,
+                            asio::io_context::strand &strand,
+                            Mp3Stream &mp3_stream, std::string track,
+                            RangeRequest range) {
+  return std::shared_ptr<UdpClientConnection>(new UdpClientConnection(
+      io_context, strand, mp3_stream, std::move(track), range));
+}
+
+UdpClientConnection::UdpClientConnection(asio::io_context &io_context,
+                                         asio::io_context::strand &strand,
+                                         Mp3Stream &mp3_stream,
+                                         std::string track, RangeRequest range)
+    : strand_(strand)
+    , socket_(io_context)
+    , keepalive_timer_(io_context)
+    , mp3_stream_(mp3_stream)
+    , track_(std::move(track))
+    , range_(range) {}
+
+void UdpClientConnection::start(udp::endpoint server) {
+  asio::error_code ec;
+  socket_.connect(server, ec);
+  if (ec) {
+    LOG(ERROR) << "client: could not reach " << server << " " << ec;
+    return;
+  }
+  StartupTimeline::instance().mark(Milestone::connected);
+  asio::co_spawn(socket_.get_executor(), receive(shared_from_this()),
+                 asio::detached);
+  asio::co_spawn(socket_.get_executor(), keepalive(shared_from_this()),
+                 asio::detached);
+}
+
+void UdpClientConnection::stop() {
+  if (stopped_) {
+    return;
+  }
+  stopped_ = true;
+  keepalive_timer_.cancel();
+  asio::co_spawn(
+      socket_.get_executor(),
+      [self = shared_from_this()]() -> asio::awaitable<void> {
+        co_await self->send(UdpRequestKind::stop);
+        asio::error_code ec;
+        self->socket_.close(ec);
+      },
+      asio::detached);
+}
+
+asio::awaitable<void> UdpClientConnection::send(UdpRequestKind kind) {
+  UdpRequest request{kind, static_cast<std::uint8_t>(range_.unit),
+                     range_.offset, cookie_,
+                     kind == UdpRequestKind::request ? track_ : std::string()};
+  auto datagram = request.encode();
+  asio::error_code ec;
+  co_await socket_.async_send(asio::buffer(datagram),
+                              asio::redirect_error(asio::use_awaitable, ec));
+  if (ec) {
+    LOG(INFO) << "client: udp send failed " << ec;
+  }
+}
+
+asio::awaitable<void> UdpClientConnection::keepalive(Pointer self) {
+  // the request is sent again until packets come, it may be lost too
+  co_await send(UdpRequestKind::request);
+  asio::error_code ec;
+  while (!stopped_) {
+    keepalive_timer_.expires_after(keepalive_interval);
+    co_await keepalive_timer_.async_wait(
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (stopped_) {
+      break;
+    }
+    auto kind = jitter_.stats().received ? UdpRequestKind::keepalive
+                                         : UdpRequestKind::request;
+    co_await send(kind);
+  }
+}
+
+asio::awaitable<void> UdpClientConnection::receive(Pointer self) {
+  std::array<char, 2048> datagram;
+  asio::error_code ec;
+  while (!stopped_) {
+    auto bytes = co_await socket_.async_receive(
+        asio::buffer(datagram), asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+      if (ec == asio::error::operation_aborted) {
+        break;
+      }
+      // the server is not listening yet, or an ICMP error came back
+      LOG(INFO) << "client: udp receive failed " << ec;
+      continue;
+    }
+    auto packet = UdpPacket::decode(std::span(datagram.data(), bytes));
+    if (!packet) {
+      continue;
+    }
+    if (packet->kind == UdpPacketKind::error) {
+      LOG(ERROR) << "client: server refused "
+                 << std::string(packet->payload.begin(), packet->payload.end());
+      stop();
+      break;
+    }
+    if (packet->kind == UdpPacketKind::cookie) {
+      // the server checks the address before it streams to it
+      if (jitter_.stats().received == 0) {
+        cookie_ = packet->cookie();
+        co_await send(UdpRequestKind::request);
+      }
+      continue;
+    }
+    jitter_.add(std::move(*packet));
+    drain();
+    if (jitter_.finished()) {
+      auto &stats = jitter_.stats();
+      LOG(INFO) << "client: udp track finished, received " << stats.received
+                << " restored " << stats.recovered << " lost " << stats.lost
+                << " late " << stats.late;
+      stop();
+    }
+  }
+}
+
+void UdpClientConnection::drain() {
+  auto &buffer = mp3_stream_.buffer().buffer();
+  bool full = false;
+  auto delivered = jitter_.drain([&buffer, &full](std::span<const char> bytes) {
+    full = bytes.size() > buffer.ready_write_size();
+    if (!full) {
+      buffer.memcpy_in(bytes.data(), bytes.size());
+    }
+    return !full;
+  });
+  if (delivered > 0) {
+    mp3_stream_.decode_next();
+  }
+  if (full && !waiting_for_room_) {
+    // the player frees space from its own thread, packets wait in the
+    // jitter buffer until it does
+    waiting_for_room_ = true;
+    mp3_stream_.buffer().add_callback_on_buffer_not_full(OnBufferNotFullSz{
+        strand_.wrap([self = shared_from_this()]() {
+          self->waiting_for_room_ = false;
+          self->drain();
+        }),
+        UdpPacket::max_payload});
+  }
+}
+
+void AsioClient::connect(std::string_view host, std::string track,
+                         RangeRequest range) {
+  if (host.starts_with("udp:")) {
+    udp_resolver_.async_resolve(
+        host.substr(4), "8060",
+        [this, track = std::move(track), range](const asio::error_code &ec,
+                                                auto results) mutable {
+          if (ec || results.empty()) {
+            LOG(ERROR) << "client: resolving failed " << ec;
+            return;
+          }
+          StartupTimeline::instance().mark(Milestone::resolved);
+          auto connection = UdpClientConnection::create(
+              io_context_, strand_, mp3_stream_, std::move(track), range);
+          udp_connection_ = connection;
+          connection->start(results.begin()->endpoint());
+        });
+    return;
+  }
+  if (host.starts_with("unix:")) {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    // a path, nothing to resolve
+    StartupTimeline::instance().mark(Milestone::resolved);
+    auto connection = TcpClientConnection::create(
+        io_context_, strand_, mp3_stream_, std::move(track), range,
+        std::string(host), cache_);
+    connection_ = connection;
+    connection->connect(
+        asio::local::stream_protocol::endpoint(std::string(host.substr(5))));
+#else
+    LOG(ERROR) << "client: unix sockets are not supported";
+#endif
+    return;
+  }
 
   resolver_.async_resolve(
-      host, "8060", [this](const asio::error_code &, auto results) mutable {
-        auto connection =
-            TcpClientConnection::create(io_context_, strand_, mp3_stream_);
-        auto &socket = connection->socket();
-        asio::async_connect(
-            socket, results,
-            [connection = std::move(connection)](const auto& ec, const auto& endpoint) {
-              connection->on_connect();
-            });
+      host, "8060",
+      [this, track = std::move(track), range,
+       host = std::string(host)](const asio::error_code &ec,
+                                 auto results) mutable {
+        if (ec) {
+          LOG(ERROR) << "client: resolving failed " << ec;
+          return;
+        }
+        StartupTimeline::instance().mark(Milestone::resolved);
+        auto connection = TcpClientConnection::create(
+            io_context_, strand_, mp3_stream_, std::move(track), range,
+            std::move(host), cache_);
+        connection_ = connection;
+        connection->connect(std::move(results));
       });
 }
 
+void AsioClient::send_control(Control control) {
+  if (auto connection = connection_.lock()) {
+    connection->send_control(control);
+  }
+  if (auto connection = udp_connection_.lock()) {
+    if (control.command == ControlCommand::stop) {
+      connection->stop();
+    }
+  }
+}
+
 AsioClient::AsioClient(asio::io_context &io_context,
-                       asio::io_context::strand &strand, Mp3Stream &mp3_stream)
+                       asio::io_context::strand &strand, Mp3Stream &mp3_stream,
+                       TrackCache *cache)
     : io_context_(io_context)
     , strand_(strand)
     , mp3_stream_(mp3_stream)
-    , resolver_(io_context_) {}
+    , cache_(cache)
+    , resolver_(io_context_)
+    , udp_resolver_(io_context_) {}
 
 } // namespace am
@@ -15,32 +15,62 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
 #include <asio.hpp>
+#include <asio/awaitable.hpp>
 #include <asio/basic_streambuf.hpp>
 #include <asio/buffer.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
 #include <asio/detail/string_view.hpp>
 #include <asio/error.hpp>
 #include <asio/error_code.hpp>
 #include <asio/io_context.hpp>
+#include <asio/local/stream_protocol.hpp>
+#if defined(__linux__)
+#  include <asio/posix/stream_descriptor.hpp>
+#  include <unistd.h>
+#endif
 #include <asio/post.hpp>
 #include <asio/read.hpp>
 #include <asio/read_until.hpp>
+#include <asio/redirect_error.hpp>
 #include <asio/signal_set.hpp>
+#include <asio/steady_timer.hpp>
 #include <asio/strand.hpp>
 #include <asio/streambuf.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/write.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <ctime>
 #include <filesystem>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <optional>
+#include <random>
 #include <ostream>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "util.hpp"
+#include "broadcast.hpp"
+#include "catalog.hpp"
+#include "media-cache.hpp"
 #include "mp3.hpp"
+#include "pacer.hpp"
 #include "protocol.hpp"
 #include "server-protocol.hpp"
+#include "shm-ring.hpp"
+#include "slab.hpp"
+#include "udp-stream.hpp"
 
 using asio::ip::tcp;
+using asio::ip::udp;
 
 namespace am {
 
@@ -50,211 +80,1491 @@ static std::string make_daytime_string() {
   return ctime(&now);
 }
 
+struct ServerOptions {
+  std::size_t threads = 1;
+  // TCP, and UDP with --udp, 0 picks a free one for a single thread
+  std::uint16_t port = 8060;
+  SendFile::Backend send_backend = SendFile::Backend::sendfile;
+  PacingOptions pacing{};
+  fs::path media_dir = "..";
+  // streamed to clients that do not ask for a track
+  std::string default_track = "inside-you-162760";
+  // every client listens to the same live channel looping over the catalog
+  bool broadcast = false;
+  // async_accepts kept pending per worker, so bursts of clients are taken
+  // without waiting for a handler to re-arm the single accept
+  std::size_t pending_accepts = 16;
+  // TCP Fast Open queue length, 0 disables it
+  int fast_open_queue = 0;
+  // also stream over UDP on the same port number
+  bool udp = false;
+  // data packets per parity packet, 0 sends no parity
+  std::uint8_t udp_fec_group = 4;
+  // percent of UDP packets dropped on purpose, to try loss on loopback
+  int udp_loss_percent = 0;
+  // also accept clients of the same host on this unix socket, empty for none
+  fs::path unix_path{};
+};
+
+// holds back a send until the next one without the flag, so headers leave in
+// the same segment as the first audio bytes that follow them
+static constexpr asio::socket_base::message_flags more_to_send =
+#if defined(MSG_MORE)
+    MSG_MORE;
+#else
+    0;
+#endif
+
+/// One client, served by two coroutines on the worker's thread.
+/**
+ * The session sends the time, waits for the client's range request and
+ * streams. A client that sends nothing at all, as clients did before range
+ * requests, gets the default track from its start after legacy_grace. The
+ * reader decodes client messages meanwhile. Both frames are allocated once
+ * and hold the connection, which is deleted once both returned. They wake
+ * each other through wake_, a timer that is cancelled instead of expiring,
+ * and check their state again after every wait. A wake while the other
+ * waits on something else, like a send, ends its next wait at once.
+ * The socket is TCP, or a unix socket for clients on the same host.
+ */
 class TcpConnection : public std::enable_shared_from_this<TcpConnection> {
 public:
   static constexpr auto interval = asio::chrono::seconds(5);
+  // server only writes envelopes and the time message itself, file bytes go
+  // through sendfile. one page is the smallest ring buffer we can map.
+  static constexpr std::size_t write_buffer_size = 4096;
+  // clients send small control messages, grown on demand up to the max
+  static constexpr std::size_t read_buffer_size = 4096;
+  static constexpr std::size_t max_read_buffer_size = 1 << 20;
+  // of an unknown track's name in the error
+  static constexpr std::size_t max_echoed_name_size = 64;
+  // a client silent this long after the time predates range requests, it
+  // gets the default track from its start
+  static constexpr auto legacy_grace = std::chrono::milliseconds(500);
+  // a client given a shared memory ring maps it within this
+  static constexpr auto shm_attach_timeout = std::chrono::seconds(5);
   using pointer = std::shared_ptr<TcpConnection>;
+  using Registry = Slab<TcpConnection>;
 
-  static pointer create(asio::io_context &io_context, asio::io_context::strand &strand) {
-    LOG(INFO) << "creating file";
-    Mp3 file = Mp3::create(fs::path("../inside-you-162760.mp3"));
-
-    return {new TcpConnection(io_context, strand, std::move(file)),
+  // the connection stays in registry until it is deleted
+  static pointer create(asio::io_context &io_context, StreamSocket &&socket,
+                        Registry &registry, MediaCache &cache,
+                        const Catalog &catalog, Broadcast *broadcast,
+                        const ServerOptions &options) {
+    return {new TcpConnection(io_context, std::move(socket), registry, cache,
+                              catalog, broadcast, options),
             [](TcpConnection *conn) {
               LOG(INFO) << "deleting connection " << conn;
               delete conn; 
             }};
   }
 
-  tcp::socket &socket() { return _socket; }
+  ~TcpConnection() {
+    if (registry_) {
+      registry_->erase(registry_slot_);
+    }
+  }
+
+  StreamSocket &socket() { return _socket; }
+
+  // the server goes away first, handlers still pending keep the connection
+  void detach() { registry_ = nullptr; }
 
   void start() {
-    send_date();
+    asio::co_spawn(io_context_, session(shared_from_this()), asio::detached);
   }
 
-  void cancel() {
-    // file.cancel deletes the last owning pointer to TcpConnection
-    // meanwhile something is being posted on the io_context that needs connection to be alive
-    // todo: make it better
-    auto ptr = shared_from_this();
-    _file.precancel();
-    asio::post(ptr->strand_.wrap([ptr](){
-        ptr->_file.cancel();
-        asio::post(ptr->strand_.wrap([ptr](){
-          LOG(INFO) << ptr.use_count();
-        }));
-    }));
-    
-  }
+  // both coroutines return at their next resumption
+  void cancel() { close(); }
 
 private:
-  TcpConnection(asio::io_context &io_context, asio::io_context::strand &strand, Mp3 &&file)
+  TcpConnection(asio::io_context &io_context, StreamSocket &&socket,
+                Registry &registry, MediaCache &cache, const Catalog &catalog,
+                Broadcast *broadcast, const ServerOptions &options)
       : io_context_(io_context)
-      , strand_(strand)
-      , _socket(io_context)
-      , _file(std::move(file))
+      , _socket(std::move(socket))
+      , registry_(&registry)
+      , registry_slot_(registry.insert(this))
+      , cache_(cache)
+      , catalog_(catalog)
+      , broadcast_(broadcast)
+      , options_(options)
+      , pace_timer_(io_context)
+      , wake_(io_context)
       , _server_decoder(
-            [this](buffers_2<std::string_view> msg) { on_message(msg); }) {}
+            [this](buffers_2<std::string_view> msg) { on_message(msg); },
+            [this](std::string name) { on_track_request(std::move(name)); },
+            [this](RangeRequest request) { on_range_request(request); },
+            [this](Control control) { on_control(control); },
+            [this](Hello hello) {
+              hello_ = hello;
+              wake();
+            },
+            max_read_buffer_size) {
+    _server_decoder.on_etag_ = [this](std::string tag) {
+      client_tag_ = std::move(tag);
+    };
+  }
 
-  void send_date() {
-    auto message = make_daytime_string();
+  asio::awaitable<void> session(pointer self) {
+    read_early_requests();
+    if (!hello_) {
+      // v1 clients get the time right away, a hello that comes later gets
+      // its own after the answer
+      _server_encoder.fill_time(make_daytime_string(), _write_buffer);
+    }
+    answer_hello();
+    if (!closed_) {
+      asio::co_spawn(io_context_, read_requests(self), asio::detached);
+    }
+    if (!range_ && !error_ && !closed_) {
+      // the client asks where to start from once it has the time
+      auto sent = co_await flush();
+      auto legacy_at = asio::steady_timer::clock_type::now() + legacy_grace;
+      while (sent && !range_ && !error_ && !closed_) {
+        if (!client_spoke_ &&
+            asio::steady_timer::clock_type::now() >= legacy_at) {
+          LOG(INFO) << "server: silent client, streaming from the start";
+          legacy_ = true;
+          streaming_ = true;
+          range_ = RangeRequest{RangeUnit::bytes, 0};
+          break;
+        }
+        co_await wait(client_spoke_ ? asio::steady_timer::time_point::max()
+                                    : legacy_at);
+        if (answer_hello()) {
+          sent = co_await flush();
+        }
+      }
+    }
+    // the answer goes before anything in the version it picks
+    answer_hello();
+    if (range_ && !error_ && !closed_) {
+      co_await stream(*range_);
+    }
+    if (error_ && !closed_) {
+      // tells the client why before closing
+      LOG(INFO) << "server: " << *error_;
+      _server_encoder.fill_error(*error_, _write_buffer);
+      co_await flush();
+    }
+    close();
+  }
 
-    auto ptr = shared_from_this();
-    _server_encoder.fill_time(message, _write_buffer);
+  /// Handles requests that arrived before the connection was accepted.
+  /**
+   * A client sending its requests right after connecting, or with the SYN
+   * through TCP Fast Open, gets the stream started before the time message
+   * is sent, so both leave in one flight.
+   */
+  void read_early_requests() {
+    asio::error_code ec;
+    auto available = _socket.available(ec);
+    if (ec || available == 0) {
+      return;
+    }
+    auto bytes = _socket.read_some(_read_buffer.prepared(), ec);
+    if (ec) {
+      return;
+    }
+    client_spoke_ = client_spoke_ || bytes > 0;
+    _read_buffer.consume(bytes);
+    if (!_server_decoder.try_read_server(_read_buffer)) {
+      LOG(ERROR) << "server: bad client message, closing";
+      close();
+    }
+  }
 
-    send([ptr]() { ptr->send_mp3(); },
-         [](const asio::error_code &) { LOG(ERROR) << "send date error"; });
+  // fills the answer to a hello not answered yet, and the time in the version
+  // it picked, false if there was none
+  bool answer_hello() {
+    if (!hello_) {
+      return false;
+    }
+    LOG(INFO) << "server: client speaks v" << static_cast<int>(hello_->version)
+              << " capabilities " << hello_->capabilities;
+    if (broadcast_ || !on_unix_socket()) {
+      // a ring needs both processes on one host, and a stream of its own
+      hello_->capabilities &= ~capability::shm_ring;
+    }
+    if (broadcast_) {
+      // a live channel is no track to keep
+      hello_->capabilities &= ~capability::etag;
+    }
+    _server_encoder.fill_hello(*hello_, _write_buffer);
+    chunked_ = hello_->capabilities & capability::chunked_mp3;
+    shm_ = hello_->capabilities & capability::shm_ring;
+    etag_ = hello_->capabilities & capability::etag;
+    if (hello_->capabilities & capability::binary_time) {
+      _server_encoder.fill_time(std::chrono::system_clock::now(),
+                                _write_buffer);
+    } else {
+      _server_encoder.fill_time(make_daytime_string(), _write_buffer);
+    }
+    hello_.reset();
+    return true;
   }
 
-  void send_mp3() {
-    auto ptr = shared_from_this();
-    _server_encoder.fill_mp3(_file, _write_buffer);
-    send(
-        [ptr]() {
-          LOG(INFO) << "server: sending mp3 envelope success";
-          ptr->send_mp3_inner();
-        },
-        [ptr](const asio::error_code &ec) {
-          LOG(ERROR) << "sending mp3 failed " << ec;
-        });
+  bool on_unix_socket() const {
+    asio::error_code ec;
+    auto endpoint = _socket.local_endpoint(ec);
+    return !ec && endpoint.protocol().family() == AF_UNIX;
   }
-  void send_mp3_inner() {
-    LOG(INFO) << "server: calling sendfile";
-    auto ptr = shared_from_this();
-    if (_file.send(io_context_, _socket,
-                   [ptr](std::size_t left, SendFile &inprogress) {
-                     if (left > 0) {
-                        inprogress.call();
-                     } else {
-                        // hack to make sure ptr has at least 2 use count
-                        ptr->clean_up(ptr);
-                     }
-                   })) {
-    } else {
-      LOG(ERROR) << "sendfile failed";
-      _socket.shutdown(asio::socket_base::shutdown_both);
-      _socket.close();
-    };
+
+  asio::awaitable<void> read_requests(pointer self) {
+    asio::error_code ec;
+    while (!closed_) {
+      auto bytes = co_await _socket.async_read_some(
+          _read_buffer.prepared(),
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        if (ec != asio::error::operation_aborted && ec != asio::error::eof) {
+          LOG(INFO) << "server: read failed " << ec;
+        }
+        break;
+      }
+      client_spoke_ = client_spoke_ || bytes > 0;
+      _read_buffer.consume(bytes);
+      if (!_server_decoder.try_read_server(_read_buffer)) {
+        LOG(ERROR) << "server: bad client message, closing";
+        break;
+      }
+    }
+    // a client gone while paused or held back would keep the session waiting
+    close();
   }
 
-  void clean_up(TcpConnection::pointer ptr) {
-    _file.cancel(); // this clears one last shared ptr on the connection 
-    _socket.close();
-  };
+  void on_track_request(std::string name) {
+    if (broadcast_) {
+      LOG(INFO) << "server: broadcasting, ignoring track request " << name;
+      return;
+    }
+    if (_file || streaming_) {
+      LOG(WARNING) << "server: ignoring track request " << name
+                   << " for a picked track";
+      return;
+    }
+    auto track = catalog_.find(name);
+    if (!track) {
+      // the name is the client's, only its start goes back
+      if (name.size() > max_echoed_name_size) {
+        name.resize(max_echoed_name_size);
+        name += "...";
+      }
+      fail("unknown track " + name);
+      return;
+    }
+    open_track(*track);
+  }
 
-  void on_message(buffers_2<std::string_view> msg) {
-    for (auto part : msg) {
-      LOG(INFO) << "clent sent " << part;
+  bool open_track(const CatalogTrack &track) {
+    LOG(INFO) << "server: streaming track " << track.id << " " << track.name;
+    auto file = Mp3::create(cache_, track.path);
+    if (!file) {
+      fail("track " + track.name + " is not available");
+      return false;
     }
+    _file.emplace(std::move(*file));
+    return true;
   }
 
-  void
-  send(absl::AnyInvocable<void() const> &&continuation,
-       absl::AnyInvocable<void(const asio::error_code &) const> &&on_error) {
-    auto ptr = shared_from_this();
-    _socket.async_write_some(
-        _write_buffer.data(), [this, ptr, on_error = std::move(on_error),
-                               continuation = std::move(continuation)](
-                                  const asio::error_code &ec,
-                                  const size_t bytes_transferred) mutable {
-          if (ec == asio::error::operation_aborted) {
-            return;
+  void on_range_request(RangeRequest request) {
+    if (streaming_) {
+      LOG(WARNING) << "server: ignoring range request while streaming";
+      return;
+    }
+    streaming_ = true;
+    range_ = request;
+    wake();
+  }
+
+  void on_control(Control control) {
+    auto now = Pacer::clock::now();
+    switch (control.command) {
+    case ControlCommand::pause:
+      paused_ = true;
+      if (pacer_) {
+        pacer_->pause(now);
+      }
+      break;
+    case ControlCommand::resume:
+      paused_ = false;
+      if (pacer_) {
+        pacer_->resume(now);
+      }
+      wake();
+      break;
+    case ControlCommand::seek:
+      if (streaming_) {
+        if (!chunked_ || broadcast_ || shm_) {
+          LOG(WARNING) << "server: seek while streaming needs chunked mp3";
+          break;
+        }
+        seek_ = RangeRequest{
+            RangeUnit::milliseconds,
+            static_cast<std::uint64_t>(std::max(control.value, 0))};
+        wake();
+        break;
+      }
+      on_range_request(
+          RangeRequest{RangeUnit::milliseconds,
+                       static_cast<std::uint64_t>(std::max(control.value, 0))});
+      break;
+    case ControlCommand::buffer_level: {
+      // what the client holds beyond the lead is played before it needs more
+      auto ahead =
+          std::chrono::milliseconds(control.value) - options_.pacing.lead;
+      if (ahead.count() > 0) {
+        hold_until_ = now + ahead;
+      } else {
+        hold_until_.reset();
+      }
+      // a sooner end of the hold takes effect at once
+      pace_timer_.cancel();
+      break;
+    }
+    case ControlCommand::stop:
+      LOG(INFO) << "server: client stopped the stream";
+      close();
+      break;
+    default:
+      LOG(WARNING) << "server: unknown control command "
+                   << static_cast<int>(control.command);
+    }
+  }
+
+  /// Waits while the client paused or holds more audio than the lead.
+  /**
+   * Called before every send of the stream, false once the connection is
+   * closed.
+   */
+  asio::awaitable<bool> hold_back() {
+    asio::error_code ec;
+    while (!closed_) {
+      if (paused_) {
+        co_await wait();
+        continue;
+      }
+      if (hold_until_ && *hold_until_ > Pacer::clock::now()) {
+        pace_timer_.expires_at(*hold_until_);
+        co_await pace_timer_.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        continue;
+      }
+      co_return true;
+    }
+    co_return false;
+  }
+
+  // the session sends error to the client and closes the connection
+  void fail(std::string error) {
+    streaming_ = true;
+    error_ = std::move(error);
+    wake();
+  }
+
+  asio::awaitable<void> stream(RangeRequest request) {
+    if (broadcast_) {
+      co_await stream_broadcast();
+      co_return;
+    }
+    if (!_file) {
+      auto track = catalog_.find(options_.default_track);
+      if (!track) {
+        track = catalog_.by_id(0);
+      }
+      if (!open_track(*track)) {
+        co_return;
+      }
+    }
+    auto tag = etag_ ? _file->etag() : std::string();
+    if (!tag.empty()) {
+      _server_encoder.fill_etag(tag, _write_buffer);
+      if (client_tag_ == tag) {
+        // the client plays its copy, it only needs where to start
+        LOG(INFO) << "server: client has track " << tag;
+        fill_range(start_of(request));
+        co_await flush();
+        co_return;
+      }
+    }
+#if defined(__linux__)
+    if (shm_) {
+      co_await stream_shm(start_of(request));
+      co_return;
+    }
+#endif
+    co_await stream_file(start_of(request));
+  }
+
+  // frame aligned offset of the file for a range request
+  std::size_t start_of(RangeRequest request) const {
+    std::size_t start = 0;
+    if (request.offset > 0) {
+      start = request.unit == RangeUnit::milliseconds
+                  ? _file->frame_at_time(
+                        std::chrono::milliseconds(request.offset))
+                  : _file->frame_at_byte(request.offset);
+    }
+    LOG(INFO) << "server: range request " << request.offset << " starts at "
+              << start;
+    return start;
+  }
+
+  // one write per chunk, straight from the mapped track
+  asio::awaitable<void> stream_broadcast() {
+    if (!legacy_) {
+      _server_encoder.fill_range(RangeReply{0, 0, 0}, _write_buffer);
+    }
+    if (!chunked_) {
+      _server_encoder.fill_live_mp3(_write_buffer);
+    }
+    auto sent = co_await flush(more_to_send);
+    if (!sent) {
+      co_return;
+    }
+    auto seq = broadcast_->join_position(options_.pacing.lead);
+    asio::error_code ec;
+    while (!closed_) {
+      auto held = co_await hold_back();
+      if (!held) {
+        co_return;
+      }
+      auto chunk = broadcast_->chunk(seq);
+      if (!chunk) {
+        if (seq < broadcast_->live_edge()) {
+          LOG(INFO) << "server: listener fell behind, skipping to the live edge";
+          seq = broadcast_->join_position(options_.pacing.lead);
+        } else {
+          broadcast_->wait([self = shared_from_this()]() { self->wake(); });
+          co_await wait();
+        }
+        continue;
+      }
+      if (chunked_) {
+        _server_encoder.fill_mp3_chunk(chunk->bytes.size(), _write_buffer);
+      }
+      // what is queued, the chunk envelope last, goes in the same write
+      std::array<asio::const_buffer, 3> parts{};
+      std::size_t count = 0;
+      for (auto part : _write_buffer.data()) {
+        parts[count++] = part;
+      }
+      auto queued = _write_buffer.ready_size();
+      parts[count++] = asio::buffer(chunk->bytes.data(), chunk->bytes.size());
+      co_await asio::async_write(
+          _socket, std::span(parts.data(), count),
+          asio::redirect_error(asio::use_awaitable, ec));
+      _write_buffer.commit(queued);
+      if (ec) {
+        if (ec != asio::error::operation_aborted) {
+          LOG(INFO) << "server: listener left " << ec;
+        }
+        co_return;
+      }
+      seq++;
+    }
+  }
+
+  /// Sends the file from start, paced and held back as the client asks.
+  /**
+   * With chunked mp3 every send is preceded by a chunk envelope, and what
+   * else waits in the write buffer goes out between chunks. A seek takes
+   * effect at the next chunk boundary, it answers with a new range and the
+   * chunks continue from there.
+   */
+  asio::awaitable<void> stream_file(std::size_t start) {
+    // a legacy client only knows the time and mp3 messages
+    auto filled = legacy_ || fill_range(start);
+    if (!filled ||
+        (!chunked_ && !_server_encoder.fill_mp3(*_file, start, _write_buffer))) {
+      fail("track is too big for protocol v1");
+      co_return;
+    }
+    auto sent = co_await flush(more_to_send);
+    if (!sent) {
+      co_return;
+    }
+    LOG(INFO) << "server: calling sendfile";
+    if (_file->byte_rate() > 0) {
+      if (options_.pacing.mode == PacingMode::app) {
+        pacer_.emplace(_file->byte_rate(), options_.pacing);
+      } else if (options_.pacing.mode == PacingMode::kernel) {
+        set_max_pacing_rate();
+      }
+    }
+    // bytes of the file not sent yet, and of the current chunk
+    std::size_t left = _file->size() - start;
+    std::size_t in_chunk = 0;
+    bool started = false;
+    while (left > 0) {
+      if (seek_ && in_chunk == 0) {
+        start = start_of(*std::exchange(seek_, std::nullopt));
+        left = _file->size() - start;
+        fill_range(start);
+        if (pacer_) {
+          pacer_.emplace(_file->byte_rate(), options_.pacing);
+        }
+        // the next send starts a new SendFile from start
+        started = false;
+        continue;
+      }
+      auto next = co_await next_send(_file->size() - start - left, left);
+      if (!next) {
+        co_return;
+      }
+      auto max_len = *next;
+      if (chunked_) {
+        if (in_chunk == 0) {
+          in_chunk = std::min({left, mp3_chunk_max_size, max_len});
+          _server_encoder.fill_mp3_chunk(in_chunk, _write_buffer);
+        }
+        max_len = std::min(max_len, in_chunk);
+      }
+      if (!_write_buffer.empty()) {
+        sent = co_await flush(more_to_send);
+        if (!sent) {
+          co_return;
+        }
+      }
+      if (started) {
+        sending_->call(max_len);
+      } else {
+        // sending_ and chunk_left_ are set before send returns when the
+        // first chunk goes out at once
+        started = _file->send(
+            io_context_, _socket,
+            [this](std::size_t bytes_left, SendFile &inprogress) {
+              sending_ = &inprogress;
+              chunk_left_ = bytes_left;
+              wake();
+            },
+            start, max_len);
+        if (!started) {
+          LOG(ERROR) << "sendfile failed";
+          co_return;
+        }
+      }
+      while (!chunk_left_ && !closed_) {
+        co_await wait();
+      }
+      if (closed_) {
+        co_return;
+      }
+      auto now_left = *std::exchange(chunk_left_, std::nullopt);
+      in_chunk -= std::min(in_chunk, left - now_left);
+      left = now_left;
+    }
+    if (chunked_) {
+      // a zero size chunk ends the track
+      _server_encoder.fill_mp3_chunk(0, _write_buffer);
+      co_await flush();
+    }
+  }
+
+#if defined(__linux__)
+  /// Writes the file from start into a ring shared with the client.
+  /**
+   * The ring's descriptors go to the client with its message, see
+   * shm-ring.hpp. Nothing fits until the client mapped the ring. The ring's
+   * size bounds how far ahead the client gets, app pacing and the client's
+   * holds apply on top as for sendfile. Bytes are copied from the mapped
+   * track, the only syscalls are eventfd writes to a waiting client.
+   */
+  asio::awaitable<void> stream_shm(std::size_t start) {
+    auto ring = ShmRing::create(ShmRing::default_size);
+    if (!ring) {
+      fail("shared memory ring is not available");
+      co_return;
+    }
+    fill_range(start);
+    auto sent = co_await flush();
+    if (!sent) {
+      co_return;
+    }
+    _server_encoder.fill_shm_ring(ShmRingInfo{ring->size()}, _write_buffer);
+    auto fds = ring->fds();
+    sent = co_await flush_with_fds(fds);
+    if (!sent) {
+      co_return;
+    }
+    shm_space_.emplace(io_context_, ::dup(ring->space_ready_fd()));
+    if (_file->byte_rate() > 0 && options_.pacing.mode == PacingMode::app) {
+      pacer_.emplace(_file->byte_rate(), options_.pacing);
+    }
+    // a client that never maps the ring would be waited for as long as it
+    // keeps the connection open
+    asio::steady_timer attach_timer(io_context_);
+    attach_timer.expires_after(shm_attach_timeout);
+    attach_timer.async_wait(
+        [weak = weak_from_this()](const asio::error_code &ec) {
+          auto self = weak.lock();
+          if (!ec && self && self->shm_space_) {
+            asio::error_code cancel_ec;
+            self->shm_space_->cancel(cancel_ec);
+          }
+        });
+    bool attached = false;
+    auto pos = start;
+    asio::error_code ec;
+    while (pos < _file->size()) {
+      if (!attached && ring->attached()) {
+        attached = true;
+        attach_timer.cancel();
+      }
+      auto left = _file->size() - pos;
+      auto next = co_await next_send(pos - start, left);
+      if (!next) {
+        co_return;
+      }
+      auto room = ring->write_span();
+      if (room.empty()) {
+        if (ring->writer_wait()) {
+          co_await shm_space_->async_wait(
+              asio::posix::stream_descriptor::wait_read,
+              asio::redirect_error(asio::use_awaitable, ec));
+          if (closed_) {
+            co_return;
           }
-          LOG(INFO) << "server: sending send" << _write_buffer;
           if (ec) {
-            _write_buffer.commit(bytes_transferred);
-            on_error(ec);
-          } else {
-            _write_buffer.commit(bytes_transferred);
-            if (_write_buffer.empty()) {
-              _write_buffer.reset();
-              continuation();
-            } else {
-              send(std::move(continuation), std::move(on_error));
+            if (!ring->attached()) {
+              fail("the shared memory ring was not attached");
             }
+            co_return;
           }
-        });
+          ShmRing::drain_eventfd(shm_space_->native_handle());
+        }
+        continue;
+      }
+      auto len = _file->read_at(
+          pos, room.first(std::min({room.size(), left, *next})));
+      if (len == 0) {
+        LOG(ERROR) << "server: reading the track failed";
+        co_return;
+      }
+      ring->commit_write(len);
+      pos += len;
+    }
+    ring->finish();
+    LOG(INFO) << "server: shm ring finished at " << pos;
+  }
+
+  // sends the write buffer with fds attached to its first byte
+  asio::awaitable<bool> flush_with_fds(ShmRing::Fds fds) {
+    asio::error_code ec;
+    // sendmsg is called once the socket is writable
+    _socket.native_non_blocking(true, ec);
+    while (true) {
+      co_await _socket.async_wait(
+          StreamSocket::wait_write,
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        co_return false;
+      }
+      // the message is small and the buffer was flushed before it
+      auto first = *_write_buffer.data().begin();
+      auto res = send_with_fds(
+          _socket.native_handle(),
+          std::span(static_cast<const char *>(first.data()), first.size()),
+          fds);
+      if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
+      if (res < 0) {
+        LOG(ERROR) << "server: sending the ring failed " << errno;
+        co_return false;
+      }
+      _write_buffer.commit(res);
+      break;
+    }
+    co_return co_await flush();
+  }
+#endif
+
+  /// Waits until the client and the pacer let the next send go.
+  /**
+   * paced is what the stream sent so far, left what remains. Returns how
+   * much may go now, SendFile::unlimited without a pacer, or nullopt once
+   * the connection is closed.
+   */
+  asio::awaitable<std::optional<std::size_t>> next_send(std::size_t paced,
+                                                        std::size_t left) {
+    asio::error_code ec;
+    while (true) {
+      auto held = co_await hold_back();
+      if (!held) {
+        co_return std::nullopt;
+      }
+      if (!pacer_) {
+        co_return SendFile::unlimited;
+      }
+      auto allowance = pacer_->allowance(paced, Pacer::clock::now());
+      if (paced == 0) {
+        // at least one chunk, so a zero lead still starts the stream
+        co_return std::max(allowance, pacer_->chunk_size());
+      }
+      // the tail of the file is sent as soon as it fits, smaller sends
+      // wait for a full chunk, see Pacer::chunk_size, so a 128 kbit/s
+      // stream wakes about 4 times per second
+      if (allowance >= std::min(left, pacer_->chunk_size())) {
+        co_return allowance;
+      }
+      pace_timer_.expires_at(pacer_->ready_at(paced));
+      co_await pace_timer_.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  bool fill_range(std::size_t start) {
+    return _server_encoder.fill_range(
+        RangeReply{start, _file->size(),
+                   static_cast<int>(_file->duration().count())},
+        _write_buffer);
+  }
+
+  void set_max_pacing_rate() {
+#if defined(SO_MAX_PACING_RATE)
+    unsigned int rate =
+        _file->byte_rate() * (100 + options_.pacing.margin_percent) / 100;
+    if (setsockopt(_socket.native_handle(), SOL_SOCKET, SO_MAX_PACING_RATE,
+                   &rate, sizeof(rate)) != 0) {
+      LOG(WARNING) << "SO_MAX_PACING_RATE failed " << errno;
+    }
+#else
+    LOG(WARNING) << "kernel pacing is not supported, sending unpaced";
+#endif
+  }
+
+  // resumes on wake, close or at until, callers check what they wait for
+  // again. a wake while nothing waited returns the next wait at once
+  asio::awaitable<void>
+  wait(asio::steady_timer::time_point until =
+           asio::steady_timer::time_point::max()) {
+    if (std::exchange(woken_, false)) {
+      co_return;
+    }
+    asio::error_code ec;
+    wake_.expires_at(until);
+    co_await wake_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    woken_ = false;
+  }
+
+  void wake() {
+    woken_ = true;
+    wake_.cancel();
+  }
+
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    pace_timer_.cancel();
+    wake();
+    if (_file) {
+      // an io_uring send in flight no longer reports to the connection
+      _file->precancel();
+    }
+    asio::error_code ec;
+#if defined(__linux__)
+    if (shm_space_) {
+      shm_space_->cancel(ec);
+    }
+#endif
+    _socket.close(ec);
+  }
+
+  void on_message(buffers_2<std::string_view> msg) {
+    for (auto part : msg) {
+      LOG(INFO) << "clent sent " << part;
+    }
+  }
+
+  // sends what the encoder filled, false once the connection failed
+  asio::awaitable<bool> flush(asio::socket_base::message_flags flags = 0) {
+    asio::error_code ec;
+    while (!_write_buffer.empty()) {
+      auto bytes = co_await _socket.async_send(
+          _write_buffer.data(), flags,
+          asio::redirect_error(asio::use_awaitable, ec));
+      LOG(INFO) << "server: sending send" << _write_buffer;
+      _write_buffer.commit(bytes);
+      if (ec) {
+        if (ec != asio::error::operation_aborted) {
+          LOG(ERROR) << "server: send failed " << ec;
+        }
+        co_return false;
+      }
+    }
+    _write_buffer.reset();
+    co_return true;
   }
 
   asio::io_context &io_context_;
-  asio::io_context::strand &strand_;
-  tcp::socket _socket;
+  StreamSocket _socket;
+  Registry *registry_;
+  Registry::slot_type registry_slot_;
   char _delim = '\0';
   bool _was_timeout{false};
+  MediaCache &cache_;
+  const Catalog &catalog_;
+  // null unless the server broadcasts
+  Broadcast *broadcast_;
+  const ServerOptions &options_;
+  std::optional<Pacer> pacer_{};
+  // a range request or an error arrived, later requests are ignored
+  bool streaming_{false};
+  std::optional<RangeRequest> range_{};
+  // the client's hello, until answered
+  std::optional<Hello> hello_{};
+  // mp3 goes in chunks (10) instead of one message (2)
+  bool chunked_{false};
+  // mp3 goes through a shared memory ring (11)
+  bool shm_{false};
+  // the track's tag (12) goes before the range
+  bool etag_{false};
+  // the tag of the client's copy of the track, empty if it has none
+  std::string client_tag_{};
+#if defined(__linux__)
+  // the ring's space ready eventfd, while streaming through it
+  std::optional<asio::posix::stream_descriptor> shm_space_{};
+#endif
+  // where to continue from at the next chunk boundary
+  std::optional<RangeRequest> seek_{};
+  std::optional<std::string> error_{};
+  // reported by the send in flight, taken by the session
+  SendFile *sending_{};
+  std::optional<std::size_t> chunk_left_{};
+  // any byte came from the client, so it is no legacy client
+  bool client_spoke_{false};
+  // streams with nothing but the time and one mp3 message (2)
+  bool legacy_{false};
+  bool paused_{false};
+  // the client reported more audio than the lead, nothing is sent until then
+  std::optional<Pacer::clock::time_point> hold_until_{};
+  bool closed_{false};
+  asio::steady_timer pace_timer_;
+  asio::steady_timer wake_;
+  // wake was called since the last wait returned
+  bool woken_{false};
 
-  Mp3 _file;
-  RingBuffer _write_buffer{8388608, 20000, 40000};
+  // picked by the client, or the default track at its range request
+  std::optional<Mp3> _file{};
+  RingBuffer _write_buffer{write_buffer_size, write_buffer_size / 4,
+                          write_buffer_size / 2};
   ServerEncoder _server_encoder{};
-  RingBuffer _read_buffer{8388608, 20000, 40000};
+  RingBuffer _read_buffer{read_buffer_size, read_buffer_size / 4,
+                         read_buffer_size / 2};
   ServerDecoder _server_decoder;
   DestructionSignaller _destruction_signaller{"TcpConnection"};
 };
 
+#if defined(SO_REUSEPORT)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+static constexpr bool has_reuse_port() {
+#if defined(SO_REUSEPORT)
+  return true;
+#else
+  return false;
+#endif
+}
+
 class TcpServer {
 public:
-  TcpServer(asio::io_context &io_context, asio::io_context::strand &strand)
+  // listen_local also accepts on options.unix_path, a unix socket can only be
+  // bound once so one worker takes all local clients
+  TcpServer(asio::io_context &io_context, MediaCache &cache,
+            const Catalog &catalog, Broadcast *broadcast,
+            const ServerOptions &options, unsigned short port, bool reuse,
+            bool listen_local)
       : io_context_(io_context)
-      , strand_(strand)
-      , acceptor_(io_context, tcp::endpoint(tcp::v4(), 8060)) {
-    start_accept();
+      , cache_(cache)
+      , catalog_(catalog)
+      , broadcast_(broadcast)
+      , options_(options)
+      , acceptor_(io_context) {
+    auto endpoint = tcp::endpoint(tcp::v4(), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+    // every worker binds its own acceptor to the same port, the kernel
+    // balances incoming connections between them
+    if (reuse)
+      acceptor_.set_option(reuse_port(true));
+#endif
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    if (options_.fast_open_queue > 0) {
+      enable_fast_open();
+    }
+    auto pending = std::max<std::size_t>(1, options_.pending_accepts);
+    for (std::size_t i = 0; i < pending; i++) {
+      start_accept(acceptor_);
+    }
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    if (listen_local && !options_.unix_path.empty()) {
+      listen_local_socket();
+      for (std::size_t i = 0; i < pending; i++) {
+        start_accept(*local_acceptor_);
+      }
+    }
+#else
+    if (listen_local && !options_.unix_path.empty()) {
+      LOG(WARNING) << "unix sockets are not supported, listening on TCP only";
+    }
+#endif
   }
+
+  ~TcpServer() {
+    connections_.for_each([](TcpConnection &conn) { conn.detach(); });
+  }
+
   void cancel() {
     acceptor_.close();
-    for (auto &weak_conn : connections_) {
-      if (auto conn = weak_conn.lock()) {
-        LOG(INFO) << "cancelling use count " << conn.use_count();
-        conn->cancel();
-      }
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    if (local_acceptor_) {
+      local_acceptor_->close();
+      std::error_code ec;
+      fs::remove(options_.unix_path, ec);
     }
+#endif
+    if (broadcast_) {
+      broadcast_->stop();
+    }
+    LOG(INFO) << "cancelling " << connections_.size() << " connections";
+    connections_.for_each([](TcpConnection &conn) { conn.cancel(); });
   }
 
 private:
-  void start_accept() {
-    LOG(INFO) << "start accept";
-    TcpConnection::pointer new_connection = TcpConnection::create(io_context_, strand_);
-    acceptor_.async_accept(
-        new_connection->socket(),
-        [this, new_connection](const asio::error_code &error) {
-          LOG(INFO) << "accepted " << error;
+  void enable_fast_open() {
+#if defined(TCP_FASTOPEN)
+    int queue = options_.fast_open_queue;
+    if (setsockopt(acceptor_.native_handle(), IPPROTO_TCP, TCP_FASTOPEN,
+                   reinterpret_cast<const char *>(&queue),
+                   sizeof(queue)) != 0) {
+      LOG(WARNING) << "TCP_FASTOPEN failed " << errno;
+    }
+#else
+    LOG(WARNING) << "TCP Fast Open is not supported";
+#endif
+  }
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+  void listen_local_socket() {
+    // a socket file left by a server that did not stop cleanly refuses the
+    // bind
+    std::error_code remove_ec;
+    fs::remove(options_.unix_path, remove_ec);
+    auto endpoint =
+        asio::local::stream_protocol::endpoint(options_.unix_path.string());
+    local_acceptor_.emplace(io_context_);
+    local_acceptor_->open(endpoint.protocol());
+    local_acceptor_->bind(endpoint);
+    local_acceptor_->listen();
+    LOG(INFO) << "server: listening on " << options_.unix_path;
+  }
+#endif
+
+  // the connection is only created once a client arrived
+  template <typename Acceptor> void start_accept(Acceptor &acceptor) {
+    acceptor.async_accept(
+        io_context_,
+        [this, &acceptor](const asio::error_code &error,
+                          typename Acceptor::protocol_type::socket peer) {
           if (error == asio::error::operation_aborted) {
             LOG(INFO) << "accepted aborted";
             return;
           }
-          connections_.emplace_back(new_connection);
-          this->handle_accept(new_connection, error);
+          this->handle_accept(error, std::move(peer));
+          start_accept(acceptor);
         });
   }
 
-  void handle_accept(TcpConnection::pointer new_connection,
-                     const asio::error_code &error) {
+  void handle_accept(const asio::error_code &error, StreamSocket &&peer) {
     if (!error) {
-      new_connection->start();
+      TcpConnection::create(io_context_, std::move(peer), connections_,
+                            cache_, catalog_, broadcast_, options_)
+          ->start();
+    } else {
+      LOG(WARNING) << "accept failed " << error;
     }
-    start_accept();
   }
 
   asio::io_context &io_context_;
-  asio::io_context::strand &strand_;
+  MediaCache &cache_;
+  const Catalog &catalog_;
+  Broadcast *broadcast_;
+  const ServerOptions &options_;
   tcp::acceptor acceptor_;
-  std::vector<std::weak_ptr<TcpConnection>> connections_;
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+  std::optional<asio::local::stream_protocol::acceptor> local_acceptor_{};
+#endif
+  // live connections of this worker, each removes itself when deleted
+  TcpConnection::Registry connections_;
   DestructionSignaller signaller_{"TcpServer"};
 };
 
+/// Streams over UDP, one coroutine per client endpoint.
+/**
+ * Packets are frame aligned and released at real time plus the pacing lead,
+ * with a parity packet after every group, see udp-stream.hpp. A client that
+ * stops sending keepalives is dropped after idle_timeout. A session starts
+ * only for a request echoing the cookie its address was sent, and only while
+ * the worker streams fewer than max_sessions.
+ */
+class UdpServer {
+public:
+  static constexpr auto idle_timeout = std::chrono::seconds(5);
+  // end packets sent, one of them should make it
+  static constexpr int end_repeats = 3;
+  // sessions streamed at once by one worker, more clients get an error
+  static constexpr std::size_t max_sessions = 256;
+  // cookies waiting for their request, a full table issues no more until
+  // some expire
+  static constexpr std::size_t max_pending = 4096;
+  static constexpr auto cookie_timeout = std::chrono::seconds(5);
+
+  UdpServer(asio::io_context &io_context, MediaCache &cache,
+            const Catalog &catalog, const ServerOptions &options,
+            unsigned short port, bool reuse)
+      : io_context_(io_context)
+      , cache_(cache)
+      , catalog_(catalog)
+      , options_(options)
+      , socket_(io_context)
+      , drop_(options.udp_loss_percent / 100.0) {
+    auto endpoint = udp::endpoint(udp::v4(), port);
+    socket_.open(endpoint.protocol());
+    socket_.set_option(udp::socket::reuse_address(true));
+#if defined(SO_REUSEPORT)
+    // the kernel hashes each client to one worker, so all datagrams of a
+    // session reach the same one
+    if (reuse)
+      socket_.set_option(reuse_port(true));
+#endif
+    socket_.bind(endpoint);
+    asio::co_spawn(io_context_, receive(), asio::detached);
+  }
+
+  void cancel() {
+    asio::error_code ec;
+    socket_.close(ec);
+    for (auto &[endpoint, session] : sessions_) {
+      session->stopped = true;
+      session->timer.cancel();
+    }
+  }
+
+private:
+  struct Session {
+    explicit Session(asio::io_context &io_context, std::uint8_t fec_group)
+        : timer(io_context)
+        , fec(fec_group) {}
+
+    udp::endpoint endpoint;
+    UdpRequest request;
+    asio::steady_timer timer;
+    FecEncoder fec;
+    std::chrono::steady_clock::time_point last_heard;
+    bool stopped{false};
+  };
+
+  // a cookie sent to an address, not echoed yet
+  struct Pending {
+    std::uint64_t cookie;
+    std::chrono::steady_clock::time_point issued;
+  };
+
+  asio::awaitable<void> receive() {
+    std::array<char, 2048> datagram;
+    udp::endpoint from;
+    asio::error_code ec;
+    while (socket_.is_open()) {
+      auto bytes = co_await socket_.async_receive_from(
+          asio::buffer(datagram), from,
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        if (ec == asio::error::operation_aborted) {
+          co_return;
+        }
+        // an ICMP unreachable from a client that left, keep serving
+        continue;
+      }
+      auto request = UdpRequest::decode(std::span(datagram.data(), bytes));
+      if (!request) {
+        continue;
+      }
+      auto found = sessions_.find(from);
+      if (found != sessions_.end()) {
+        found->second->last_heard = std::chrono::steady_clock::now();
+        if (request->kind == UdpRequestKind::stop) {
+          found->second->stopped = true;
+          found->second->timer.cancel();
+        }
+        continue;
+      }
+      if (request->kind != UdpRequestKind::request) {
+        continue;
+      }
+      if (!verified(from, request->cookie)) {
+        if (auto cookie = issue_cookie(from)) {
+          co_await send(from, UdpPacket::make_cookie(*cookie));
+        }
+        continue;
+      }
+      if (sessions_.size() >= max_sessions) {
+        std::string error = "server is full";
+        co_await send(from, UdpPacket{0, UdpPacketKind::error, 0,
+                                      static_cast<std::uint16_t>(error.size()),
+                                      {error.begin(), error.end()}});
+        continue;
+      }
+      auto session =
+          std::make_shared<Session>(io_context_, options_.udp_fec_group);
+      session->endpoint = from;
+      session->request = std::move(*request);
+      session->last_heard = std::chrono::steady_clock::now();
+      sessions_.emplace(from, session);
+      asio::co_spawn(io_context_, stream(session), asio::detached);
+    }
+  }
+
+  // the request echoes the cookie last sent to from, which is used up
+  bool verified(const udp::endpoint &from, std::uint64_t cookie) {
+    auto found = pending_.find(from);
+    if (found == pending_.end() || cookie == 0 ||
+        found->second.cookie != cookie ||
+        std::chrono::steady_clock::now() - found->second.issued >
+            cookie_timeout) {
+      return false;
+    }
+    pending_.erase(found);
+    return true;
+  }
+
+  // the cookie from has to echo, the one it was sent while that is fresh.
+  // nullopt while the table is full
+  std::optional<std::uint64_t> issue_cookie(const udp::endpoint &from) {
+    auto now = std::chrono::steady_clock::now();
+    auto found = pending_.find(from);
+    if (found != pending_.end() && now - found->second.issued <= cookie_timeout) {
+      return found->second.cookie;
+    }
+    if (found == pending_.end() && pending_.size() >= max_pending) {
+      std::erase_if(pending_, [now](const auto &entry) {
+        return now - entry.second.issued > cookie_timeout;
+      });
+      if (pending_.size() >= max_pending) {
+        return std::nullopt;
+      }
+    }
+    std::uint64_t cookie = 0;
+    while (cookie == 0) {
+      cookie = cookies_(random_device_);
+    }
+    pending_.insert_or_assign(from, Pending{cookie, now});
+    return cookie;
+  }
+
+  asio::awaitable<void> stream(std::shared_ptr<Session> session) {
+    co_await stream_track(*session);
+    sessions_.erase(session->endpoint);
+  }
+
+  asio::awaitable<void> stream_track(Session &session) {
+    auto &request = session.request;
+    auto track = request.track.empty() ? catalog_.find(options_.default_track)
+                                       : catalog_.find(request.track);
+    if (!track && request.track.empty()) {
+      track = catalog_.by_id(0);
+    }
+    auto file = track ? cache_.get(track->path) : nullptr;
+    auto index = file ? cache_.index(*file) : nullptr;
+    if (!index) {
+      std::string error = "track " + request.track + " is not available";
+      co_await send(session.endpoint,
+                    UdpPacket{0, UdpPacketKind::error, 0,
+                              static_cast<std::uint16_t>(error.size()),
+                              {error.begin(), error.end()}});
+      co_return;
+    }
+    LOG(INFO) << "server: udp streaming " << track->name << " to "
+              << session.endpoint;
+    auto entries = index->entries();
+    auto start = static_cast<RangeUnit>(request.unit) == RangeUnit::milliseconds
+                     ? index->byte_at_time(
+                           std::chrono::milliseconds(request.offset))
+                     : index->frame_at_byte(request.offset);
+    auto frame = static_cast<std::size_t>(
+        std::lower_bound(entries.begin(), entries.end(), start,
+                         [](const Mp3IndexEntry &entry, std::size_t offset) {
+                           return entry.offset < offset;
+                         }) -
+        entries.begin());
+    auto mapped = file->mapped().size() == file->size();
+    std::vector<char> copy;
+    auto started = std::chrono::steady_clock::now();
+    std::uint64_t samples = 0;
+    asio::error_code ec;
+    while (frame < entries.size() && !session.stopped) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - session.last_heard > idle_timeout) {
+        LOG(INFO) << "server: udp client " << session.endpoint << " went away";
+        co_return;
+      }
+      auto due = started +
+                 std::chrono::microseconds(samples * 1000000 /
+                                           index->sample_rate()) -
+                 options_.pacing.lead;
+      if (due > now) {
+        session.timer.expires_at(due);
+        co_await session.timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        continue;
+      }
+      // whole frames, contiguous in the file, up to a packet
+      auto first = entries[frame].offset;
+      auto end = first + entries[frame].frame_bytes;
+      samples += entries[frame].samples;
+      frame++;
+      while (frame < entries.size() && entries[frame].offset == end &&
+             end + entries[frame].frame_bytes - first <=
+                 UdpPacket::max_payload) {
+        end += entries[frame].frame_bytes;
+        samples += entries[frame].samples;
+        frame++;
+      }
+      std::span<const char> payload;
+      if (mapped) {
+        payload = file->mapped().subspan(first, end - first);
+      } else {
+        copy.resize(end - first);
+        copy.resize(file->read_at(first, copy));
+        payload = copy;
+      }
+      for (auto &packet : session.fec.add(payload)) {
+        co_await send(session.endpoint, std::move(packet));
+      }
+    }
+    if (session.stopped) {
+      co_return;
+    }
+    if (auto parity = session.fec.flush()) {
+      co_await send(session.endpoint, std::move(*parity));
+    }
+    for (int i = 0; i < end_repeats; i++) {
+      co_await send(session.endpoint, UdpPacket{session.fec.next_seq(),
+                                                UdpPacketKind::end, 0, 0, {}});
+    }
+  }
+
+  asio::awaitable<void> send(udp::endpoint to, UdpPacket packet) {
+    if (drop_(random_)) {
+      co_return;
+    }
+    auto datagram = packet.encode();
+    asio::error_code ec;
+    co_await socket_.async_send_to(
+        asio::buffer(datagram), to,
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec && ec != asio::error::operation_aborted) {
+      LOG(INFO) << "server: udp send failed " << ec;
+    }
+  }
+
+  asio::io_context &io_context_;
+  MediaCache &cache_;
+  const Catalog &catalog_;
+  const ServerOptions &options_;
+  udp::socket socket_;
+  std::map<udp::endpoint, std::shared_ptr<Session>> sessions_;
+  std::map<udp::endpoint, Pending> pending_;
+  // cookies must not be guessable from the ones an attacker was sent
+  std::random_device random_device_{};
+  std::uniform_int_distribution<std::uint64_t> cookies_{};
+  // simulated loss
+  std::minstd_rand random_{};
+  std::bernoulli_distribution drop_;
+  DestructionSignaller signaller_{"UdpServer"};
+};
+
+// one io_context, acceptor and thread per core, connections never migrate
+// between workers
+struct ServerWorker {
+  ServerWorker(MediaCache &cache, const Catalog &catalog,
+               const ServerOptions &options, Broadcast::clock::time_point epoch,
+               unsigned short port, bool reuse, bool listen_local)
+      : broadcast_(options.broadcast ? std::make_unique<Broadcast>(
+                                           io_context_, cache, catalog, epoch)
+                                     : nullptr)
+      , server_(io_context_, cache, catalog, broadcast_.get(), options, port,
+                reuse, listen_local) {
+    if (options.udp) {
+      udp_server_.emplace(io_context_, cache, catalog, options, port, reuse);
+    }
+  }
+
+  void cancel() {
+    server_.cancel();
+    if (udp_server_) {
+      udp_server_->cancel();
+    }
+  }
+
+  asio::io_context io_context_{1};
+  // every worker runs its own copy of the channel, in step through epoch
+  std::unique_ptr<Broadcast> broadcast_;
+  TcpServer server_;
+  std::optional<UdpServer> udp_server_{};
+};
+
+static ServerOptions parse_options(int argc, char *argv[]) {
+  ServerOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--threads=")) {
+      options.threads = std::strtoul(arg.substr(10).data(), nullptr, 10);
+      if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+    } else if (arg.starts_with("--port=")) {
+      options.port = static_cast<std::uint16_t>(
+          std::strtoul(arg.substr(7).data(), nullptr, 10));
+    } else if (arg == "--send-backend=sendfile") {
+      options.send_backend = SendFile::Backend::sendfile;
+    } else if (arg == "--send-backend=io_uring") {
+      options.send_backend = SendFile::Backend::io_uring;
+    } else if (arg == "--pacing=off") {
+      options.pacing.mode = PacingMode::off;
+    } else if (arg == "--pacing=app") {
+      options.pacing.mode = PacingMode::app;
+    } else if (arg == "--pacing=kernel") {
+      options.pacing.mode = PacingMode::kernel;
+    } else if (arg.starts_with("--pacing-lead-ms=")) {
+      options.pacing.lead = std::chrono::milliseconds(
+          std::strtoul(arg.substr(17).data(), nullptr, 10));
+    } else if (arg.starts_with("--media-dir=")) {
+      options.media_dir = arg.substr(12);
+    } else if (arg.starts_with("--default-track=")) {
+      options.default_track = arg.substr(16);
+    } else if (arg == "--broadcast") {
+      options.broadcast = true;
+    } else if (arg == "--fast-open") {
+      options.fast_open_queue = 256;
+    } else if (arg == "--udp") {
+      options.udp = true;
+    } else if (arg.starts_with("--udp-fec=")) {
+      options.udp_fec_group = static_cast<std::uint8_t>(
+          std::min(255ul, std::strtoul(arg.substr(10).data(), nullptr, 10)));
+    } else if (arg.starts_with("--udp-loss=")) {
+      options.udp_loss_percent = std::clamp(
+          static_cast<int>(std::strtol(arg.substr(11).data(), nullptr, 10)), 0,
+          100);
+    } else if (arg.starts_with("--unix=")) {
+      options.unix_path = arg.substr(7);
+    } else if (arg.starts_with("--accepts=")) {
+      options.pending_accepts =
+          std::strtoul(arg.substr(10).data(), nullptr, 10);
+    } else {
+      LOG(ERROR) << "unknown argument " << arg;
+      LOG(INFO) << "Usage: asio-server [--threads=N] [--port=N]"
+                << " [--send-backend=sendfile|io_uring]"
+                << " [--pacing=off|app|kernel] [--pacing-lead-ms=N]"
+                << " [--media-dir=DIR] [--default-track=NAME] [--broadcast]"
+                << " [--accepts=N] [--fast-open] [--udp] [--udp-fec=K]"
+                << " [--udp-loss=PCT] [--unix=PATH]"
+                << std::endl
+                << "  --threads=N   worker threads, 0 uses all cores" << std::endl
+                << "  --port=N  TCP and UDP port, default 8060" << std::endl
+                << "  --send-backend=io_uring  send files with io_uring,"
+                << " linux only" << std::endl
+                << "  --pacing=app  send at the track bitrate plus a lead"
+                << std::endl
+                << "  --pacing=kernel  let SO_MAX_PACING_RATE pace, linux only"
+                << std::endl
+                << "  --pacing-lead-ms=N  audio sent ahead, default 2000"
+                << std::endl
+                << "  --media-dir=DIR  library of mp3 files, default .."
+                << std::endl
+                << "  --default-track=NAME  track for clients that do not"
+                << " pick one" << std::endl
+                << "  --broadcast  all clients listen to one live channel"
+                << " playing the catalog" << std::endl
+                << "  --accepts=N  accepts kept pending per worker, default 16"
+                << std::endl
+                << "  --fast-open  accept requests sent with the SYN"
+                << std::endl
+                << "  --udp  also stream over UDP, with parity packets"
+                << std::endl
+                << "  --udp-fec=K  data packets per parity packet, default 4,"
+                << " 0 for none" << std::endl
+                << "  --udp-loss=PCT  drop PCT% of UDP packets, for testing"
+                << std::endl
+                << "  --unix=PATH  also accept local clients on a unix socket";
+      std::exit(1);
+    }
+  }
+  if (options.threads > 1 && !has_reuse_port()) {
+    LOG(WARNING) << "SO_REUSEPORT is not supported, running single threaded";
+    options.threads = 1;
+  }
+  return options;
+}
+
 } // namespace am
 
-int main() {
+int main(int argc, char *argv[]) {
   using namespace am;
 
+  auto options = parse_options(argc, argv);
+  auto threads = options.threads;
+  SendFile::set_backend(options.send_backend);
+  auto catalog = Catalog::scan(options.media_dir);
+  if (catalog.empty()) {
+    LOG(ERROR) << "no mp3 files in " << options.media_dir;
+    return 1;
+  }
   try {
-    asio::io_context io_context;
-    asio::io_context::strand strand{io_context};
-    asio::signal_set signals{io_context, SIGINT};
-    TcpServer server(io_context, strand);
-    signals.async_wait(
-        [&server, &strand](const asio::error_code ec, int signal) {
-          server.cancel();
-        });
-    io_context.run();
+    MediaCache cache;
+    std::vector<std::unique_ptr<ServerWorker>> workers;
+    workers.reserve(threads);
+    auto epoch = Broadcast::clock::now();
+    for (std::size_t i = 0; i < threads; i++) {
+      workers.emplace_back(std::make_unique<ServerWorker>(
+          cache, catalog, options, epoch, options.port, threads > 1, i == 0));
+      if (workers.back()->broadcast_ && !workers.back()->broadcast_->start()) {
+        return 1;
+      }
+    }
+    LOG(INFO) << "serving with " << threads << " threads";
+    auto &main_context = workers.front()->io_context_;
+    asio::signal_set signals{main_context, SIGINT};
+    signals.async_wait([&workers](const asio::error_code ec, int signal) {
+      for (auto &worker : workers) {
+        asio::post(worker->io_context_,
+                   [&worker = *worker]() { worker.cancel(); });
+      }
+    });
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (std::size_t i = 1; i < threads; i++) {
+      pool.emplace_back([&context = workers[i]->io_context_]() {
+        try {
+          context.run();
+        } catch (std::exception &e) {
+          LOG(ERROR) << "worker failed " << e.what();
+        }
+      });
+    }
+    main_context.run();
+    for (auto &thread : pool) {
+      thread.join();
+    }
+    cache.log_stat();
+    LinearMemPool::instance().log_stat();
+    SendFileStats::instance().log_stat();
     LOG(INFO)<<"stopping";
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
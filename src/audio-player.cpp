@@ -30,6 +30,7 @@
 
 #include "audio-player.hpp"
 #include "protocol.hpp"
+#include "startup-timeline.hpp"
 
 namespace am {
 
@@ -95,9 +96,13 @@ struct SdlAudioDevice {
 
 struct Player {
   using OnLowWatermark = std::function<void()>;
+  // called from the audio thread
+  using OnFirstAudio = std::function<void()>;
 
-  static std::unique_ptr<Player> create(OnLowWatermark &&on_low_watermark) {
-    auto *player = new Player(std::move(on_low_watermark));
+  static std::unique_ptr<Player> create(OnLowWatermark &&on_low_watermark,
+                                        OnFirstAudio &&on_first_audio) {
+    auto *player =
+        new Player(std::move(on_low_watermark), std::move(on_first_audio));
     auto res = std::unique_ptr<Player>(player);
 
     res->setup_unit();
@@ -121,6 +126,9 @@ struct Player {
 
     len = (len > audio_len ? audio_len : len);
     _output_buffer.buffer().memcpy_out(stream, len);
+    if (StartupTimeline::instance().mark(Milestone::first_audio)) {
+      on_first_audio_();
+    }
 
     if (_output_buffer.buffer().below_low_watermark()) {
       on_low_watermark_();
@@ -130,6 +138,7 @@ struct Player {
   }
   void start() {
     LOG(INFO) << "audo device started";
+    StartupTimeline::instance().mark(Milestone::device_started);
     started_ = true;
     if (audio_device_.has_value())
       audio_device_->play();
@@ -160,8 +169,9 @@ struct Player {
     LOG(INFO) << memtric_callback_micros_;
   }
 private:
-  Player(OnLowWatermark &&on_low_watermark)
-      : on_low_watermark_(std::move(on_low_watermark)) {}
+  Player(OnLowWatermark &&on_low_watermark, OnFirstAudio &&on_first_audio)
+      : on_low_watermark_(std::move(on_low_watermark))
+      , on_first_audio_(std::move(on_first_audio)) {}
 
   void setup_unit() {
     SDL_AudioSpec spec;
@@ -181,6 +191,7 @@ private:
   Channel _output_buffer{};
   std::atomic_bool started_{false};
   OnLowWatermark on_low_watermark_;
+  OnFirstAudio on_first_audio_;
   std::atomic_int callbacks_called_{};
   Metric<int> metric_underflows_ = Metric<int>::create_counter("underflows");
   Metric<int> metric_len_ = Metric<int>::create_average("sdl callback stream len");
@@ -199,13 +210,22 @@ struct Mp3Stream::Pimpl {
       : input_(input)
       , io_context_(io_context)
       , strand_(strand)
-      , player_(Player::create([this]() {
-        asio::post(io_context_, [this]() { decode_next(); });
-      })) {
+      , player_(Player::create(
+            [this]() {
+              asio::post(io_context_, [this]() { decode_next(); });
+            },
+            [this]() {
+              // logging stays off the audio thread
+              asio::post(io_context_,
+                         []() { StartupTimeline::instance().report(); });
+            })) {
     mp3dec_init(&mp3d_);
   }
 
   void decode_next() {
+    if (input_.buffer().ready_size() > 0) {
+      StartupTimeline::instance().mark(Milestone::first_byte);
+    }
     if (waiting_for_play_) {
       return;
     }
@@ -260,6 +280,7 @@ struct Mp3Stream::Pimpl {
       } else {
         buffer.commit(info.frame_bytes);
         if (samples) {
+          StartupTimeline::instance().mark(Milestone::first_frame);
           decoded_frames_++;
           // TODO: what if it does not fit
           player_buffer.memcpy_in(pcm.data(), decoded_size);
@@ -0,0 +1,163 @@
+#include "broadcast.hpp"
+
+#include <absl/log/log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace am {
+
+Broadcast::Broadcast(asio::io_context &io_context, MediaCache &cache,
+                     const Catalog &catalog, clock::time_point epoch)
+    : io_context_(io_context)
+    , cache_(cache)
+    , catalog_(catalog)
+    , timer_(io_context)
+    , next_release_(epoch)
+    , ring_(ring_size) {}
+
+bool Broadcast::start(clock::time_point now) {
+  if (!open_next_track()) {
+    LOG(ERROR) << "broadcast: no track of the catalog can be played";
+    return false;
+  }
+  stopped_ = false;
+  release(now);
+  return true;
+}
+
+void Broadcast::stop() {
+  stopped_ = true;
+  timer_.cancel();
+  waiters_.clear();
+}
+
+std::uint64_t
+Broadcast::join_position(std::chrono::milliseconds lead) const {
+  auto oldest = next_seq_ > ring_size ? next_seq_ - ring_size : 0;
+  auto seq = next_seq_;
+  std::chrono::microseconds behind{0};
+  while (seq > oldest && behind < lead) {
+    seq--;
+    behind += ring_[seq % ring_size].duration;
+  }
+  return seq;
+}
+
+std::optional<BroadcastChunk> Broadcast::chunk(std::uint64_t seq) const {
+  if (seq >= next_seq_ || next_seq_ - seq > ring_size) {
+    return std::nullopt;
+  }
+  return ring_[seq % ring_size];
+}
+
+void Broadcast::wait(absl::AnyInvocable<void()> on_released) {
+  if (stopped_) {
+    return;
+  }
+  waiters_.push_back(std::move(on_released));
+}
+
+bool Broadcast::open_next_track() {
+  track_.reset();
+  for (std::size_t tries = 0; tries < catalog_.size(); tries++) {
+    auto track = catalog_.by_id(next_track_id_);
+    next_track_id_ = (next_track_id_ + 1) % catalog_.size();
+    auto file = cache_.get(track->path);
+    if (!file) {
+      continue;
+    }
+    auto index = cache_.index(*file);
+    if (!index) {
+      continue;
+    }
+    LOG(INFO) << "broadcast: playing " << track->name;
+    track_.emplace(Track{std::move(file), std::move(index)});
+    return true;
+  }
+  return false;
+}
+
+BroadcastChunk Broadcast::next_chunk() {
+  auto entries = track_->index->entries();
+  auto first = track_->frame;
+  auto end_offset = entries[first].offset;
+  std::size_t samples = 0;
+  auto min_samples = static_cast<std::size_t>(
+      track_->index->sample_rate() *
+      std::chrono::milliseconds(chunk_duration).count() / 1000);
+  // a gap in the index ends the chunk, the next one starts after it
+  while (track_->frame < entries.size() && samples < min_samples &&
+         entries[track_->frame].offset == end_offset) {
+    auto &entry = entries[track_->frame];
+    end_offset = entry.offset + entry.frame_bytes;
+    samples += entry.samples;
+    track_->frame++;
+  }
+  BroadcastChunk chunk{};
+  chunk.seq = next_seq_;
+  chunk.duration = std::chrono::microseconds(
+      samples * 1000000 / track_->index->sample_rate());
+  auto start = entries[first].offset;
+  auto len = end_offset - start;
+  auto &file = track_->file;
+  if (file->mapped().size() == file->size()) {
+    chunk.bytes = file->mapped().subspan(start, len);
+    chunk.owner = file;
+  } else {
+    // no mapping on this platform, one read per chunk shared by listeners
+    auto copy = std::make_shared<std::vector<char>>(len);
+    copy->resize(file->read_at(start, *copy));
+    chunk.bytes = *copy;
+    chunk.owner = std::move(copy);
+  }
+  return chunk;
+}
+
+void Broadcast::release(clock::time_point now) {
+  if (stopped_) {
+    return;
+  }
+  bool released = false;
+  while (next_release_ <= now) {
+    if (track_->frame >= track_->index->frame_count() && !open_next_track()) {
+      LOG(ERROR) << "broadcast: no track left to play, stopping";
+      stop();
+      return;
+    }
+    auto chunk = next_chunk();
+    next_release_ += chunk.duration;
+    ring_[next_seq_ % ring_size] = std::move(chunk);
+    next_seq_++;
+    released = true;
+  }
+  if (released) {
+    // waiters may wait again from their callback
+    auto waiters = std::move(waiters_);
+    waiters_.clear();
+    for (auto &waiter : waiters) {
+      waiter();
+    }
+  }
+  schedule();
+}
+
+void Broadcast::schedule() {
+  if (stopped_) {
+    return;
+  }
+  timer_.expires_at(next_release_);
+  timer_.async_wait([this](const asio::error_code &ec) {
+    if (ec == asio::error::operation_aborted) {
+      return;
+    }
+    release(clock::now());
+  });
+}
+
+} // namespace am
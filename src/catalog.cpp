@@ -0,0 +1,78 @@
+#include "catalog.hpp"
+
+#include <absl/log/log.h>
+#include <absl/strings/string_view.h>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace am {
+
+namespace {
+
+bool is_mp3(const fs::path &path) {
+  auto ext = path.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return ext == ".mp3";
+}
+
+} // namespace
+
+Catalog Catalog::scan(const fs::path &dir) {
+  Catalog catalog;
+  std::vector<fs::path> paths;
+  std::error_code ec;
+  auto it = fs::recursive_directory_iterator(
+      dir, fs::directory_options::skip_permission_denied, ec);
+  for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (it->is_regular_file(ec) && is_mp3(it->path())) {
+      paths.push_back(it->path().lexically_relative(dir));
+    }
+  }
+  if (ec) {
+    LOG(ERROR) << "catalog: scanning " << dir << " failed " << ec.message();
+  }
+  std::sort(paths.begin(), paths.end());
+
+  catalog.tracks_.reserve(paths.size());
+  catalog.by_name_.reserve(paths.size());
+  for (auto &relative : paths) {
+    auto name = relative;
+    name.replace_extension();
+    auto id = static_cast<std::uint32_t>(catalog.tracks_.size());
+    catalog.tracks_.push_back(
+        CatalogTrack{id, name.generic_string(), dir / relative});
+    catalog.by_name_.emplace(catalog.tracks_.back().name, id);
+  }
+  LOG(INFO) << "catalog: " << catalog.size() << " tracks in " << dir;
+  return catalog;
+}
+
+const CatalogTrack *Catalog::find(std::string_view key) const {
+  if (auto track = by_name(key)) {
+    return track;
+  }
+  std::uint32_t id = 0;
+  auto [end, ec] = std::from_chars(key.data(), key.data() + key.size(), id);
+  if (ec == std::errc() && end == key.data() + key.size()) {
+    return by_id(id);
+  }
+  return nullptr;
+}
+
+const CatalogTrack *Catalog::by_id(std::uint32_t id) const {
+  return id < tracks_.size() ? &tracks_[id] : nullptr;
+}
+
+const CatalogTrack *Catalog::by_name(std::string_view name) const {
+  auto it = by_name_.find(absl::string_view(name.data(), name.size()));
+  return it != by_name_.end() ? &tracks_[it->second] : nullptr;
+}
+
+} // namespace am
@@ -1,13 +1,39 @@
 #include "client-protocol.hpp"
 #include "protocol.hpp"
 #include <absl/log/log.h>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
 
 namespace am {
 
 void ClientDecoder::try_read_client(RingBuffer &state) {
   if (try_read(state)) {
     //_envelope.log();
-    if (_envelope.message_type == 1) {
+    if ((_envelope.message_type == 1 || _envelope.message_type == 7 ||
+         _envelope.message_type == 12) &&
+        _envelope.message_size > state.capacity()) {
+      if (_envelope.message_size > max_buffer_size) {
+        LOG(ERROR) << "client: server message too big "
+                   << _envelope.message_size;
+        _state = DecoderState::failed;
+        return;
+      }
+      state.reserve(_envelope.message_size);
+    }
+    if (_envelope.message_type == 1 &&
+        (_capabilities & capability::binary_time)) {
+      if (state.ready_size() >= 8) {
+        auto since_epoch = static_cast<std::time_t>(fields(state).get_size() /
+                                                    1000000);
+        std::string time = std::ctime(&since_epoch);
+        reset();
+        on_time_(buffers_2(std::string_view(time)));
+        try_read_client(state);
+      }
+    } else if (_envelope.message_type == 1) {
       // get time
       if (state.ready_size() >= _envelope.message_size) {
         // got time
@@ -16,12 +42,78 @@ void ClientDecoder::try_read_client(RingBuffer &state) {
         reset();
         try_read_client(state);
       }
-    } else if (_envelope.message_type == 2) {
-      const auto read_size = std::min(static_cast<int>(state.ready_size()),
-                                      _envelope.message_size);
-      on_mp3_bytes_(state);
+    } else if (_envelope.message_type == 5) {
+      if (state.ready_size() >= RangeReply::wire_size(_version)) {
+        auto fields = this->fields(state);
+        RangeReply range{};
+        range.start = fields.get_size();
+        range.total = fields.get_size();
+        range.duration_ms = fields.get_int();
+        on_range_(range);
+        reset();
+        try_read_client(state);
+      }
+    } else if (_envelope.message_type == 9) {
+      if (state.ready_size() >= Hello::wire_size) {
+        FieldReader fields{WireVersion::v2, state};
+        _version = static_cast<WireVersion>(fields.get_u32());
+        _capabilities = fields.get_u32();
+        LOG(INFO) << "client: server speaks v" << static_cast<int>(_version)
+                  << " capabilities " << _capabilities;
+        reset();
+        if (on_hello_) {
+          on_hello_();
+        }
+        try_read_client(state);
+      }
+    } else if (_envelope.message_type == 11) {
+      if (state.ready_size() >= ShmRingInfo::wire_size) {
+        ShmRingInfo ring{fields(state).get_size()};
+        reset();
+        if (on_shm_ring_) {
+          on_shm_ring_(ring);
+        }
+        try_read_client(state);
+      }
+    } else if (_envelope.message_type == 12) {
+      if (state.ready_size() >= _envelope.message_size) {
+        std::string tag;
+        for (auto part : state.peek_string_view(_envelope.message_size)) {
+          tag.append(part);
+        }
+        state.commit(_envelope.message_size);
+        reset();
+        if (on_etag_) {
+          on_etag_(std::move(tag));
+        }
+        try_read_client(state);
+      }
+    } else if (_envelope.message_type == 7) {
       if (state.ready_size() >= _envelope.message_size) {
-        // finished the file
+        std::string error;
+        for (auto part : state.peek_string_view(_envelope.message_size)) {
+          error.append(part);
+        }
+        state.commit(_envelope.message_size);
+        reset();
+        on_error_(std::move(error));
+      }
+    } else if (_envelope.message_type == 2 || _envelope.message_type == 10) {
+      if (_envelope.message_type == 10 && _envelope.message_size == 0) {
+        LOG(INFO) << "client: end of track";
+        reset();
+        try_read_client(state);
+        return;
+      }
+      auto payload = std::min<std::uint64_t>(state.ready_size(),
+                                             _envelope.message_size - _mp3_read);
+      if (payload > 0) {
+        auto taken = on_mp3_bytes_(state.peek_span(static_cast<int>(payload)));
+        state.commit(taken);
+        _mp3_read += taken;
+      }
+      if (_mp3_read == _envelope.message_size) {
+        _mp3_read = 0;
         reset();
         try_read_client(state);
       }
@@ -29,8 +121,48 @@ void ClientDecoder::try_read_client(RingBuffer &state) {
   }
 }
 
+void ClientDecoder::reset_connection() {
+  reset();
+  _version = WireVersion::v1;
+  _capabilities = 0;
+  _mp3_read = 0;
+}
+
+void ClientEncoder::fill_hello(Hello hello, RingBuffer &buff) {
+  fill_envelope(Envelope{9, Hello::wire_size}, buff);
+  FieldWriter fields{WireVersion::v2, buff};
+  fields.put_u32(static_cast<std::uint32_t>(hello.version));
+  fields.put_u32(hello.capabilities);
+  _version = WireVersion::v2;
+}
+
 void ClientEncoder::fill_message(std::string_view msg, RingBuffer &buff) {
-  fill_envelope(Envelope{3, static_cast<int>(msg.size())}, buff);
+  fill_envelope(Envelope{3, msg.size()}, buff);
   buff.memcpy_in(static_cast<const char *>(msg.data()), msg.size());
 }
+
+void ClientEncoder::fill_track_request(std::string_view track,
+                                       RingBuffer &buff) {
+  fill_envelope(Envelope{6, track.size()}, buff);
+  buff.memcpy_in(track.data(), track.size());
+}
+
+void ClientEncoder::fill_etag(std::string_view tag, RingBuffer &buff) {
+  fill_envelope(Envelope{12, tag.size()}, buff);
+  buff.memcpy_in(tag.data(), tag.size());
+}
+
+void ClientEncoder::fill_range_request(RangeRequest request, RingBuffer &buff) {
+  fill_envelope(Envelope{4, RangeRequest::wire_size(_version)}, buff);
+  auto fields = this->fields(buff);
+  fields.put_int(static_cast<int>(request.unit));
+  fields.put_size(request.offset);
+}
+
+void ClientEncoder::fill_control(Control control, RingBuffer &buff) {
+  fill_envelope(Envelope{8, Control::wire_size}, buff);
+  auto fields = this->fields(buff);
+  fields.put_int(static_cast<int>(control.command));
+  fields.put_int(control.value);
+}
 } // namespace am
@@ -2,6 +2,7 @@
 #include "audio-player.hpp"
 #include "client-protocol.hpp"
 #include "protocol.hpp"
+#include "startup-timeline.hpp"
 
 #include <absl/log/log.h>
 #include <asio/io_context.hpp>
@@ -16,11 +17,20 @@ Driver::Driver(asio::io_context &io_context, asio::io_context::strand &strand,
     , strand_(strand)
     , work_guard_(io_context.get_executor())
     , host_(std::move(host))
-    , mp3_stream_(buffer_, io_context, strand) {}
+    , mp3_stream_(buffer_, io_context, strand) {
+  if (auto dir = TrackCache::default_dir(); !dir.empty()) {
+    cache_.emplace(std::move(dir));
+  }
+}
 
 void Driver::play(Song &&song) {
-  asio_client_.emplace(context_, strand_, mp3_stream_);
-  asio_client_->connect(host_);
+  StartupTimeline::instance().begin();
+  asio_client_.emplace(context_, strand_, mp3_stream_,
+                       cache_ ? &*cache_ : nullptr);
+  asio_client_->connect(
+      host_, std::move(song.name),
+      RangeRequest{RangeUnit::milliseconds,
+                   static_cast<std::uint64_t>(song.start.count())});
 }
 
 } // namespace am
@@ -30,10 +40,18 @@ int main(int argc, char *argv[]) {
 
   std::srand(std::time(nullptr));
 
-  if (argc != 2) {
-    LOG(INFO) << "Usage: driver <host>" << std::endl;
+  if (argc < 2 || argc > 4) {
+    LOG(INFO) << "Usage: driver <host|udp:host|unix:path>"
+              << " [track name or id [start seconds]]" << std::endl;
     return 1;
   }
+  Song song{};
+  if (argc >= 3) {
+    song.name = argv[2];
+  }
+  if (argc == 4) {
+    song.start = std::chrono::seconds(std::strtol(argv[3], nullptr, 10));
+  }
 
   std::atomic_int should_stop = 0;
 
@@ -45,7 +63,7 @@ int main(int argc, char *argv[]) {
   });
 
   auto driver = am::Driver(io_context, strand, argv[1]);
-  driver.play({});
+  driver.play(std::move(song));
 
   while (!should_stop) {
     io_context.run_one();
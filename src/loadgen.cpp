@@ -0,0 +1,474 @@
+#include <absl/log/log.h>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/error.hpp>
+#include <asio/error_code.hpp>
+#include <asio/generic/stream_protocol.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/local/stream_protocol.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/use_awaitable.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define MINIMP3_IMPLEMENTATION
+#define MINIMP3_ONLY_MP3
+#define MINIMP3_FLOAT_OUTPUT
+#include <minimp3.h>
+
+#include "client-protocol.hpp"
+#include "protocol.hpp"
+
+using asio::ip::tcp;
+
+namespace am {
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadOptions {
+  // "name" over TCP or "unix:path"
+  std::string host;
+  std::size_t sessions = 10;
+  // between the starts of two sessions
+  std::chrono::milliseconds ramp{100};
+  // empty for the server's default track
+  std::string track{};
+  // decode the mp3 like a player would, to load the client side too
+  bool decode = false;
+  // sessions still streaming then are stopped, 0 streams tracks to the end
+  std::chrono::seconds duration{0};
+  std::size_t threads = 1;
+};
+
+enum class SessionEnd { completed, stopped, error };
+
+struct SessionResult {
+  SessionEnd end{SessionEnd::error};
+  // why, for errors
+  std::string error{};
+  std::optional<Clock::duration> connect{};
+  // from the start of the connect to the first mp3 byte
+  std::optional<Clock::duration> first_byte{};
+  std::uint64_t bytes{0};
+  std::uint64_t frames{0};
+  double audio_seconds{0};
+  Clock::duration decode_time{};
+};
+
+/// What the sessions share while they run.
+struct LoadStats {
+  std::atomic<std::uint64_t> bytes{0};
+  std::atomic<std::size_t> active{0};
+  std::atomic<std::size_t> finished{0};
+  std::mutex mutex;
+  std::vector<SessionResult> results;
+
+  void add(SessionResult result) {
+    std::lock_guard lock(mutex);
+    results.push_back(std::move(result));
+  }
+};
+
+/// Decodes mp3 bytes as they come, keeping only the frame not complete yet.
+struct FrameCounter {
+  // the longest mp3 frame, fewer bytes may hold a frame cut in two
+  static constexpr std::size_t max_frame_bytes = 1441;
+
+  FrameCounter() { mp3dec_init(&decoder_); }
+
+  void add(bytes_view bytes, SessionResult &result, bool last) {
+    auto started = Clock::now();
+    pending_.insert(pending_.end(), bytes.begin(), bytes.end());
+    std::size_t pos = 0;
+    while (pending_.size() - pos >= (last ? 1 : 2 * max_frame_bytes)) {
+      mp3dec_frame_info_t info{};
+      auto samples = mp3dec_decode_frame(
+          &decoder_, reinterpret_cast<const std::uint8_t *>(&pending_[pos]),
+          static_cast<int>(pending_.size() - pos), pcm_.data(), &info);
+      if (info.frame_bytes == 0) {
+        break;
+      }
+      pos += info.frame_bytes;
+      if (samples > 0 && info.hz > 0) {
+        result.frames++;
+        result.audio_seconds += static_cast<double>(samples) / info.hz;
+      }
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + pos);
+    result.decode_time += Clock::now() - started;
+  }
+
+  mp3dec_t decoder_{};
+  std::vector<char> pending_{};
+  std::array<mp3d_sample_t, MINIMP3_MAX_SAMPLES_PER_FRAME> pcm_{};
+};
+
+// writes buff until it is empty
+static asio::awaitable<bool>
+flush(asio::generic::stream_protocol::socket &socket, RingBuffer &buff) {
+  asio::error_code ec;
+  while (!buff.empty()) {
+    auto bytes = co_await socket.async_write_some(
+        buff.data(), asio::redirect_error(asio::use_awaitable, ec));
+    buff.commit(bytes);
+    if (ec) {
+      co_return false;
+    }
+  }
+  co_return true;
+}
+
+/// One listener, from its start in the ramp to the end of the track.
+/**
+ * Speaks like the player's client, a hello with chunked mp3, the track and
+ * a range from 0, and counts what comes. Sessions still streaming at
+ * stop_at send stop and close.
+ */
+static asio::awaitable<void>
+run_session(const LoadOptions &options, const tcp::resolver::results_type &endpoints,
+            Clock::time_point start_at, std::optional<Clock::time_point> stop_at,
+            LoadStats &stats) {
+  auto executor = co_await asio::this_coro::executor;
+  asio::steady_timer timer(executor);
+  asio::error_code ec;
+  timer.expires_at(start_at);
+  co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+
+  SessionResult result{};
+  stats.active++;
+  auto started = Clock::now();
+  asio::generic::stream_protocol::socket socket(executor);
+  if (options.host.starts_with("unix:")) {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    co_await socket.async_connect(
+        asio::local::stream_protocol::endpoint(options.host.substr(5)),
+        asio::redirect_error(asio::use_awaitable, ec));
+#else
+    ec = asio::error::operation_not_supported;
+#endif
+  } else {
+    ec = asio::error::host_not_found;
+    for (auto &entry : endpoints) {
+      socket.close(ec);
+      socket.open(entry.endpoint().protocol(), ec);
+      if (ec) {
+        continue;
+      }
+      co_await socket.async_connect(
+          entry.endpoint(), asio::redirect_error(asio::use_awaitable, ec));
+      if (!ec) {
+        break;
+      }
+    }
+  }
+  if (ec) {
+    result.error = "connect: " + ec.message();
+  } else {
+    result.connect = Clock::now() - started;
+  }
+
+  RingBuffer write_buffer{4096, 1024, 2048};
+  RingBuffer read_buffer{65535, 20000, 40000};
+  ClientEncoder encoder{};
+  std::optional<std::uint64_t> total{};
+  std::optional<FrameCounter> frames{};
+  if (options.decode) {
+    frames.emplace();
+  }
+  ClientDecoder decoder(
+      [](buffers_2<std::string_view>) {},
+      [&total](RangeReply range) { total = range.total - range.start; },
+      [&](buffers_2<bytes_view> bytes) {
+        if (!result.first_byte) {
+          result.first_byte = Clock::now() - started;
+        }
+        result.bytes += bytes.size();
+        stats.bytes += bytes.size();
+        if (frames) {
+          for (auto part : bytes) {
+            frames->add(part, result, total && result.bytes == *total);
+          }
+        }
+        return bytes.size();
+      },
+      [&result](std::string error) { result.error = "refused: " + error; });
+
+  bool timed_out = false;
+  if (result.connect) {
+    if (stop_at) {
+      timer.expires_at(*stop_at);
+      timer.async_wait([&socket, &timed_out](const asio::error_code &ec) {
+        if (!ec) {
+          timed_out = true;
+          asio::error_code ignored;
+          socket.cancel(ignored);
+        }
+      });
+    }
+    encoder.fill_hello(Hello{wire_version_latest, capability::binary_time |
+                                                      capability::chunked_mp3},
+                       write_buffer);
+    if (!options.track.empty()) {
+      encoder.fill_track_request(options.track, write_buffer);
+    }
+    encoder.fill_range_request(RangeRequest{RangeUnit::bytes, 0}, write_buffer);
+    auto sent = co_await flush(socket, write_buffer);
+    while (sent) {
+      auto bytes = co_await socket.async_read_some(
+          read_buffer.prepared(), asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        if (timed_out) {
+          result.end = SessionEnd::stopped;
+          encoder.fill_control(Control{ControlCommand::stop, 0}, write_buffer);
+          co_await flush(socket, write_buffer);
+        } else if (result.error.empty()) {
+          result.error = "read: " + ec.message();
+        }
+        break;
+      }
+      read_buffer.consume(bytes);
+      decoder.try_read_client(read_buffer);
+      if (decoder.failed()) {
+        result.error = "bad server message";
+        break;
+      }
+      if (total && result.bytes == *total) {
+        result.end = SessionEnd::completed;
+        break;
+      }
+    }
+    if (!sent) {
+      result.error = "send failed";
+    }
+    timer.cancel();
+  }
+  socket.close(ec);
+  if (result.end != SessionEnd::error) {
+    result.error.clear();
+  }
+  stats.active--;
+  stats.add(std::move(result));
+  stats.finished++;
+}
+
+// nearest rank, in milliseconds
+static double percentile_ms(const std::vector<Clock::duration> &sorted,
+                            double percent) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto rank = static_cast<std::size_t>(percent / 100 * (sorted.size() - 1) + 0.5);
+  return std::chrono::duration<double, std::milli>(sorted[rank]).count();
+}
+
+static void print_percentiles(std::string_view name,
+                              std::vector<Clock::duration> samples) {
+  std::sort(samples.begin(), samples.end());
+  std::cout << name << " ms p50 " << percentile_ms(samples, 50) << " p90 "
+            << percentile_ms(samples, 90) << " p99 "
+            << percentile_ms(samples, 99) << " max "
+            << percentile_ms(samples, 100) << " of " << samples.size()
+            << std::endl;
+}
+
+static void report(const LoadOptions &options, LoadStats &stats,
+                   Clock::duration elapsed) {
+  std::lock_guard lock(stats.mutex);
+  std::size_t completed = 0, stopped = 0, errors = 0;
+  std::uint64_t bytes = 0, frames = 0;
+  double audio_seconds = 0;
+  Clock::duration decode_time{};
+  std::vector<Clock::duration> connect, first_byte;
+  std::map<std::string, std::size_t> reasons;
+  for (auto &result : stats.results) {
+    switch (result.end) {
+    case SessionEnd::completed:
+      completed++;
+      break;
+    case SessionEnd::stopped:
+      stopped++;
+      break;
+    case SessionEnd::error:
+      errors++;
+      reasons[result.error]++;
+      break;
+    }
+    bytes += result.bytes;
+    frames += result.frames;
+    audio_seconds += result.audio_seconds;
+    decode_time += result.decode_time;
+    if (result.connect) {
+      connect.push_back(*result.connect);
+    }
+    if (result.first_byte) {
+      first_byte.push_back(*result.first_byte);
+    }
+  }
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "sessions " << stats.results.size() << " completed "
+            << completed << " stopped " << stopped << " errors " << errors
+            << std::endl;
+  std::cout << "throughput " << bytes / seconds / (1024 * 1024)
+            << " MiB/s over " << seconds << " s, "
+            << (stats.results.empty()
+                    ? 0.0
+                    : bytes * 8 / seconds / 1000 / stats.results.size())
+            << " kbit/s per session" << std::endl;
+  print_percentiles("connect", std::move(connect));
+  if (!first_byte.empty()) {
+    print_percentiles("first byte", std::move(first_byte));
+  }
+  if (options.decode) {
+    auto decode_seconds = std::chrono::duration<double>(decode_time).count();
+    std::cout << "decoded " << frames << " frames, " << audio_seconds
+              << " s of audio in " << decode_seconds
+              << " s of cpu" << std::endl;
+  }
+  for (auto &[reason, count] : reasons) {
+    std::cout << "error " << count << "x " << reason << std::endl;
+  }
+}
+
+static LoadOptions parse_options(int argc, char *argv[]) {
+  LoadOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--sessions=")) {
+      options.sessions = std::strtoul(arg.substr(11).data(), nullptr, 10);
+    } else if (arg.starts_with("--ramp-ms=")) {
+      options.ramp = std::chrono::milliseconds(
+          std::strtoul(arg.substr(10).data(), nullptr, 10));
+    } else if (arg.starts_with("--track=")) {
+      options.track = arg.substr(8);
+    } else if (arg == "--decode") {
+      options.decode = true;
+    } else if (arg.starts_with("--seconds=")) {
+      options.duration = std::chrono::seconds(
+          std::strtoul(arg.substr(10).data(), nullptr, 10));
+    } else if (arg.starts_with("--threads=")) {
+      options.threads = std::max(
+          1ul, std::strtoul(arg.substr(10).data(), nullptr, 10));
+    } else if (!arg.starts_with("--") && options.host.empty()) {
+      options.host = arg;
+    } else {
+      LOG(ERROR) << "unknown argument " << arg;
+      options.host.clear();
+      break;
+    }
+  }
+  if (options.host.empty() || options.sessions == 0) {
+    LOG(INFO) << "Usage: loadgen <host|unix:path> [--sessions=N] [--ramp-ms=N]"
+              << " [--track=NAME] [--decode] [--seconds=N] [--threads=N]"
+              << std::endl
+              << "  --sessions=N  concurrent streams, default 10" << std::endl
+              << "  --ramp-ms=N  between the starts of two sessions, default"
+              << " 100" << std::endl
+              << "  --track=NAME  track name or id, default the server's"
+              << std::endl
+              << "  --decode  decode the mp3 as a player would" << std::endl
+              << "  --seconds=N  stop sessions after N seconds, default at"
+              << " the end of the track" << std::endl
+              << "  --threads=N  client threads, default 1";
+    std::exit(1);
+  }
+  return options;
+}
+
+} // namespace am
+
+int main(int argc, char *argv[]) {
+  using namespace am;
+
+  auto options = parse_options(argc, argv);
+  std::vector<std::unique_ptr<asio::io_context>> contexts;
+  for (std::size_t i = 0; i < options.threads; i++) {
+    contexts.emplace_back(std::make_unique<asio::io_context>(1));
+  }
+  tcp::resolver::results_type endpoints;
+  if (!options.host.starts_with("unix:")) {
+    tcp::resolver resolver(*contexts.front());
+    asio::error_code ec;
+    endpoints = resolver.resolve(options.host, "8060", ec);
+    if (ec) {
+      LOG(ERROR) << "resolving " << options.host << " failed " << ec;
+      return 1;
+    }
+  }
+
+  LoadStats stats;
+  auto start = Clock::now();
+  std::optional<Clock::time_point> stop_at;
+  if (options.duration.count() > 0) {
+    stop_at = start + options.duration;
+  }
+  for (std::size_t i = 0; i < options.sessions; i++) {
+    asio::co_spawn(*contexts[i % contexts.size()],
+                   run_session(options, endpoints, start + i * options.ramp,
+                               stop_at, stats),
+                   asio::detached);
+  }
+
+  // checks for the end of the last session, and prints progress every
+  // progress_interval, keeping the first context running until then
+  constexpr auto progress_interval = std::chrono::seconds(5);
+  asio::steady_timer progress(*contexts.front());
+  std::uint64_t last_bytes = 0;
+  auto last = start;
+  std::function<void(const asio::error_code &)> tick =
+      [&](const asio::error_code &ec) {
+        if (ec || stats.finished == options.sessions) {
+          return;
+        }
+        auto now = Clock::now();
+        if (now - last >= progress_interval) {
+          auto bytes = stats.bytes.load();
+          auto seconds = std::chrono::duration<double>(now - last).count();
+          std::cout << std::fixed << std::setprecision(1) << "active "
+                    << stats.active << " finished " << stats.finished << " "
+                    << (bytes - last_bytes) / seconds / (1024 * 1024)
+                    << " MiB/s" << std::endl;
+          last_bytes = bytes;
+          last = now;
+        }
+        progress.expires_after(std::chrono::milliseconds(250));
+        progress.async_wait(tick);
+      };
+  progress.expires_after(std::chrono::milliseconds(250));
+  progress.async_wait(tick);
+
+  std::vector<std::thread> pool;
+  for (std::size_t i = 1; i < contexts.size(); i++) {
+    pool.emplace_back([&context = *contexts[i]]() { context.run(); });
+  }
+  contexts.front()->run();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  report(options, stats, Clock::now() - start);
+  auto failed = std::any_of(
+      stats.results.begin(), stats.results.end(),
+      [](const SessionResult &result) { return result.end == SessionEnd::error; });
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+#include "media-cache.hpp"
+#include "mp3-index.hpp"
+
+#include <absl/log/log.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+
+#if defined(__linux__) || defined(__APPLE__)
+#  include <sys/mman.h>
+#  include <unistd.h>
+#elif defined(_WIN32) || defined(_WIN64)
+#  include <windows.h>
+#  include <io.h>
+#endif
+
+namespace am {
+
+std::shared_ptr<const MediaFile> MediaFile::open(const fs::path &filepath) {
+  std::error_code ec;
+  auto sz = fs::file_size(filepath, ec);
+  if (ec) {
+    LOG(ERROR) << "file " << filepath << " can not be opened: " << ec.message();
+    return nullptr;
+  }
+  fhandle f{std::fopen(filepath.string().c_str(), "rb")};
+  if (!f) {
+    LOG(ERROR) << "file " << filepath << " can not be opened";
+    return nullptr;
+  }
+  return std::shared_ptr<const MediaFile>(
+      new MediaFile(filepath, std::move(f), sz));
+}
+
+MediaFile::MediaFile(fs::path path, fhandle fd, std::size_t size)
+    : path_(std::move(path))
+    , fd_(std::move(fd))
+    , size_(size) {
+#if defined(__linux__) || defined(__APPLE__)
+  if (size_ > 0) {
+    void *p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fileno(fd_.get()), 0);
+    if (p == MAP_FAILED) {
+      LOG(ERROR) << "mmap of " << path_ << " failed " << errno;
+    } else {
+      mapped_ = static_cast<const char *>(p);
+      mapped_size_ = size_;
+    }
+  }
+#endif
+}
+
+MediaFile::~MediaFile() {
+#if defined(__linux__) || defined(__APPLE__)
+  if (mapped_) {
+    ::munmap(const_cast<char *>(mapped_), mapped_size_);
+  }
+#endif
+}
+
+std::size_t MediaFile::read_at(std::size_t offset,
+                               std::span<char> out) const {
+  if (offset >= size_) {
+    return 0;
+  }
+  auto len = std::min(out.size(), size_ - offset);
+  if (mapped_) {
+    std::memcpy(out.data(), mapped_ + offset, len);
+    return len;
+  }
+#if defined(__linux__) || defined(__APPLE__)
+  auto res = ::pread(fileno(fd_.get()), out.data(), len, offset);
+  return res < 0 ? 0 : static_cast<std::size_t>(res);
+#elif defined(_WIN32) || defined(_WIN64)
+  auto fhandle = (HANDLE)_get_osfhandle(_fileno(fd_.get()));
+  OVERLAPPED overlapped{};
+  overlapped.Offset = offset & 0x00000000FFFFFFFF;
+  overlapped.OffsetHigh = (offset & 0xFFFFFFFF00000000) >> 32;
+  DWORD read = 0;
+  if (!ReadFile(fhandle, out.data(), static_cast<DWORD>(len), &read,
+                &overlapped)) {
+    return 0;
+  }
+  return read;
+#endif
+}
+
+MediaCache::MediaCache(std::size_t capacity)
+    : capacity_(capacity) {}
+
+std::shared_ptr<const MediaFile> MediaCache::get(const fs::path &filepath) {
+  auto key = filepath.lexically_normal().string();
+  std::lock_guard lock(mutex_);
+  if (auto it = files_.find(key); it != files_.end()) {
+    metric_hits_.add(1);
+    return it->second;
+  }
+  metric_misses_.add(1);
+  auto file = MediaFile::open(filepath);
+  if (!file) {
+    return nullptr;
+  }
+  if (files_.size() >= capacity_) {
+    evict_idle_locked();
+  }
+  files_.emplace(std::move(key), file);
+  return file;
+}
+
+std::shared_ptr<const Mp3Index> MediaCache::index(const MediaFile &file) {
+  auto key = file.path().lexically_normal().string();
+  {
+    std::lock_guard lock(mutex_);
+    if (auto it = indexes_.find(key); it != indexes_.end()) {
+      return it->second;
+    }
+  }
+  // scanning a track takes a while, other workers keep going meanwhile
+  auto loaded = Mp3Index::load_or_build(file);
+  std::shared_ptr<const Mp3Index> index;
+  if (loaded) {
+    index = std::make_shared<const Mp3Index>(std::move(*loaded));
+  }
+  std::lock_guard lock(mutex_);
+  if (indexes_.size() >= capacity_) {
+    evict_idle_locked();
+  }
+  // a racing worker may have built it too, first one wins
+  return indexes_.try_emplace(std::move(key), std::move(index)).first->second;
+}
+
+void MediaCache::evict_idle_locked() {
+  // only the cache holds idle files
+  std::erase_if(files_, [](const auto &entry) {
+    return entry.second.use_count() == 1;
+  });
+  std::erase_if(indexes_, [](const auto &entry) {
+    return entry.second.use_count() <= 1;
+  });
+}
+
+void MediaCache::log_stat() {
+  LOG(INFO) << metric_hits_;
+  LOG(INFO) << metric_misses_;
+}
+
+} // namespace am
@@ -0,0 +1,156 @@
+#include "mp3-frame.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <optional>
+#include <span>
+
+namespace am {
+
+namespace {
+
+// kbps by [mpeg 2 or 2.5][layer - 1][bitrate index]
+constexpr std::array<std::array<std::array<int, 16>, 3>, 2> bitrates{{
+    {{
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    }},
+    {{
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    }},
+}};
+
+constexpr std::array<int, 3> mpeg1_sample_rates{44100, 48000, 32000};
+
+unsigned char byte_at(std::span<const char> bytes, std::size_t pos) {
+  return static_cast<unsigned char>(bytes[pos]);
+}
+
+std::uint32_t big_endian_at(std::span<const char> bytes, std::size_t pos) {
+  return (std::uint32_t{byte_at(bytes, pos)} << 24) |
+         (std::uint32_t{byte_at(bytes, pos + 1)} << 16) |
+         (std::uint32_t{byte_at(bytes, pos + 2)} << 8) |
+         std::uint32_t{byte_at(bytes, pos + 3)};
+}
+
+bool tag_at(std::span<const char> bytes, std::size_t pos,
+            std::string_view tag) {
+  return pos + tag.size() <= bytes.size() &&
+         std::string_view(bytes.data() + pos, tag.size()) == tag;
+}
+
+} // namespace
+
+std::optional<Mp3FrameHeader> parse_frame_header(std::span<const char> bytes) {
+  if (bytes.size() < 4) {
+    return std::nullopt;
+  }
+  auto b0 = byte_at(bytes, 0);
+  auto b1 = byte_at(bytes, 1);
+  auto b2 = byte_at(bytes, 2);
+  auto b3 = byte_at(bytes, 3);
+  if (b0 != 0xFF || (b1 & 0xE0) != 0xE0) {
+    return std::nullopt;
+  }
+  int version_bits = (b1 >> 3) & 3;
+  int layer_bits = (b1 >> 1) & 3;
+  int bitrate_index = (b2 >> 4) & 0xF;
+  int sample_rate_index = (b2 >> 2) & 3;
+  if (version_bits == 1 || layer_bits == 0 || bitrate_index == 0 ||
+      bitrate_index == 15 || sample_rate_index == 3) {
+    return std::nullopt;
+  }
+  Mp3FrameHeader header{};
+  header.version = version_bits == 3 ? 10 : (version_bits == 2 ? 20 : 25);
+  header.layer = 4 - layer_bits;
+  bool mpeg1 = header.version == 10;
+  header.bitrate_kbps =
+      bitrates[mpeg1 ? 0 : 1][header.layer - 1][bitrate_index];
+  header.sample_rate = mpeg1_sample_rates[sample_rate_index] /
+                       (mpeg1 ? 1 : (header.version == 20 ? 2 : 4));
+  header.channels = ((b3 >> 6) & 3) == 3 ? 1 : 2;
+  int padding = (b2 >> 1) & 1;
+  if (header.layer == 1) {
+    header.samples_per_frame = 384;
+    header.frame_bytes =
+        (12 * header.bitrate_kbps * 1000 / header.sample_rate + padding) * 4;
+  } else {
+    header.samples_per_frame = (header.layer == 3 && !mpeg1) ? 576 : 1152;
+    header.frame_bytes = header.samples_per_frame / 8 * header.bitrate_kbps *
+                             1000 / header.sample_rate +
+                         padding;
+  }
+  return header;
+}
+
+std::size_t id3v2_size(std::span<const char> data) {
+  if (data.size() < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3') {
+    return 0;
+  }
+  // syncsafe integer, 7 bits per byte
+  std::size_t size = 0;
+  for (std::size_t i = 6; i < 10; i++) {
+    size = (size << 7) | (byte_at(data, i) & 0x7F);
+  }
+  bool footer = byte_at(data, 5) & 0x10;
+  return 10 + size + (footer ? 10 : 0);
+}
+
+std::optional<std::size_t> find_frame(std::span<const char> data,
+                                      std::size_t from) {
+  for (std::size_t pos = from; pos + 4 <= data.size(); pos++) {
+    if (byte_at(data, pos) != 0xFF) {
+      continue;
+    }
+    auto header = parse_frame_header(data.subspan(pos, 4));
+    if (!header) {
+      continue;
+    }
+    auto next = pos + header->frame_bytes;
+    if (next + 4 > data.size()) {
+      // last frame of the data, nothing to confirm it with
+      return pos;
+    }
+    auto next_header = parse_frame_header(data.subspan(next, 4));
+    if (next_header && next_header->same_stream(*header)) {
+      return pos;
+    }
+  }
+  return std::nullopt;
+}
+
+std::optional<std::uint32_t> vbr_header_frames(std::span<const char> frame,
+                                               const Mp3FrameHeader &header) {
+  if (header.layer != 3) {
+    return std::nullopt;
+  }
+  frame = frame.first(std::min(frame.size(), header.frame_bytes));
+  // Xing sits right after the side information
+  std::size_t side_info = header.version == 10 ? (header.channels == 1 ? 17 : 32)
+                                               : (header.channels == 1 ? 9 : 17);
+  auto xing = 4 + side_info;
+  if (tag_at(frame, xing, "Xing") || tag_at(frame, xing, "Info")) {
+    if (xing + 12 > frame.size()) {
+      return 0;
+    }
+    auto flags = big_endian_at(frame, xing + 4);
+    return (flags & 1) ? big_endian_at(frame, xing + 8) : 0;
+  }
+  // VBRI is always 32 bytes after the header
+  constexpr std::size_t vbri = 4 + 32;
+  if (tag_at(frame, vbri, "VBRI")) {
+    if (vbri + 18 > frame.size()) {
+      return 0;
+    }
+    return big_endian_at(frame, vbri + 14);
+  }
+  return std::nullopt;
+}
+
+} // namespace am
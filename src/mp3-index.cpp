@@ -0,0 +1,271 @@
+#include "mp3-index.hpp"
+#include "mp3-frame.hpp"
+
+#include <absl/log/log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#  include <sys/stat.h>
+#endif
+
+namespace am {
+
+namespace {
+
+constexpr char index_magic[4] = {'A', 'M', 'I', 'X'};
+
+} // namespace
+
+Mp3IndexSource Mp3IndexSource::of(const fs::path &track, std::uint64_t size) {
+  Mp3IndexSource source{size, 0, 0, 0};
+  std::error_code ec;
+  auto time = fs::last_write_time(track, ec);
+  if (!ec) {
+    source.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       time.time_since_epoch())
+                       .count();
+  }
+#if defined(__linux__) || defined(__APPLE__)
+  struct stat st {};
+  if (::stat(track.c_str(), &st) == 0) {
+#  if defined(__APPLE__)
+    auto ctime = st.st_ctimespec;
+#  else
+    auto ctime = st.st_ctim;
+#  endif
+    source.ctime = static_cast<std::int64_t>(ctime.tv_sec) * 1000000000 +
+                   ctime.tv_nsec;
+    source.inode = st.st_ino;
+  }
+#endif
+  return source;
+}
+
+Mp3Index::Mp3Index(Mp3IndexHeader header, std::vector<Mp3IndexEntry> entries)
+    : header_(header)
+    , owned_(std::move(entries))
+    , entries_(owned_) {}
+
+Mp3Index::Mp3Index(Mp3IndexHeader header,
+                   std::shared_ptr<const MediaFile> sidecar,
+                   std::span<const Mp3IndexEntry> entries)
+    : header_(header)
+    , sidecar_(std::move(sidecar))
+    , entries_(entries) {}
+
+std::optional<Mp3Index> Mp3Index::build(const MediaFile &file,
+                                        const Mp3IndexSource &source) {
+  auto data = file.mapped();
+  std::vector<char> copy;
+  if (data.size() != file.size()) {
+    // no mapping on this platform, a one off read of the whole track
+    copy.resize(file.size());
+    copy.resize(file.read_at(0, copy));
+    data = copy;
+  }
+  auto first = find_frame(data, id3v2_size(data));
+  if (!first) {
+    return std::nullopt;
+  }
+  auto stream = *parse_frame_header(data.subspan(*first));
+
+  std::vector<Mp3IndexEntry> entries;
+  entries.reserve((data.size() - *first) / stream.frame_bytes + 1);
+  std::optional<std::uint32_t> vbr_frames;
+  std::size_t resyncs = 0;
+  std::size_t pos = *first;
+  while (pos + 4 <= data.size()) {
+    auto header = parse_frame_header(data.subspan(pos, 4));
+    if (!header || !header->same_stream(stream)) {
+      auto next = find_frame(data, pos + 1);
+      if (!next) {
+        // trailing ID3v1 or APE tags
+        break;
+      }
+      resyncs++;
+      pos = *next;
+      continue;
+    }
+    if (pos + header->frame_bytes > data.size()) {
+      // truncated last frame, decoders drop it too
+      break;
+    }
+    if (entries.empty() && !vbr_frames) {
+      vbr_frames = vbr_header_frames(data.subspan(pos), *header);
+      if (vbr_frames) {
+        pos += header->frame_bytes;
+        continue;
+      }
+    }
+    entries.push_back(Mp3IndexEntry{
+        pos, static_cast<std::uint32_t>(header->frame_bytes),
+        static_cast<std::uint16_t>(header->bitrate_kbps),
+        static_cast<std::uint16_t>(header->samples_per_frame)});
+    pos += header->frame_bytes;
+  }
+  if (entries.empty()) {
+    return std::nullopt;
+  }
+  if (resyncs > 0) {
+    LOG(WARNING) << "index " << file.path() << ": skipped " << resyncs
+                 << " damaged regions";
+  }
+  if (vbr_frames && *vbr_frames != 0 && *vbr_frames != entries.size()) {
+    LOG(WARNING) << "index " << file.path() << ": vbr header counts "
+                 << *vbr_frames << " frames, found " << entries.size();
+  }
+  Mp3IndexHeader header{};
+  std::memcpy(header.magic, index_magic, sizeof(index_magic));
+  header.version = Mp3IndexHeader::current_version;
+  header.source = source;
+  header.sample_rate = stream.sample_rate;
+  header.samples_per_frame = stream.samples_per_frame;
+  header.frame_count = entries.size();
+  // the track is in memory for the scan anyway, servers tag it from here
+  ContentHash hash;
+  hash.update(data);
+  header.content_hash = hash.digest();
+  return Mp3Index(header, std::move(entries));
+}
+
+std::optional<Mp3Index> Mp3Index::load(const fs::path &sidecar,
+                                       const Mp3IndexSource &source) {
+  std::error_code ec;
+  if (!fs::exists(sidecar, ec)) {
+    return std::nullopt;
+  }
+  auto file = MediaFile::open(sidecar);
+  if (!file || file->size() < sizeof(Mp3IndexHeader)) {
+    return std::nullopt;
+  }
+  Mp3IndexHeader header{};
+  file->read_at(0, {reinterpret_cast<char *>(&header), sizeof(header)});
+  if (std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0 ||
+      header.version != Mp3IndexHeader::current_version ||
+      header.source != source || header.frame_count == 0 ||
+      header.sample_rate == 0 || header.samples_per_frame == 0 ||
+      file->size() !=
+          sizeof(header) + header.frame_count * sizeof(Mp3IndexEntry)) {
+    LOG(INFO) << "index " << sidecar << " is stale";
+    return std::nullopt;
+  }
+  if (file->mapped().size() == file->size()) {
+    // the header size keeps entries aligned inside the page aligned mapping
+    static_assert(sizeof(Mp3IndexHeader) % alignof(Mp3IndexEntry) == 0);
+    auto entries = reinterpret_cast<const Mp3IndexEntry *>(
+        file->mapped().data() + sizeof(header));
+    return Mp3Index(header, std::move(file),
+                    {entries, static_cast<std::size_t>(header.frame_count)});
+  }
+  std::vector<Mp3IndexEntry> entries(header.frame_count);
+  auto bytes = entries.size() * sizeof(Mp3IndexEntry);
+  if (file->read_at(sizeof(header),
+                    {reinterpret_cast<char *>(entries.data()), bytes}) !=
+      bytes) {
+    return std::nullopt;
+  }
+  return Mp3Index(header, std::move(entries));
+}
+
+std::optional<Mp3Index> Mp3Index::load_or_build(const MediaFile &track) {
+  auto sidecar = sidecar_path(track.path());
+  auto source = Mp3IndexSource::of(track.path(), track.size());
+  if (auto index = load(sidecar, source)) {
+    return index;
+  }
+  auto index = build(track, source);
+  if (!index) {
+    LOG(WARNING) << "no mp3 frames to index in " << track.path();
+    return std::nullopt;
+  }
+  LOG(INFO) << "indexed " << track.path() << ": " << index->frame_count()
+            << " frames, " << index->duration().count() << "ms";
+  if (!index->write(sidecar)) {
+    LOG(INFO) << "index " << sidecar << " can not be written, keeping it in"
+              << " memory";
+  }
+  return index;
+}
+
+fs::path Mp3Index::sidecar_path(const fs::path &track) {
+  auto sidecar = track;
+  sidecar += ".idx";
+  return sidecar;
+}
+
+bool Mp3Index::write(const fs::path &sidecar) const {
+  // written aside and renamed, so concurrent readers never map half a file
+  auto tmp = sidecar;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+    out.write(reinterpret_cast<const char *>(entries_.data()),
+              entries_.size_bytes());
+    if (!out) {
+      std::error_code ec;
+      fs::remove(tmp, ec);
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, sidecar, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+std::size_t Mp3Index::audio_end() const {
+  auto &last = entries_.back();
+  return last.offset + last.frame_bytes;
+}
+
+std::chrono::milliseconds Mp3Index::duration() const {
+  return std::chrono::milliseconds(entries_.size() *
+                                   header_.samples_per_frame * 1000 /
+                                   header_.sample_rate);
+}
+
+std::size_t Mp3Index::byte_rate() const {
+  auto samples = entries_.size() * header_.samples_per_frame;
+  return (audio_end() - audio_start()) * header_.sample_rate / samples;
+}
+
+std::string Mp3Index::etag() const {
+  return ContentHash::to_tag(header_.content_hash);
+}
+
+std::size_t Mp3Index::byte_at_time(std::chrono::milliseconds offset) const {
+  if (offset.count() <= 0) {
+    return audio_start();
+  }
+  auto frame = static_cast<std::size_t>(offset.count()) * header_.sample_rate /
+               (1000 * header_.samples_per_frame);
+  return frame < entries_.size() ? entries_[frame].offset : audio_end();
+}
+
+std::size_t Mp3Index::frame_at_byte(std::size_t offset) const {
+  auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), offset,
+      [](const Mp3IndexEntry &entry, std::size_t offset) {
+        return entry.offset < offset;
+      });
+  return it != entries_.end() ? it->offset : audio_end();
+}
+
+} // namespace am
@@ -1,10 +1,14 @@
 #include "mp3-system.hpp"
+#include "uring-system.hpp"
 #include <absl/log/log.h>
+#include <algorithm>
+#include <atomic>
 #include <asio/error.hpp>
 #include <asio/error_code.hpp>
 #include <asio/io_context.hpp>
 #include <cstddef>
 #include <exception>
+#include <variant>
 
 #if defined(__linux__)
 #  include <sys/sendfile.h>
@@ -49,29 +53,103 @@ void SendFileWin::cancel() {
 
 #endif
 
-SendFile::SendFile(asio::io_context &io_context, asio::ip::tcp::socket &socket,
-                   std::FILE *file, std::size_t size,
+static std::atomic<SendFile::Backend> send_file_backend{
+    SendFile::Backend::sendfile};
+
+void SendFile::set_backend(Backend backend) {
+  send_file_backend.store(backend, std::memory_order_relaxed);
+}
+
+SendFile::Backend SendFile::backend() {
+  return send_file_backend.load(std::memory_order_relaxed);
+}
+
+SendFile::SendFile(asio::io_context &io_context, StreamSocket &socket,
+                   std::shared_ptr<const MediaFile> file, std::size_t offset,
                    OnChunkSent &&on_chunk_sent)
     : io_context_(io_context)
     , socket_(socket)
-    , file_(file)
-    , cur_(0)
-    , size_(size)
+    , file_(std::move(file))
+    , cur_(std::min(offset, file_->size()))
+    , size_(file_->size())
     , on_chunk_sent_(std::move(on_chunk_sent)) {
-  call();
+#if defined(__linux__)
+  if (backend() == Backend::io_uring && size_ > cur_ &&
+      file_->mapped().size() == size_) {
+    auto &service = asio::use_service<UringSendService>(io_context_);
+    if (service.available()) {
+      uring_.service_ = &service;
+    }
+  }
+#endif
 }
 
-void SendFile::call() {
+SendFile::~SendFile() {
+#if defined(__linux__)
+  uring_.cancel();
+#endif
+}
+
+void SendFile::call(std::size_t max_len) {
+#if defined(__linux__)
+  if (uring_.service_) {
+    auto len = std::min({size_ - cur_, uring_chunk_size, max_len});
+    uring_.op_ = uring_.service_->send(
+        *this, file_, socket_.lowest_layer().native_handle(),
+        file_->mapped().data() + cur_, len);
+    return;
+  }
+#endif
+  call_sendfile(max_len);
+}
+
+#if defined(__linux__)
+void SendFileUring::cancel() {
+  if (op_) {
+    service_->detach(op_);
+    op_ = nullptr;
+  }
+}
+
+void SendFile::on_uring_sent(int res) {
+  if (res > 0) {
+    cur_ += res;
+    SendFileStats::instance().add(0, res);
+    on_chunk_sent_(size_ - cur_, *this);
+  } else if (res == -EAGAIN || res == -EINTR) {
+    // asio made the socket O_NONBLOCK, so a full socket buffer completes the
+    // send with EAGAIN instead of io_uring retrying it once writable. wait
+    // for room through asio, the next call submits the send again
+    socket_.async_wait(StreamSocket::wait_write,
+                       [this](const asio::error_code &ec) {
+                         if (ec == asio::error::operation_aborted) {
+                           return;
+                         }
+                         SendFileStats::instance().add(1, 0);
+                         on_chunk_sent_(size_ - cur_, *this);
+                       });
+  } else {
+    LOG(INFO) << "io_uring send: client conection problem " << -res;
+    on_chunk_sent_(0, *this);
+  }
+}
+#endif
+
+void SendFile::call_sendfile(std::size_t max_len) {
 #if defined(__linux__) || defined(__APPLE__)
-  std::size_t len = size_ - cur_;
-  off_t res_len;
+  std::size_t len = std::min(size_ - cur_, max_len);
+  // on mac the length is in/out, 0 sends until the end of file
+  off_t res_len = max_len == unlimited ? 0 : len;
 #if defined(__APPLE__)
-  int res = sendfile(fileno(file_), socket_.lowest_layer().native_handle(),
-                     cur_, &res_len, nullptr, 0);
+  int res = sendfile(fileno(file_->handle()),
+                     socket_.lowest_layer().native_handle(), cur_, &res_len,
+                     nullptr, 0);
 
 #elif defined(__linux__)
-  auto res = sendfile(socket_.lowest_layer().native_handle(), fileno(file_),
-                     nullptr, len);
+  // the file is shared between connections, never use its file position
+  off_t offset = cur_;
+  auto res = sendfile(socket_.lowest_layer().native_handle(),
+                      fileno(file_->handle()), &offset, len);
   if (res >= 0) {
     res_len = res;
     res = 0;
@@ -81,6 +159,7 @@ void SendFile::call() {
 #else
   static_assert(false);
 #  endif
+  SendFileStats::instance().add(1, res_len);
   if (res == 0) {
     LOG(INFO) << "sent " << res_len << " res was " << res;
     cur_ += res_len;
@@ -91,11 +170,13 @@ void SendFile::call() {
     if (err == EAGAIN) {
       LOG(INFO) << "sendfile: would block, EAGAIN";
       cur_ += res_len;
-      socket_.async_wait(asio::ip::tcp::socket::wait_write,
+      socket_.async_wait(StreamSocket::wait_write,
                          [this](const asio::error_code &ec) {
                            if (ec == asio::error::operation_aborted) {
                              return;
                            }
+                           // the reactor wake up for this socket
+                           SendFileStats::instance().add(1, 0);
                            on_chunk_sent_(size_ - cur_, *this);
                          });
     } else if (err == 57) { // mac
@@ -111,7 +192,8 @@ void SendFile::call() {
   }
 #elif defined(_WIN32) || defined(_WIN64)
   platform_.overlapped_ = {};
-  DWORD bytes = std::min(std::min(size_ - cur_, TRANSMITFILE_MAX), 100000ull);
+  DWORD bytes = std::min(
+      {size_ - cur_, TRANSMITFILE_MAX, 100000ull, (unsigned long long)max_len});
   auto socket = socket_.lowest_layer().native_handle();
   if (platform_.overlapped_.hEvent != nullptr) {
     CloseHandle(platform_.overlapped_.hEvent);
@@ -150,9 +232,10 @@ void SendFile::call() {
 
   platform_.overlapped_.OffsetHigh = (cur_ & 0xFFFFFFFF00000000) >> 32;
 
-  auto fhandle = (HANDLE)_get_osfhandle(_fileno(file_));
+  auto fhandle = (HANDLE)_get_osfhandle(_fileno(file_->handle()));
 
-  if (!TransmitFile(socket, fhandle, size_ - cur_, bytes,
+  DWORD to_write = std::min<std::size_t>(size_ - cur_, max_len);
+  if (!TransmitFile(socket, fhandle, to_write, bytes,
                     &platform_.overlapped_, nullptr, 0)) {
     auto err = GetLastError();
     auto wsaerr = WSAGetLastError();
@@ -167,6 +250,31 @@ void SendFile::call() {
 
 void SendFile::cancel() {
   platform_.cancel();
+#if defined(__linux__)
+  uring_.cancel();
+#endif
+}
+
+SendFileStats &SendFileStats::instance() {
+  static auto *stats = new SendFileStats();
+  return *stats;
+}
+
+void SendFileStats::add(long syscalls, long bytes) {
+  metric_syscalls_.add(syscalls);
+  metric_bytes_.add(bytes);
+}
+
+void SendFileStats::log_stat() {
+  auto syscalls =
+      std::get<MetricSimpleValue<long>>(metric_syscalls_.val_).value();
+  auto bytes = std::get<MetricSimpleValue<long>>(metric_bytes_.val_).value();
+  LOG(INFO) << metric_syscalls_;
+  LOG(INFO) << metric_bytes_;
+  if (bytes > 0) {
+    LOG(INFO) << "send syscalls per GB "
+              << static_cast<double>(syscalls) * (1 << 30) / bytes;
+  }
 }
 
 } // namespace am
@@ -1,38 +1,131 @@
 #include "mp3.hpp"
+#include "mp3-frame.hpp"
 #include <absl/base/macros.h>
 #include <absl/log/log.h>
+#include <algorithm>
 #include <asio.hpp>
 #include <asio/io_context.hpp>
-#include <asio/ip/tcp.hpp>
+#include <asio/generic/stream_protocol.hpp>
 #include <cstddef>
 #include <cstdio>
 #include <exception>
 #include <optional>
+#include <span>
+#include <vector>
 
 namespace am {
 
-Mp3 Mp3::create(fs::path filepath) {
+namespace {
+
+// enough to get past the tag and confirm a frame with the one after it
+constexpr std::size_t probe_size = 16 * 1024;
+
+struct Probe {
+  std::size_t audio_start;
+  std::size_t byte_rate;
+};
+
+Probe probe(const MediaFile &file) {
+  std::vector<char> head(std::min(probe_size, file.size()));
+  if (file.read_at(0, head) != head.size()) {
+    return {0, 0};
+  }
+  auto tag_size = id3v2_size(head);
+  if (tag_size > 0) {
+    if (tag_size >= file.size()) {
+      return {0, 0};
+    }
+    head.resize(std::min(probe_size, file.size() - tag_size));
+    if (file.read_at(tag_size, head) != head.size()) {
+      return {0, 0};
+    }
+  }
+  auto pos = find_frame(head, 0);
+  if (!pos) {
+    return {tag_size, 0};
+  }
+  auto header = parse_frame_header(std::span<const char>(head).subspan(*pos));
+  return {tag_size + *pos, header->byte_rate()};
+}
+
+} // namespace
+
+std::optional<Mp3> Mp3::create(MediaCache &cache, fs::path filepath) {
   LOG(INFO) << "filepath " << filepath;
-  if (!std::filesystem::exists(filepath)) {
+  auto file = cache.get(filepath);
+  if (!file) {
     LOG(ERROR) << "file " << filepath << " does not exist";
-    std::terminate();
+    return std::nullopt;
+  }
+  auto index = cache.index(*file);
+  if (index) {
+    auto audio_start = index->audio_start();
+    auto byte_rate = index->byte_rate();
+    return Mp3{std::move(file), std::move(index), audio_start, byte_rate};
+  }
+  auto [audio_start, byte_rate] = probe(*file);
+  if (byte_rate == 0) {
+    LOG(WARNING) << "no mp3 frames found in " << filepath;
+  }
+  return Mp3{std::move(file), nullptr, audio_start, byte_rate};
+}
+
+std::chrono::milliseconds Mp3::duration() const {
+  return index_ ? index_->duration() : std::chrono::milliseconds(0);
+}
+
+std::string Mp3::etag() const { return index_ ? index_->etag() : ""; }
+
+std::size_t Mp3::frame_at_byte(std::size_t offset) const {
+  if (offset == 0) {
+    return 0;
+  }
+  if (index_) {
+    auto start = index_->frame_at_byte(offset);
+    return start == index_->audio_end() ? file_->size() : start;
+  }
+  if (offset <= audio_start_) {
+    return audio_start_;
+  }
+  if (offset >= file_->size()) {
+    return file_->size();
   }
-  auto sz = std::filesystem::file_size(filepath);
-  fhandle f{std::fopen(filepath.string().c_str(), "rb")};
+  std::vector<char> window(std::min(probe_size, file_->size() - offset));
+  if (file_->read_at(offset, window) != window.size()) {
+    return offset;
+  }
+  // no header close by, the decoder resyncs on its own
+  return offset + find_frame(window, 0).value_or(0);
+}
 
-  return {std::move(f), sz};
+std::size_t Mp3::frame_at_time(std::chrono::milliseconds offset) const {
+  if (offset.count() <= 0 || byte_rate_ == 0) {
+    return 0;
+  }
+  if (index_) {
+    auto start = index_->byte_at_time(offset);
+    return start == index_->audio_end() ? file_->size() : start;
+  }
+  return frame_at_byte(audio_start_ + offset.count() * byte_rate_ / 1000);
 }
 
 bool Mp3::send(asio::io_context &io_context,
-               const asio::ip::tcp::socket &socket,
-               OnChunkSent &&on_chunk_sent) {
-  auto &non_const_socket = const_cast<asio::ip::tcp::socket &>(socket);
-  send_file_ = std::make_unique<SendFile>(io_context, non_const_socket, fd_.get(), size_,
-                     std::move(on_chunk_sent));
+               const StreamSocket &socket,
+               OnChunkSent &&on_chunk_sent, std::size_t offset,
+               std::size_t first_chunk) {
+  auto &non_const_socket = const_cast<StreamSocket &>(socket);
+  send_file_ = std::make_unique<SendFile>(io_context, non_const_socket, file_,
+                                          offset, std::move(on_chunk_sent));
+  // started only once send_file_ is set, a chunk callback may cancel it
+  send_file_->call(first_chunk);
   return true;
 }
 
-size_t Mp3::size() const { return size_; }
+size_t Mp3::size() const { return file_->size(); }
+
+std::size_t Mp3::read_at(std::size_t offset, std::span<char> out) const {
+  return file_->read_at(offset, out);
+}
 
 void Mp3::cancel() { if (send_file_) { 
   LOG(INFO) << "Mp3::cancel send file reset";
@@ -0,0 +1,47 @@
+#include "pacer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+namespace am {
+
+Pacer::Pacer(std::size_t byte_rate, const PacingOptions &options,
+             clock::time_point start)
+    : bytes_per_second_(byte_rate * (100.0 + options.margin_percent) / 100.0)
+    , lead_bytes_(static_cast<std::size_t>(
+          byte_rate * std::chrono::duration<double>(options.lead).count()))
+    , chunk_size_(std::max<std::size_t>(4096, byte_rate / 10))
+    , start_(start) {}
+
+std::size_t Pacer::allowance(std::size_t sent, clock::time_point now) const {
+  auto elapsed = std::chrono::duration<double>(now - start_).count();
+  auto budget = lead_bytes_ + static_cast<std::size_t>(
+                                  std::max(0.0, elapsed) * bytes_per_second_);
+  return budget > sent ? budget - sent : 0;
+}
+
+Pacer::clock::time_point Pacer::ready_at(std::size_t sent) const {
+  auto target = sent + chunk_size_;
+  if (target <= lead_bytes_) {
+    return start_;
+  }
+  auto seconds = (target - lead_bytes_) / bytes_per_second_;
+  return start_ + std::chrono::duration_cast<clock::duration>(
+                      std::chrono::duration<double>(seconds));
+}
+
+void Pacer::pause(clock::time_point now) {
+  if (!paused_at_) {
+    paused_at_ = now;
+  }
+}
+
+void Pacer::resume(clock::time_point now) {
+  if (paused_at_) {
+    start_ += now - *paused_at_;
+    paused_at_.reset();
+  }
+}
+
+} // namespace am
@@ -1,7 +1,11 @@
 #include "protocol-system.hpp"
 
+#include <absl/log/log.h>
+#include <atomic>
 #include <cstddef>
 #include <exception>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 
@@ -30,28 +34,71 @@ namespace am {
       munmap(info.p2_, info.len_);
     if (!info.shname_.empty())
       shm_unlink(info.shname_.c_str());
+    if (info.fd_ != -1)
+      close(info.fd_);
+    info.fd_ = -1;
+#elif defined(_WIN32) || defined(_WIN64)
+    if (info.p1_)
+      UnmapViewOfFile(info.p1_);
+    if (info.p2_)
+      UnmapViewOfFile(info.p2_);
+    if (info.file_handle_)
+      CloseHandle(info.file_handle_);
 #endif
+    info.p1_ = nullptr;
+    info.p2_ = nullptr;
+    info.file_handle_ = nullptr;
   }
 
-  LinearMemInfo::LinearMemInfo(std::size_t minsize) {
-    int res = init(minsize);
+  LinearMemInfo::LinearMemInfo(std::size_t minsize, bool shared) {
+    int res = init(minsize, shared);
     if (res != 0) {
       std::terminate();
     };
   }
 
+#if defined(__APPLE__) || defined(__linux__)
+  LinearMemHandle LinearMemInfo::map_shared(int fd, std::size_t len) {
+    LinearMemHandle info{new LinearMemInfo()};
+    info->fd_ = fd;
+    std::size_t pagesize = ::sysconf(_SC_PAGESIZE);
+    if (len == 0 || len % pagesize ||
+        info->map_mirrored(fd, len) != 0) {
+      return nullptr;
+    }
+    return info;
+  }
+#endif
+
   LinearMemInfo::~LinearMemInfo() {
-    if (res_ != 0)
-      free(*this);
+    free(*this);
   }
 
-  int LinearMemInfo::init(std::size_t minsize) {
+#if defined(__APPLE__) || defined(__linux__)
+  static int open_shared_memory(LinearMemInfo &info) {
+#  if defined(__linux__)
+    // anonymous, nothing in /dev/shm to name, clean up or leak on crash
+    return memfd_create("am_ring_buffer", MFD_CLOEXEC);
+#  else
+    pid_t pid = getpid();
+    // buffers are created concurrently by server worker threads
+    static std::atomic<int> counter = 0;
+    int r = counter++;
+    std::stringstream s;
+    s << "pid_" << pid << "_buffer_" << r;
+    auto shname = s.str();
+    shm_unlink(shname.c_str());
+    int fd = shm_open(shname.c_str(), O_RDWR | O_CREAT, 0);
+    info.shname_ = std::move(shname);
+    return fd;
+#  endif
+  }
+#endif
+
+  int LinearMemInfo::init(std::size_t minsize, bool shared) {
     res_ = -1;
-// TODO: this leaks resources in error
 #if defined(__APPLE__) || defined(__linux__)
     // source https: // github.com/lava/linear_ringbuffer
-    pid_t pid = getpid();
-    static int counter = 0;
     std::size_t pagesize = ::sysconf(_SC_PAGESIZE);
     std::size_t bytes = minsize & ~(pagesize - 1);
     if (minsize % pagesize) {
@@ -62,52 +109,39 @@ namespace am {
       perror("overflow");
       return -1;
     }
-    int r = counter++;
-    std::stringstream s;
-    s << "pid_" << pid << "_buffer_" << r;
-    const auto shname = s.str();
-    shm_unlink(shname.c_str());
-    int fd = shm_open(shname.c_str(), O_RDWR | O_CREAT, 0);
-    shname_ = std::move(shname);
+    int fd = open_shared_memory(*this);
+    if (fd == -1) {
+      perror("shared memory");
+      return -1;
+    }
     std::size_t len = bytes;
     if (ftruncate(fd, len) == -1) {
       perror("ftruncate");
+      close(fd);
       return -1;
     }
-    void *p =
-        ::mmap(nullptr, 2 * len, PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
-    if (p == MAP_FAILED) {
-      perror("mmap");
-      return -1;
-    }
-    munmap(p, 2 * len);
-
-    p1_ = (char *)mmap(p, len, PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
-    if (p1_ == MAP_FAILED) {
-      perror("mmap1");
-      return -1;
-    }
-
-    p2_ = (char *)mmap((char *)p + len, len, PROT_WRITE, MAP_SHARED | MAP_FIXED,
-                       fd, 0);
-    if (p2_ == MAP_FAILED) {
-      perror("mmap2");
+    if (map_mirrored(fd, len) != 0) {
+      close(fd);
       return -1;
     }
     p1_[0] = 'x';
-    printf("pointer %s: %p %p %p %ld %c %c\n", shname_.c_str(), p, p1_, p2_,
-           (char *)p2_ - (char *)p1_, p1_[0], p2_[0]);
     if (p1_[0] != p2_[0]) {
       perror("not the same memory");
+      close(fd);
       return -1;
     }
-    len_ = len;
-    printf("xxx len %zu\n", len_);
+    if (shared) {
+      fd_ = fd;
+    } else {
+      // both mappings keep the shared memory alive, the descriptor is not
+      // needed anymore, keeping it would cost an fd per buffer
+      close(fd);
+    }
     res_ = 0;
 #else
   // source https://gist.github.com/rygorous/3158316
   DWORD pid = GetCurrentProcessId();
-  static int counter = 0;
+  static std::atomic<int> counter = 0;
   std::size_t pagesize = system_page_size();
   std::size_t bytes = minsize & ~(pagesize - 1);
   if (minsize % pagesize) {
@@ -159,6 +193,104 @@ namespace am {
     return 0;
   }
 
+#if defined(__APPLE__) || defined(__linux__)
+  int LinearMemInfo::map_mirrored(int fd, std::size_t len) {
+    // reserve address space for both views and map them over the
+    // reservation, nothing else can be mapped in between by another thread.
+    void *reserved = ::mmap(nullptr, 2 * len, PROT_NONE,
+                            MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (reserved == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+    char *p = (char *)reserved;
+
+    p1_ = (char *)mmap(p, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                       fd, 0);
+    if (p1_ == MAP_FAILED) {
+      p1_ = nullptr;
+      munmap(p, 2 * len);
+      perror("mmap1");
+      return -1;
+    }
+    len_ = len;
+
+    p2_ = (char *)mmap(p + len, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, fd, 0);
+    if (p2_ == MAP_FAILED) {
+      p2_ = nullptr;
+      munmap(p + len, len);
+      perror("mmap2");
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  LinearMemPool &LinearMemPool::instance() {
+    // never destroyed, ring buffers in other statics may outlive it
+    static auto *pool = new LinearMemPool();
+    return *pool;
+  }
+
+  std::size_t LinearMemPool::size_class(std::size_t minsize) {
+    std::size_t res = system_page_size();
+    while (res < minsize) {
+      res *= 2;
+    }
+    return res;
+  }
+
+  LinearMemHandle LinearMemPool::acquire(std::size_t minsize) {
+    auto size = size_class(minsize);
+    {
+      std::lock_guard lock(mutex_);
+      auto &free = free_[size];
+      if (!free.empty()) {
+        auto info = std::move(free.back());
+        free.pop_back();
+        idle_bytes_ -= info->len_;
+        metric_hits_.add(1);
+        return LinearMemHandle{info.release()};
+      }
+    }
+    metric_misses_.add(1);
+    return LinearMemHandle{new LinearMemInfo(size)};
+  }
+
+  void LinearMemPool::release(LinearMemInfo *info) {
+    std::unique_ptr<LinearMemInfo> owned{info};
+    if (owned->fd_ != -1) {
+      return;
+    }
+    {
+      std::lock_guard lock(mutex_);
+      if (idle_bytes_ + owned->len_ <= max_idle_bytes) {
+        idle_bytes_ += owned->len_;
+        free_[owned->len_].emplace_back(std::move(owned));
+        return;
+      }
+    }
+    // over budget, unmapped here outside of the lock
+  }
+
+  long LinearMemPool::hits() const {
+    return std::get<MetricSimpleValue<long>>(metric_hits_.val_).value();
+  }
+
+  long LinearMemPool::misses() const {
+    return std::get<MetricSimpleValue<long>>(metric_misses_.val_).value();
+  }
+
+  void LinearMemPool::log_stat() {
+    LOG(INFO) << metric_hits_;
+    LOG(INFO) << metric_misses_;
+  }
+
+  void LinearMemRecycler::operator()(LinearMemInfo *info) const {
+    LinearMemPool::instance().release(info);
+  }
+
   std::size_t system_page_size() {
 #if defined(_WIN32) || defined(_WIN64)
     SYSTEM_INFO sysInfo;
@@ -2,10 +2,14 @@
 #include "protocol-system.hpp"
 
 #include <absl/log/log.h>
+#include <algorithm>
+#include <array>
 #include <asio/buffer.hpp>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <exception>
+#include <limits>
 #include <span>
 #include <string>
 #include <string_view>
@@ -17,11 +21,16 @@ namespace am {
 LinnearArray::LinnearArray(std::size_t size)
     : ptr_(nullptr)
     , len_(0)
-    , mapped_(size) {
-  len_ = mapped_.len_;
-  ptr_ = mapped_.p1_;
+    , mapped_(LinearMemPool::instance().acquire(size)) {
+  len_ = mapped_->len_;
+  ptr_ = mapped_->p1_;
 }
 
+LinnearArray::LinnearArray(LinearMemHandle mapped)
+    : ptr_(mapped->p1_)
+    , len_(mapped->len_)
+    , mapped_(std::move(mapped)) {}
+
 std::size_t LinnearArray::size() const { return len_; }
 
 inline char *LinnearArray::data() { return ptr_; }
@@ -54,6 +63,37 @@ void RingBuffer::reset() {
   non_filled_size_ = _size;
 }
 
+void RingBuffer::reserve(std::size_t size) {
+  if (size <= _size) {
+    return;
+  }
+  LinnearArray grown(size);
+  // filled sequence is linear thanks to the mirrored mapping
+  if (filled_size_ > 0) {
+    std::memcpy(grown.data(), &_data.at(filled_start_), filled_size_);
+  }
+  _data = std::move(grown);
+  _size = _data.size();
+  filled_start_ = 0;
+  non_filled_start_ = filled_size_;
+  non_filled_size_ = _size - filled_size_;
+}
+
+std::size_t RingBuffer::capacity() const { return _size; }
+
+void RingBuffer::adopt(LinearMemHandle mapped) {
+  LinnearArray adopted(std::move(mapped));
+  auto start = adopted.size() - filled_size_;
+  if (filled_size_ > 0) {
+    std::memcpy(&adopted.at(start), &_data.at(filled_start_), filled_size_);
+  }
+  _data = std::move(adopted);
+  _size = _data.size();
+  filled_start_ = filled_size_ ? start : 0;
+  non_filled_start_ = 0;
+  non_filled_size_ = _size - filled_size_;
+}
+
 void RingBuffer::commit(std::size_t len) {
   non_filled_size_ += len;
   filled_size_ -= len;
@@ -70,6 +110,8 @@ void RingBuffer::consume(std::size_t len) {
 }
 
 void RingBuffer::memcpy_in(const void *data, size_t sz) {
+  check_write(sz, "memcpy_in");
+
   auto left_to_the_right = _size - non_filled_start_;
   if (sz > left_to_the_right) {
     std::memcpy(&_data.at(non_filled_start_), data, left_to_the_right);
@@ -174,6 +216,14 @@ void RingBuffer::check(int len, std::string_view method) const {
   }
 }
 
+void RingBuffer::check_write(std::size_t len, std::string_view method) const {
+  if (len > non_filled_size_) {
+    LOG(ERROR) << "RingBuffer " << method << ": cant write " << len
+               << " > " << non_filled_size_ << " debug " << this;
+    std::terminate();
+  }
+}
+
 inline char RingBuffer::char_at(std::size_t pos) const {
   if (pos < _size)
     return _data.at(pos);
@@ -263,38 +313,183 @@ void Envelope::log() {
             << message_size;
 }
 
+// LEB128 varint from bytes, the number of bytes it took or 0 if it is not
+// complete in them
+static std::size_t read_varint(std::span<const unsigned char> bytes,
+                               std::uint64_t &value) {
+  value = 0;
+  for (std::size_t i = 0; i < bytes.size() && i < 10; i++) {
+    value |= static_cast<std::uint64_t>(bytes[i] & 0x7f) << (7 * i);
+    if (!(bytes[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static void write_varint(std::uint64_t value, RingBuffer &buff) {
+  std::array<unsigned char, 10> bytes{};
+  std::size_t len = 0;
+  do {
+    bytes[len] = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      bytes[len] |= 0x80;
+    }
+    len++;
+  } while (value);
+  buff.memcpy_in(bytes.data(), len);
+}
+
+static void write_le(std::uint64_t value, std::size_t len, RingBuffer &buff) {
+  std::array<unsigned char, 8> bytes{};
+  for (std::size_t i = 0; i < len; i++) {
+    bytes[i] = (value >> (8 * i)) & 0xff;
+  }
+  buff.memcpy_in(bytes.data(), len);
+}
+
+static std::uint64_t read_le(std::size_t len, RingBuffer &buff) {
+  std::array<unsigned char, 8> bytes{};
+  buff.memcpy_out(bytes.data(), len);
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < len; i++) {
+    value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+  }
+  return value;
+}
+
+void FieldWriter::put_int(std::int32_t value) {
+  if (version == WireVersion::v1) {
+    buff.memcpy_in(&value, sizeof(value));
+  } else {
+    write_le(static_cast<std::uint32_t>(value), 4, buff);
+  }
+}
+
+void FieldWriter::put_u32(std::uint32_t value) {
+  put_int(static_cast<std::int32_t>(value));
+}
+
+void FieldWriter::put_size(std::uint64_t value) {
+  if (version == WireVersion::v1) {
+    put_int(static_cast<std::int32_t>(value));
+  } else {
+    write_le(value, 8, buff);
+  }
+}
+
+std::int32_t FieldReader::get_int() {
+  if (version == WireVersion::v1) {
+    std::int32_t value{};
+    buff.memcpy_out(&value, sizeof(value));
+    return value;
+  }
+  return static_cast<std::int32_t>(read_le(4, buff));
+}
+
+std::uint32_t FieldReader::get_u32() {
+  return static_cast<std::uint32_t>(get_int());
+}
+
+std::uint64_t FieldReader::get_size() {
+  if (version == WireVersion::v1) {
+    // v1 sizes are never negative, a negative one reads as 0
+    return static_cast<std::uint64_t>(std::max(get_int(), 0));
+  }
+  return read_le(8, buff);
+}
+
+// longest v2 envelope, a 5 byte type and a 10 byte size
+static constexpr std::size_t envelope_v2_max_size = 15;
+
 bool Decoder::try_read(RingBuffer &state) {
   if (_state == DecoderState::before_envelope) {
-    if (state.ready_size() >= sizeof(Envelope)) {
+    if (_version == WireVersion::v1) {
+      if (state.ready_size() < envelope_v1_size) {
+        return false;
+      }
       // we can parse the envelope now
       _envelope.message_type = state.peek_int();
       state.commit(4);
-      _envelope.message_size = state.peek_int();
+      _envelope.message_size =
+          static_cast<std::uint64_t>(std::max(state.peek_int(), 0));
       state.commit(4);
-      _state = DecoderState::have_envelope;
-      LOG(INFO) << "Handle::try_read state " << (int)_state
-                << " envelope, message_size " << _envelope.message_size
-                << " message_type " << _envelope.message_type;
-      return try_read(state);
     } else {
-      return false;
+      std::array<unsigned char, envelope_v2_max_size> head{};
+      auto len = std::min(state.ready_size(), head.size());
+      std::size_t copied = 0;
+      for (auto part : state.peek_string_view(static_cast<int>(len))) {
+        std::memcpy(head.data() + copied, part.data(), part.size());
+        copied += part.size();
+      }
+      std::uint64_t type = 0;
+      auto type_len = read_varint(std::span(head.data(), len), type);
+      std::uint64_t size = 0;
+      auto size_len = type_len ? read_varint(std::span(head.data() + type_len,
+                                                       len - type_len),
+                                             size)
+                               : 0;
+      if (type_len > 5 || type > std::numeric_limits<int>::max() ||
+          (!size_len && len == head.size())) {
+        LOG(ERROR) << "Decoder::try_read malformed v2 envelope";
+        _state = DecoderState::failed;
+        return false;
+      }
+      if (!size_len) {
+        return false;
+      }
+      state.commit(type_len + size_len);
+      _envelope.message_type = static_cast<int>(type);
+      _envelope.message_size = size;
     }
+    _state = DecoderState::have_envelope;
+    LOG(INFO) << "Handle::try_read state " << (int)_state
+              << " envelope, message_size " << _envelope.message_size
+              << " message_type " << _envelope.message_type;
+    return try_read(state);
   } else if (_state == DecoderState::have_envelope) {
     return true;
+  } else if (_state == DecoderState::failed) {
+    return false;
   } else {
     std::terminate();
   }
 }
 
+bool Decoder::failed() const { return _state == DecoderState::failed; }
+
 void Decoder::reset() {
   _state = DecoderState::before_envelope;
   _envelope = {};
 }
 
-void Encoder::fill_envelope(Envelope envelope, RingBuffer &buff) {
-  buff.memcpy_in(&envelope, sizeof(envelope));
+FieldReader Decoder::fields(RingBuffer &state) { return {_version, state}; }
+
+bool Encoder::fill_envelope(Envelope envelope, RingBuffer &buff) {
+  if (_version == WireVersion::v1) {
+    if (envelope.message_size >
+        static_cast<std::uint64_t>(std::numeric_limits<int>::max())) {
+      return false;
+    }
+    auto message_size = static_cast<int>(envelope.message_size);
+    buff.memcpy_in(&envelope.message_type, sizeof(envelope.message_type));
+    buff.memcpy_in(&message_size, sizeof(message_size));
+  } else {
+    write_varint(static_cast<std::uint32_t>(envelope.message_type), buff);
+    write_varint(envelope.message_size, buff);
+  }
+  return true;
 }
 
+FieldWriter Encoder::fields(RingBuffer &buff) { return {_version, buff}; }
+
+void Encoder::reserve_message(std::size_t size, RingBuffer &buff) {
+  auto needed = size + max_envelope_size;
+  if (needed > buff.ready_write_size()) {
+    buff.reserve(buff.ready_size() + needed);
+  }
+}
 
 static std::string make_daytime_string() {
   using namespace std; // For time_t, time and ctime;
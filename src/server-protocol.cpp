@@ -2,32 +2,180 @@
 #include "protocol.hpp"
 #include <absl/log/log.h>
 #include <asio/buffer.hpp>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
 
 namespace am {
 
-void ServerDecoder::try_read_server(RingBuffer &state) {
+bool ServerDecoder::try_read_server(RingBuffer &state) {
   if (try_read(state)) {
-    if (_envelope.message_type == 3) {
-      // get time
+    // text messages, track requests and tags
+    if (_envelope.message_type == 3 || _envelope.message_type == 6 ||
+        _envelope.message_type == 12) {
+      auto message_size = static_cast<std::size_t>(_envelope.message_size);
+      if (_envelope.message_type != 3 && message_size > max_name_size) {
+        LOG(ERROR) << "server: client name too long " << message_size;
+        return false;
+      }
+      if (message_size > state.capacity()) {
+        if (message_size > max_buffer_size_) {
+          LOG(ERROR) << "server: client message too big " << message_size;
+          return false;
+        }
+        state.reserve(message_size);
+      }
       if (state.ready_size() >= _envelope.message_size) {
-        // got time
-        on_message_(state.peek_string_view(_envelope.message_size));
-        state.commit(_envelope.message_size);
+        auto text = state.peek_string_view(_envelope.message_size);
+        if (_envelope.message_type == 3) {
+          on_message_(text);
+          state.commit(_envelope.message_size);
+          reset();
+        } else {
+          auto type = _envelope.message_type;
+          std::string name;
+          for (auto part : text) {
+            name.append(part);
+          }
+          state.commit(_envelope.message_size);
+          reset();
+          if (type == 6) {
+            on_track_request_(std::move(name));
+          } else if (on_etag_) {
+            on_etag_(std::move(name));
+          }
+        }
+        return try_read_server(state);
+      }
+    } else if (_envelope.message_type == 4) {
+      auto wire_size = RangeRequest::wire_size(_version);
+      if (_envelope.message_size != wire_size) {
+        LOG(ERROR) << "server: bad range request size "
+                   << _envelope.message_size;
+        return false;
+      }
+      if (state.ready_size() >= wire_size) {
+        auto fields = this->fields(state);
+        RangeRequest request{};
+        request.unit = static_cast<RangeUnit>(fields.get_int());
+        request.offset = fields.get_size();
+        reset();
+        on_range_request_(request);
+        return try_read_server(state);
+      }
+    } else if (_envelope.message_type == 8) {
+      if (_envelope.message_size != Control::wire_size) {
+        LOG(ERROR) << "server: bad control message size "
+                   << _envelope.message_size;
+        return false;
+      }
+      if (state.ready_size() >= Control::wire_size) {
+        auto fields = this->fields(state);
+        Control control{};
+        control.command = static_cast<ControlCommand>(fields.get_int());
+        control.value = fields.get_int();
         reset();
-        try_read_server(state);
+        on_control_(control);
+        return try_read_server(state);
       }
+    } else if (_envelope.message_type == 9) {
+      // one hello, before the client leaves v1
+      if (_version != WireVersion::v1 ||
+          _envelope.message_size != Hello::wire_size) {
+        LOG(ERROR) << "server: unexpected hello, size "
+                   << _envelope.message_size;
+        return false;
+      }
+      if (state.ready_size() >= Hello::wire_size) {
+        FieldReader fields{WireVersion::v2, state};
+        auto offered = fields.get_u32();
+        auto capabilities = fields.get_u32();
+        reset();
+        if (offered < static_cast<std::uint32_t>(WireVersion::v2)) {
+          LOG(ERROR) << "server: client offered version " << offered;
+          return false;
+        }
+        // clients switch to v2 right after their hello, whatever they offer
+        _version = WireVersion::v2;
+        on_hello_(Hello{_version, capabilities & capabilities_supported});
+        return try_read_server(state);
+      }
+    } else {
+      LOG(ERROR) << "server: unexpected message type "
+                 << _envelope.message_type;
+      return false;
     }
   }
+  return !failed();
+}
+
+void ServerEncoder::fill_hello(Hello hello, RingBuffer &buff) {
+  fill_envelope(Envelope{9, Hello::wire_size}, buff);
+  FieldWriter fields{WireVersion::v2, buff};
+  fields.put_u32(static_cast<std::uint32_t>(hello.version));
+  fields.put_u32(hello.capabilities);
+  _version = hello.version;
+}
+
+void ServerEncoder::fill_time(std::chrono::system_clock::time_point time,
+                              RingBuffer &buff) {
+  auto since_epoch = std::chrono::duration_cast<std::chrono::microseconds>(
+      time.time_since_epoch());
+  fill_envelope(Envelope{1, 8}, buff);
+  fields(buff).put_size(static_cast<std::uint64_t>(since_epoch.count()));
 }
 
 void ServerEncoder::fill_time(std::string_view time, RingBuffer &buff) {
-  fill_envelope(Envelope{1, static_cast<int>(time.size())}, buff);
+  fill_envelope(Envelope{1, time.size()}, buff);
   buff.memcpy_in(static_cast<const char *>(time.data()), time.size());
 }
 
-void ServerEncoder::fill_mp3(Mp3 &file, RingBuffer &buff) {
-  fill_envelope(Envelope{2, static_cast<int>(file.size())}, buff);
+bool ServerEncoder::fill_range(RangeReply range, RingBuffer &buff) {
+  if (_version == WireVersion::v1 &&
+      range.total > static_cast<std::uint64_t>(std::numeric_limits<int>::max())) {
+    return false;
+  }
+  fill_envelope(Envelope{5, RangeReply::wire_size(_version)}, buff);
+  auto fields = this->fields(buff);
+  fields.put_size(range.start);
+  fields.put_size(range.total);
+  fields.put_int(range.duration_ms);
+  return true;
+}
+
+void ServerEncoder::fill_error(std::string_view error, RingBuffer &buff) {
+  reserve_message(error.size(), buff);
+  fill_envelope(Envelope{7, error.size()}, buff);
+  buff.memcpy_in(error.data(), error.size());
+}
+
+void ServerEncoder::fill_live_mp3(RingBuffer &buff) {
+  fill_envelope(Envelope{2, _version == WireVersion::v1
+                                ? std::numeric_limits<int>::max()
+                                : std::numeric_limits<std::uint64_t>::max()},
+                buff);
+}
+
+void ServerEncoder::fill_mp3_chunk(std::size_t size, RingBuffer &buff) {
+  fill_envelope(Envelope{10, size}, buff);
+}
+
+void ServerEncoder::fill_shm_ring(ShmRingInfo ring, RingBuffer &buff) {
+  fill_envelope(Envelope{11, ShmRingInfo::wire_size}, buff);
+  fields(buff).put_size(ring.size);
+}
+
+void ServerEncoder::fill_etag(std::string_view tag, RingBuffer &buff) {
+  reserve_message(tag.size(), buff);
+  fill_envelope(Envelope{12, tag.size()}, buff);
+  buff.memcpy_in(tag.data(), tag.size());
+}
+
+bool ServerEncoder::fill_mp3(Mp3 &file, std::size_t start, RingBuffer &buff) {
   // send file will send the rest
+  return fill_envelope(Envelope{2, file.size() - start}, buff);
 }
 
 } // namespace am
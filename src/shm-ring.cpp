@@ -0,0 +1,270 @@
+#include "shm-ring.hpp"
+
+#include "protocol-system.hpp"
+
+#include <absl/log/log.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <vector>
+
+#if defined(__APPLE__) || defined(__linux__)
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+#if defined(__linux__)
+#  include <sys/eventfd.h>
+#endif
+
+namespace am {
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "shared positions need lock free atomics");
+
+#if defined(__linux__)
+static void notify(int eventfd) { eventfd_write(eventfd, 1); }
+
+static ShmRingControl *map_control(int fd) {
+  void *p = ::mmap(nullptr, sizeof(ShmRingControl), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? nullptr : static_cast<ShmRingControl *>(p);
+}
+
+static std::size_t fd_size(int fd) {
+  struct stat st {};
+  if (::fstat(fd, &st) != 0) {
+    return 0;
+  }
+  return static_cast<std::size_t>(st.st_size);
+}
+#endif
+
+std::unique_ptr<ShmRing> ShmRing::create(std::size_t size) {
+#if defined(__linux__)
+  std::unique_ptr<ShmRing> ring{new ShmRing()};
+  ring->data_ = LinearMemHandle{new LinearMemInfo(size, true)};
+  ring->size_ = ring->data_->len_;
+  ring->control_fd_ = memfd_create("am_ring_control", MFD_CLOEXEC);
+  if (ring->control_fd_ == -1 ||
+      ftruncate(ring->control_fd_, sizeof(ShmRingControl)) != 0) {
+    LOG(ERROR) << "shm ring: control block failed " << errno;
+    return nullptr;
+  }
+  auto *control = map_control(ring->control_fd_);
+  if (!control) {
+    LOG(ERROR) << "shm ring: mapping the control block failed " << errno;
+    return nullptr;
+  }
+  ring->control_ = new (control) ShmRingControl();
+  ring->data_ready_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ring->space_ready_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->data_ready_ == -1 || ring->space_ready_ == -1) {
+    LOG(ERROR) << "shm ring: eventfd failed " << errno;
+    return nullptr;
+  }
+  return ring;
+#else
+  return nullptr;
+#endif
+}
+
+std::unique_ptr<ShmRing> ShmRing::open(Fds fds, std::size_t size) {
+#if defined(__linux__)
+  std::unique_ptr<ShmRing> ring{new ShmRing()};
+  // owned from here on, closed with the ring on any failure
+  ring->control_fd_ = fds[1];
+  ring->data_ready_ = fds[2];
+  ring->space_ready_ = fds[3];
+  if (fd_size(fds[0]) != size || fd_size(fds[1]) < sizeof(ShmRingControl)) {
+    close(fds[0]);
+    LOG(ERROR) << "shm ring: descriptors are not a ring of " << size
+               << " bytes";
+    return nullptr;
+  }
+  ring->data_ = LinearMemInfo::map_shared(fds[0], size);
+  if (!ring->data_) {
+    LOG(ERROR) << "shm ring: mapping the ring failed " << errno;
+    return nullptr;
+  }
+  ring->size_ = size;
+  ring->control_ = map_control(ring->control_fd_);
+  if (!ring->control_) {
+    LOG(ERROR) << "shm ring: mapping the control block failed " << errno;
+    return nullptr;
+  }
+  return ring;
+#else
+#  if defined(__APPLE__)
+  for (auto fd : fds) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+#  endif
+  return nullptr;
+#endif
+}
+
+ShmRing::~ShmRing() {
+#if defined(__linux__)
+  if (control_) {
+    ::munmap(control_, sizeof(ShmRingControl));
+  }
+  for (auto fd : {control_fd_, data_ready_, space_ready_}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+#endif
+}
+
+ShmRing::Fds ShmRing::fds() const {
+  return {data_ ? data_->fd_ : -1, control_fd_, data_ready_, space_ready_};
+}
+
+void ShmRing::drain_eventfd(int fd) {
+#if defined(__linux__)
+  eventfd_t count{};
+  eventfd_read(fd, &count);
+#endif
+}
+
+bool ShmRing::attached() const { return control_->attached.load() != 0; }
+
+std::size_t ShmRing::writable() const {
+  if (!control_->attached.load()) {
+    return 0;
+  }
+  auto used = control_->written.load() - control_->read.load();
+  return used >= size_ ? 0 : size_ - used;
+}
+
+std::span<char> ShmRing::write_span() {
+  return {data_->p1_ + control_->written.load() % size_, writable()};
+}
+
+void ShmRing::commit_write(std::size_t len) {
+  control_->written.fetch_add(len);
+#if defined(__linux__)
+  if (control_->reader_waiting.exchange(0)) {
+    notify(data_ready_);
+  }
+#endif
+}
+
+void ShmRing::finish() {
+  control_->finished.store(1);
+#if defined(__linux__)
+  if (control_->reader_waiting.exchange(0)) {
+    notify(data_ready_);
+  }
+#endif
+}
+
+bool ShmRing::writer_wait() {
+  control_->writer_waiting.store(1);
+  if (writable() > 0) {
+    control_->writer_waiting.store(0);
+    return false;
+  }
+  return true;
+}
+
+std::uint64_t ShmRing::written() const { return control_->written.load(); }
+
+bool ShmRing::finished() const { return control_->finished.load(); }
+
+void ShmRing::release(std::uint64_t read) {
+  control_->read.store(read);
+  control_->attached.store(1);
+#if defined(__linux__)
+  if (control_->writer_waiting.exchange(0)) {
+    notify(space_ready_);
+  }
+#endif
+}
+
+bool ShmRing::reader_wait(std::uint64_t seen) {
+  control_->reader_waiting.store(1);
+  if (control_->written.load() != seen || control_->finished.load()) {
+    control_->reader_waiting.store(0);
+    return false;
+  }
+  return true;
+}
+
+LinearMemHandle ShmRing::take_data() { return std::move(data_); }
+
+long send_with_fds(int socket, std::span<const char> bytes,
+                   std::span<const int> fds) {
+#if defined(__APPLE__) || defined(__linux__)
+  iovec iov{const_cast<char *>(bytes.data()), bytes.size()};
+  std::vector<char> control(CMSG_SPACE(fds.size_bytes()));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  auto *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fds.size_bytes());
+  std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size_bytes());
+  int flags = 0;
+#  if defined(MSG_NOSIGNAL)
+  flags |= MSG_NOSIGNAL;
+#  endif
+  return ::sendmsg(socket, &msg, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+long receive_with_fds(int socket, std::span<char> out, std::vector<int> &fds) {
+#if defined(__APPLE__) || defined(__linux__)
+  iovec iov{out.data(), out.size()};
+  // a ring's descriptors, at most one message of them per read
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(ShmRing::Fds))];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int flags = 0;
+#  if defined(MSG_CMSG_CLOEXEC)
+  flags |= MSG_CMSG_CLOEXEC;
+#  endif
+  auto res = ::recvmsg(socket, &msg, flags);
+  if (res < 0) {
+    return res;
+  }
+  for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; i++) {
+      int fd{};
+      std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      fds.push_back(fd);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    LOG(WARNING) << "receive_with_fds: descriptors were truncated";
+  }
+  return res;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+} // namespace am
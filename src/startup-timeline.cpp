@@ -0,0 +1,83 @@
+#include "startup-timeline.hpp"
+
+#include <absl/log/log.h>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string_view>
+
+namespace am {
+
+namespace {
+
+// the steps ending at each milestone after play, then the whole of it
+constexpr std::array<std::string_view, StartupTimeline::milestones>
+    step_names{"resolve",      "connect",     "first byte", "first frame",
+               "device start", "first audio", "total"};
+
+std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             StartupTimeline::Clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace
+
+StartupTimeline &StartupTimeline::instance() {
+  static StartupTimeline timeline;
+  return timeline;
+}
+
+void StartupTimeline::begin() {
+  for (auto &mark : marks_) {
+    mark.store(0);
+  }
+  reported_.store(false);
+  mark(Milestone::play);
+}
+
+bool StartupTimeline::mark(Milestone milestone) {
+  std::int64_t unset = 0;
+  return marks_[static_cast<std::size_t>(milestone)].compare_exchange_strong(
+      unset, now_ns());
+}
+
+void StartupTimeline::report() {
+  auto first_audio =
+      marks_[static_cast<std::size_t>(Milestone::first_audio)].load();
+  if (first_audio == 0 || reported_.exchange(true)) {
+    return;
+  }
+  std::array<std::int64_t, milestones> marks{};
+  for (std::size_t i = 0; i < milestones; i++) {
+    marks[i] = marks_[i].load();
+  }
+  // a step missing its start, a UDP stream has no connect, counts from the
+  // milestone before
+  std::ostringstream line;
+  auto last = marks[0];
+  for (std::size_t i = 1; i < milestones; i++) {
+    line << (i > 1 ? ", " : "") << step_names[i - 1] << " ";
+    if (marks[i] == 0 || last == 0) {
+      line << "-";
+      continue;
+    }
+    auto micros = (marks[i] - last) / 1000;
+    histograms_[i - 1].add(micros);
+    line << micros << " us";
+    last = marks[i];
+  }
+  if (marks[0] != 0) {
+    auto micros = (first_audio - marks[0]) / 1000;
+    histograms_.back().add(micros);
+    line << ", total " << micros << " us";
+  }
+  LOG(INFO) << "startup: " << line.str();
+  for (auto &histogram : histograms_) {
+    LOG(INFO) << histogram;
+  }
+}
+
+} // namespace am
@@ -0,0 +1,173 @@
+#include "track-cache.hpp"
+
+#include <absl/log/log.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace am {
+
+namespace {
+
+// tags come from the server and end up in paths
+bool valid_tag(std::string_view tag) {
+  return tag.size() == ContentHash::tag_size &&
+         std::all_of(tag.begin(), tag.end(), [](char c) {
+           return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+         });
+}
+
+} // namespace
+
+TrackCache::TrackCache(fs::path dir)
+    : dir_(std::move(dir)) {}
+
+fs::path TrackCache::default_dir() {
+  if (auto *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+    return fs::path(xdg) / "mp3playerasio";
+  }
+  if (auto *home = std::getenv("HOME"); home && *home) {
+    return fs::path(home) / ".cache" / "mp3playerasio";
+  }
+  return {};
+}
+
+fs::path TrackCache::copy_path(std::string_view tag) const {
+  return dir_ / (std::string(tag) + ".mp3");
+}
+
+fs::path TrackCache::name_path(std::string_view host,
+                               std::string_view track) const {
+  ContentHash key;
+  key.update(host);
+  key.update(std::string_view("\n"));
+  key.update(track);
+  return dir_ / "names" / key.tag();
+}
+
+std::string TrackCache::lookup(std::string_view host,
+                               std::string_view track) const {
+  std::ifstream name(name_path(host, track));
+  std::string tag;
+  if (!std::getline(name, tag) || !valid_tag(tag)) {
+    return {};
+  }
+  std::error_code ec;
+  if (!fs::is_regular_file(copy_path(tag), ec)) {
+    return {};
+  }
+  return tag;
+}
+
+fhandle TrackCache::open(std::string_view tag) const {
+  if (!valid_tag(tag)) {
+    return nullptr;
+  }
+  return fhandle{std::fopen(copy_path(tag).string().c_str(), "rb")};
+}
+
+std::unique_ptr<TrackCacheWriter> TrackCache::store(std::string_view host,
+                                                    std::string_view track,
+                                                    std::string tag,
+                                                    std::size_t size) {
+  if (!valid_tag(tag)) {
+    LOG(WARNING) << "track cache: ignoring tag " << tag;
+    return nullptr;
+  }
+  std::error_code ec;
+  fs::create_directories(dir_ / "names", ec);
+  if (ec) {
+    LOG(WARNING) << "track cache: can not create " << dir_ << " "
+                 << ec.message();
+    return nullptr;
+  }
+  auto copy = copy_path(tag);
+  auto part = copy;
+  part += ".part";
+  fhandle file{std::fopen(part.string().c_str(), "wb")};
+  if (!file) {
+    LOG(WARNING) << "track cache: can not write " << part;
+    return nullptr;
+  }
+  return std::make_unique<TrackCacheWriter>(std::move(file), std::move(part),
+                                            std::move(copy),
+                                            name_path(host, track),
+                                            std::move(tag), size);
+}
+
+TrackCacheWriter::TrackCacheWriter(fhandle file, fs::path part, fs::path copy,
+                                   fs::path name, std::string tag,
+                                   std::size_t size)
+    : file_(std::move(file))
+    , part_(std::move(part))
+    , copy_(std::move(copy))
+    , name_(std::move(name))
+    , tag_(std::move(tag))
+    , size_(size) {}
+
+TrackCacheWriter::~TrackCacheWriter() {
+  if (!done_) {
+    file_.reset();
+    std::error_code ec;
+    fs::remove(part_, ec);
+  }
+}
+
+void TrackCacheWriter::append(std::span<const char> bytes) {
+  if (failed_ || done_ || bytes.empty()) {
+    return;
+  }
+  if (written_ + bytes.size() > size_ ||
+      std::fwrite(bytes.data(), 1, bytes.size(), file_.get()) !=
+          bytes.size()) {
+    LOG(WARNING) << "track cache: dropping the copy of " << tag_;
+    failed_ = true;
+    return;
+  }
+  hash_.update(bytes);
+  written_ += bytes.size();
+  if (written_ == size_) {
+    finish();
+  }
+}
+
+void TrackCacheWriter::finish() {
+  failed_ = true;
+  if (std::fflush(file_.get()) != 0) {
+    LOG(WARNING) << "track cache: writing " << part_ << " failed";
+    return;
+  }
+  file_.reset();
+  if (hash_.tag() != tag_) {
+    LOG(WARNING) << "track cache: download hashed to " << hash_.tag()
+                 << " instead of " << tag_;
+    return;
+  }
+  std::error_code ec;
+  fs::rename(part_, copy_, ec);
+  if (ec) {
+    LOG(WARNING) << "track cache: keeping " << copy_ << " failed "
+                 << ec.message();
+    return;
+  }
+  done_ = true;
+  // the name moves to the new copy last, a crash before leaves the old one
+  auto name_part = name_;
+  name_part += ".part";
+  {
+    std::ofstream name(name_part, std::ios::trunc);
+    name << tag_ << '\n';
+    if (!name) {
+      return;
+    }
+  }
+  fs::rename(name_part, name_, ec);
+  LOG(INFO) << "track cache: kept " << copy_;
+}
+
+} // namespace am
@@ -0,0 +1,258 @@
+#include "udp-stream.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace am {
+
+static void put_le(std::vector<char> &out, std::uint64_t value,
+                   std::size_t len) {
+  for (std::size_t i = 0; i < len; i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+static std::uint64_t get_le(std::span<const char> in, std::size_t len) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < len; i++) {
+    value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+// XORs bytes into into, growing it with zeros to fit
+static void xor_into(std::vector<char> &into, std::span<const char> bytes) {
+  if (into.size() < bytes.size()) {
+    into.resize(bytes.size());
+  }
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    into[i] ^= bytes[i];
+  }
+}
+
+std::vector<char> UdpRequest::encode() const {
+  std::vector<char> out;
+  out.reserve(header_size + track.size());
+  put_le(out, static_cast<std::uint8_t>(kind), 1);
+  put_le(out, unit, 1);
+  put_le(out, 0, 2);
+  put_le(out, offset, 8);
+  put_le(out, cookie, 8);
+  out.insert(out.end(), track.begin(), track.end());
+  return out;
+}
+
+std::optional<UdpRequest> UdpRequest::decode(std::span<const char> datagram) {
+  if (datagram.size() < header_size) {
+    return std::nullopt;
+  }
+  auto kind = static_cast<UdpRequestKind>(get_le(datagram, 1));
+  if (kind != UdpRequestKind::request && kind != UdpRequestKind::keepalive &&
+      kind != UdpRequestKind::stop) {
+    return std::nullopt;
+  }
+  UdpRequest request{};
+  request.kind = kind;
+  request.unit = static_cast<std::uint8_t>(get_le(datagram.subspan(1), 1));
+  request.offset = get_le(datagram.subspan(4), 8);
+  request.cookie = get_le(datagram.subspan(12), 8);
+  auto track = datagram.subspan(header_size);
+  request.track.assign(track.begin(), track.end());
+  return request;
+}
+
+UdpPacket UdpPacket::make_cookie(std::uint64_t cookie) {
+  UdpPacket packet{0, UdpPacketKind::cookie, 0, 8, {}};
+  put_le(packet.payload, cookie, 8);
+  return packet;
+}
+
+std::uint64_t UdpPacket::cookie() const {
+  return payload.size() == 8 ? get_le(payload, 8) : 0;
+}
+
+std::vector<char> UdpPacket::encode() const {
+  std::vector<char> out;
+  out.reserve(header_size + payload.size());
+  put_le(out, seq, 4);
+  put_le(out, static_cast<std::uint8_t>(kind), 1);
+  put_le(out, count, 1);
+  put_le(out, length, 2);
+  out.insert(out.end(), payload.begin(), payload.end());
+  return out;
+}
+
+std::optional<UdpPacket> UdpPacket::decode(std::span<const char> datagram) {
+  if (datagram.size() < header_size) {
+    return std::nullopt;
+  }
+  UdpPacket packet{};
+  packet.seq = static_cast<std::uint32_t>(get_le(datagram, 4));
+  packet.kind = static_cast<UdpPacketKind>(get_le(datagram.subspan(4), 1));
+  packet.count = static_cast<std::uint8_t>(get_le(datagram.subspan(5), 1));
+  packet.length = static_cast<std::uint16_t>(get_le(datagram.subspan(6), 2));
+  auto payload = datagram.subspan(header_size);
+  if (packet.kind > UdpPacketKind::cookie ||
+      (packet.kind == UdpPacketKind::data && packet.length != payload.size()) ||
+      (packet.kind == UdpPacketKind::cookie && payload.size() != 8)) {
+    return std::nullopt;
+  }
+  packet.payload.assign(payload.begin(), payload.end());
+  return packet;
+}
+
+FecEncoder::FecEncoder(std::uint8_t group)
+    : group_(group) {}
+
+std::vector<UdpPacket> FecEncoder::add(std::span<const char> payload) {
+  std::vector<UdpPacket> packets;
+  packets.push_back(UdpPacket{next_seq_, UdpPacketKind::data, group_,
+                              static_cast<std::uint16_t>(payload.size()),
+                              std::vector<char>(payload.begin(), payload.end())});
+  next_seq_++;
+  if (group_) {
+    xor_into(xor_, payload);
+    length_xor_ ^= static_cast<std::uint16_t>(payload.size());
+    if (next_seq_ - group_start_ == group_) {
+      packets.push_back(parity());
+    }
+  }
+  return packets;
+}
+
+std::optional<UdpPacket> FecEncoder::flush() {
+  if (!group_ || next_seq_ == group_start_) {
+    return std::nullopt;
+  }
+  return parity();
+}
+
+UdpPacket FecEncoder::parity() {
+  UdpPacket packet{group_start_, UdpPacketKind::parity,
+                   static_cast<std::uint8_t>(next_seq_ - group_start_),
+                   length_xor_, std::exchange(xor_, {})};
+  length_xor_ = 0;
+  group_start_ = next_seq_;
+  return packet;
+}
+
+JitterBuffer::JitterBuffer(std::size_t depth)
+    : depth_(depth) {}
+
+void JitterBuffer::add(UdpPacket packet) {
+  switch (packet.kind) {
+  case UdpPacketKind::data: {
+    stats_.received++;
+    if (packet.seq < next_ || data_.contains(packet.seq)) {
+      stats_.late++;
+      return;
+    }
+    highest_ = std::max(highest_, packet.seq);
+    auto seq = packet.seq;
+    group_ = packet.count;
+    data_.emplace(seq, std::move(packet.payload));
+    if (group_) {
+      recover(seq - seq % group_);
+    }
+    break;
+  }
+  case UdpPacketKind::parity: {
+    if (!packet.count || packet.seq + packet.count <= next_) {
+      return;
+    }
+    // the whole group was sent before its parity
+    highest_ = std::max(highest_, packet.seq + packet.count - 1);
+    auto seq = packet.seq;
+    parity_.insert_or_assign(seq, std::move(packet));
+    recover(seq);
+    break;
+  }
+  case UdpPacketKind::end:
+    end_ = packet.seq;
+    break;
+  default:
+    break;
+  }
+}
+
+void JitterBuffer::recover(std::uint32_t group_start) {
+  auto parity = parity_.find(group_start);
+  if (parity == parity_.end()) {
+    return;
+  }
+  auto &packet = parity->second;
+  std::optional<std::uint32_t> missing;
+  for (auto seq = group_start; seq < group_start + packet.count; seq++) {
+    if (data_.contains(seq)) {
+      continue;
+    }
+    if (missing) {
+      // two or more lost, parity can not help
+      return;
+    }
+    missing = seq;
+  }
+  if (!missing || *missing < next_) {
+    return;
+  }
+  auto payload = packet.payload;
+  std::uint16_t length = packet.length;
+  for (auto seq = group_start; seq < group_start + packet.count; seq++) {
+    if (seq != *missing) {
+      auto &bytes = data_.at(seq);
+      xor_into(payload, bytes);
+      length ^= static_cast<std::uint16_t>(bytes.size());
+    }
+  }
+  if (length > payload.size()) {
+    return;
+  }
+  payload.resize(length);
+  data_.emplace(*missing, std::move(payload));
+  stats_.recovered++;
+}
+
+std::size_t
+JitterBuffer::drain(absl::AnyInvocable<bool(std::span<const char>)> sink) {
+  std::size_t delivered = 0;
+  while (!end_ || next_ < *end_) {
+    auto found = data_.find(next_);
+    if (found != data_.end()) {
+      if (!sink(found->second)) {
+        break;
+      }
+      delivered += found->second.size();
+      next_++;
+      continue;
+    }
+    if (!end_ && highest_ < next_ + depth_) {
+      // may still come, or be restored by parity
+      break;
+    }
+    stats_.lost++;
+    next_++;
+  }
+  // delivered packets stay while their group may still need them to restore
+  // another, a group is done once all of it is behind next_
+  while (!parity_.empty() &&
+         parity_.begin()->first + parity_.begin()->second.count <= next_) {
+    parity_.erase(parity_.begin());
+  }
+  auto keep_from = group_ ? next_ - next_ % group_ : next_;
+  if (!parity_.empty()) {
+    keep_from = std::min(keep_from, parity_.begin()->first);
+  }
+  data_.erase(data_.begin(), data_.lower_bound(keep_from));
+  return delivered;
+}
+
+bool JitterBuffer::finished() const { return end_ && next_ >= *end_; }
+
+} // namespace am
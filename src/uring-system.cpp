@@ -0,0 +1,324 @@
+#include "uring-system.hpp"
+
+#if defined(__linux__)
+
+#  include "mp3-system.hpp"
+
+#  include <absl/log/log.h>
+#  include <algorithm>
+#  include <asio/post.hpp>
+#  include <cerrno>
+#  include <cstring>
+#  include <utility>
+#  include <linux/io_uring.h>
+#  include <sys/eventfd.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+
+namespace am {
+
+namespace {
+
+int uring_setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uring_enter(int fd, unsigned to_submit) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0));
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+bool supports_send_zc(int ring_fd) {
+  constexpr unsigned ops = 256;
+  std::vector<char> buf(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op));
+  auto *probe = reinterpret_cast<io_uring_probe *>(buf.data());
+  if (uring_register(ring_fd, IORING_REGISTER_PROBE, probe, ops) < 0) {
+    return false;
+  }
+  return probe->last_op >= IORING_OP_SEND_ZC &&
+         (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+}
+
+} // namespace
+
+asio::execution_context::id UringSendService::id;
+
+UringSendService::UringSendService(asio::execution_context &context)
+    : asio::execution_context::service(context)
+    , io_context_(static_cast<asio::io_context &>(context))
+    , eventfd_(io_context_) {
+  if (!setup()) {
+    close_ring();
+  }
+}
+
+UringSendService::~UringSendService() { close_ring(); }
+
+void UringSendService::shutdown() {
+  asio::error_code ec;
+  eventfd_.close(ec);
+}
+
+bool UringSendService::setup() {
+  io_uring_params params{};
+  ring_fd_ = uring_setup(entries, &params);
+  if (ring_fd_ < 0) {
+    LOG(WARNING) << "io_uring: setup failed " << errno
+                 << ", falling back to sendfile";
+    ring_fd_ = -1;
+    return false;
+  }
+  sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    sq_ptr_ = nullptr;
+    return false;
+  }
+  if (single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      cq_ptr_ = nullptr;
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+  auto *sq = static_cast<char *>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  auto *cq = static_cast<char *>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (efd < 0) {
+    return false;
+  }
+  if (uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+    ::close(efd);
+    return false;
+  }
+  eventfd_.assign(efd);
+  send_zc_ = supports_send_zc(ring_fd_);
+  LOG(INFO) << "io_uring: ready, send_zc " << send_zc_;
+  return true;
+}
+
+void UringSendService::close_ring() {
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ptr_ && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  cq_ptr_ = nullptr;
+  if (sq_ptr_) {
+    munmap(sq_ptr_, sq_size_);
+    sq_ptr_ = nullptr;
+  }
+  if (ring_fd_ >= 0) {
+    // in flight sends are cancelled by the kernel, ops hold the files
+    ::close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+UringSendOp *UringSendService::send(SendFile &owner,
+                                    std::shared_ptr<const MediaFile> file,
+                                    int socket, const char *data,
+                                    std::size_t len) {
+  unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    // submission queue is full, hand what we have to the kernel first
+    submit();
+    tail = *sq_tail_;
+  }
+  auto *op = alloc_op();
+  op->owner_ = &owner;
+  op->file_ = std::move(file);
+
+  unsigned index = tail & *sq_mask_;
+  auto *sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = send_zc_ ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+  sqe->fd = socket;
+  sqe->addr = reinterpret_cast<std::uint64_t>(data);
+  sqe->len = static_cast<std::uint32_t>(len);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  queued_++;
+  schedule_flush();
+  wait_completions();
+  return op;
+}
+
+void UringSendService::detach(UringSendOp *op) {
+  op->owner_ = nullptr;
+  if (ring_fd_ < 0) {
+    return;
+  }
+  // a send not submitted yet would go to whatever socket takes its fd number
+  // once the owner closes it, it completes as a no op instead
+  unsigned tail = *sq_tail_;
+  for (unsigned i = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE); i != tail;
+       i++) {
+    auto *sqe = &sqes_[sq_array_[i & *sq_mask_]];
+    if (sqe->user_data == reinterpret_cast<std::uint64_t>(op)) {
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_NOP;
+      sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+    }
+  }
+}
+
+void UringSendService::schedule_flush() {
+  if (flush_scheduled_) {
+    return;
+  }
+  flush_scheduled_ = true;
+  // runs after the handlers already queued, so their sends join this batch
+  asio::post(io_context_, [this]() {
+    flush_scheduled_ = false;
+    submit();
+  });
+}
+
+void UringSendService::submit() {
+  if (queued_ == 0 || ring_fd_ < 0) {
+    return;
+  }
+  int res = uring_enter(ring_fd_, queued_);
+  SendFileStats::instance().add(1, 0);
+  if (res < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+      schedule_flush();
+      return;
+    }
+    LOG(ERROR) << "io_uring: enter failed " << errno << ", failing "
+               << queued_ << " sends";
+    fail_queued(-errno);
+    return;
+  }
+  queued_ -= std::min(queued_, static_cast<unsigned>(res));
+}
+
+void UringSendService::fail_queued(int res) {
+  // the kernel takes no SQE outside io_uring_enter, so the queued ones can
+  // be taken back
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  std::vector<UringSendOp *> failed;
+  for (unsigned i = head; i != *sq_tail_; i++) {
+    auto *sqe = &sqes_[sq_array_[i & *sq_mask_]];
+    failed.push_back(reinterpret_cast<UringSendOp *>(sqe->user_data));
+  }
+  __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+  queued_ = 0;
+  // owners send again from their callbacks, not while a send is queued
+  asio::post(io_context_, [this, failed = std::move(failed), res]() {
+    for (auto *op : failed) {
+      auto *owner = op->owner_;
+      free_op(op);
+      if (owner) {
+        owner->uring_.op_ = nullptr;
+        owner->on_uring_sent(res);
+      }
+    }
+  });
+}
+
+void UringSendService::wait_completions() {
+  // only armed while sends are in flight, a pending read would keep the
+  // io_context running forever
+  if (waiting_ || free_ops_.size() == ops_.size()) {
+    return;
+  }
+  waiting_ = true;
+  eventfd_.async_read_some(
+      asio::buffer(eventfd_buf_),
+      [this](const asio::error_code &ec, std::size_t) {
+        waiting_ = false;
+        if (ec) {
+          return;
+        }
+        SendFileStats::instance().add(1, 0);
+        reap();
+        wait_completions();
+      });
+}
+
+void UringSendService::reap() {
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    auto cqe = cqes_[head & *cq_mask_];
+    head++;
+    // give the slot back before callbacks queue new sends
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    auto *op = reinterpret_cast<UringSendOp *>(cqe.user_data);
+    if (cqe.flags & IORING_CQE_F_NOTIF) {
+      // zero copy send released the pages
+      free_op(op);
+      continue;
+    }
+    auto *owner = op->owner_;
+    op->owner_ = nullptr;
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      free_op(op);
+    }
+    if (owner) {
+      owner->uring_.op_ = nullptr;
+      owner->on_uring_sent(cqe.res);
+    }
+    tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+}
+
+UringSendOp *UringSendService::alloc_op() {
+  if (free_ops_.empty()) {
+    ops_.emplace_back(std::make_unique<UringSendOp>());
+    return ops_.back().get();
+  }
+  auto *op = free_ops_.back();
+  free_ops_.pop_back();
+  return op;
+}
+
+void UringSendService::free_op(UringSendOp *op) {
+  op->owner_ = nullptr;
+  op->file_.reset();
+  free_ops_.push_back(op);
+}
+
+} // namespace am
+
+#endif
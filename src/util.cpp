@@ -1,6 +1,13 @@
 #include "util.hpp"
 
 #include <absl/log/log.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
 
 namespace am {
 
@@ -18,4 +25,115 @@ DestructionSignaller::DestructionSignaller(DestructionSignaller &&other) noexcep
 
 }
 
+namespace {
+
+constexpr std::array<std::uint32_t, 64> sha256_k{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+std::uint32_t rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+} // namespace
+
+void ContentHash::update(std::span<const char> bytes) {
+  length_ += bytes.size();
+  if (block_used_ > 0) {
+    auto take = std::min(bytes.size(), block_.size() - block_used_);
+    std::memcpy(block_.data() + block_used_, bytes.data(), take);
+    block_used_ += take;
+    bytes = bytes.subspan(take);
+    if (block_used_ < block_.size()) {
+      return;
+    }
+    compress(block_.data());
+    block_used_ = 0;
+  }
+  // whole blocks straight from the track
+  while (bytes.size() >= block_.size()) {
+    compress(bytes.data());
+    bytes = bytes.subspan(block_.size());
+  }
+  std::memcpy(block_.data(), bytes.data(), bytes.size());
+  block_used_ = bytes.size();
+}
+
+ContentHash::Digest ContentHash::digest() const {
+  auto last = *this;
+  auto bits = length_ * 8;
+  const char pad[64] = {'\x80'};
+  // the 0x80 and zeros up to the 8 bytes of length closing a block
+  auto pad_size = (block_used_ < 56 ? 56 : 120) - block_used_;
+  last.update({pad, pad_size});
+  std::array<char, 8> length{};
+  for (std::size_t i = 0; i < length.size(); i++) {
+    length[i] = static_cast<char>(bits >> (56 - 8 * i));
+  }
+  last.update(length);
+  Digest digest{};
+  for (std::size_t i = 0; i < digest.size(); i++) {
+    digest[i] = static_cast<std::uint8_t>(last.state_[i / 4] >>
+                                          (24 - 8 * (i % 4)));
+  }
+  return digest;
+}
+
+std::string ContentHash::to_tag(const Digest &digest) {
+  static constexpr char digits[] = "0123456789abcdef";
+  std::string tag(tag_size, '0');
+  for (std::size_t i = 0; i < digest.size(); i++) {
+    tag[2 * i] = digits[digest[i] >> 4];
+    tag[2 * i + 1] = digits[digest[i] & 0xf];
+  }
+  return tag;
+}
+
+void ContentHash::compress(const char *block) {
+  std::array<std::uint32_t, 64> w;
+  for (std::size_t i = 0; i < 16; i++) {
+    auto *b = reinterpret_cast<const unsigned char *>(block + 4 * i);
+    w[i] = static_cast<std::uint32_t>(b[0]) << 24 |
+           static_cast<std::uint32_t>(b[1]) << 16 |
+           static_cast<std::uint32_t>(b[2]) << 8 | b[3];
+  }
+  for (std::size_t i = 16; i < 64; i++) {
+    auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  auto [a, b, c, d, e, f, g, h] = state_;
+  for (std::size_t i = 0; i < 64; i++) {
+    auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    auto ch = (e & f) ^ (~e & g);
+    auto t1 = h + s1 + ch + sha256_k[i] + w[i];
+    auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    auto maj = (a & b) ^ (a & c) ^ (b & c);
+    auto t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+  state_[5] += f;
+  state_[6] += g;
+  state_[7] += h;
+}
+
 }
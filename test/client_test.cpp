@@ -0,0 +1,121 @@
+#include "asio-client.hpp"
+#include "audio-player.hpp"
+#include "protocol.hpp"
+#include "server-protocol.hpp"
+
+#include <asio.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/local/stream_protocol.hpp>
+#include <asio/use_awaitable.hpp>
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace am {
+
+namespace {
+
+namespace fs = std::filesystem;
+using asio::local::stream_protocol;
+
+// MPEG 1 layer 3, 128 kbps, 44100 Hz, stereo, no padding: 417 bytes
+constexpr char frame_128k[] = {'\xFF', '\xFB', '\x90', '\x00'};
+
+std::vector<char> frames(std::size_t count) {
+  std::vector<char> data(count * 417, 0);
+  for (std::size_t i = 0; i < count; i++) {
+    std::copy(std::begin(frame_128k), std::end(frame_128k),
+              data.begin() + i * 417);
+  }
+  return data;
+}
+
+/// A server that drops the stream after its first bytes.
+/**
+ * Each connection answers the hello and the range request, then sends the
+ * track from the requested offset: the first connection only sends
+ * first_bytes of it before closing, the last one all of it.
+ */
+struct DroppingServer {
+  asio::awaitable<void> serve(stream_protocol::acceptor &acceptor,
+                              std::size_t connections) {
+    for (std::size_t i = 0; i < connections; i++) {
+      auto socket = co_await acceptor.async_accept(asio::use_awaitable);
+      RingBuffer in(4096, 1024, 2048);
+      RingBuffer out(4096, 1024, 2048);
+      std::optional<Hello> hello;
+      std::optional<RangeRequest> range;
+      ServerDecoder decoder([](buffers_2<std::string_view>) {},
+                            [](std::string) {},
+                            [&range](RangeRequest request) { range = request; },
+                            [](Control) {},
+                            [&hello](Hello answer) { hello = answer; }, 4096);
+      while (!range) {
+        auto bytes = co_await socket.async_read_some(in.prepared(),
+                                                     asio::use_awaitable);
+        in.consume(bytes);
+        if (!decoder.try_read_server(in)) {
+          co_return;
+        }
+      }
+      offsets.push_back(range->offset);
+      ServerEncoder encoder;
+      // no capabilities, the ring and tags stay off
+      encoder.fill_hello(Hello{hello->version, 0}, out);
+      auto start = static_cast<std::size_t>(range->offset);
+      encoder.fill_range(RangeReply{start, track.size(), 0}, out);
+      encoder.fill_envelope(Envelope{2, track.size() - start}, out);
+      co_await asio::async_write(socket, out.data(), asio::use_awaitable);
+      auto end = i == 0 ? first_bytes : track.size();
+      co_await asio::async_write(
+          socket, asio::buffer(track.data() + start, end - start),
+          asio::use_awaitable);
+    }
+  }
+
+  std::vector<char> track;
+  std::size_t first_bytes;
+  // of every range request
+  std::vector<std::uint64_t> offsets{};
+};
+
+} // namespace
+
+TEST_CASE("TcpClientConnection continues a dropped track where it stopped",
+          "[TcpClientConnection]") {
+  using namespace std::chrono_literals;
+  auto path = fs::temp_directory_path() / "client_test.sock";
+  fs::remove(path);
+  asio::io_context io_context;
+  asio::io_context::strand strand{io_context};
+  stream_protocol::acceptor acceptor(io_context,
+                                     stream_protocol::endpoint(path.string()));
+  // less than the player's input holds, so the client takes all of it
+  DroppingServer server{frames(100), 10000};
+  asio::co_spawn(io_context, server.serve(acceptor, 2), asio::detached);
+
+  Channel input;
+  Mp3Stream mp3_stream(input, io_context, strand);
+  auto connection = TcpClientConnection::create(
+      io_context, strand, mp3_stream, "", RangeRequest{RangeUnit::bytes, 0});
+  connection->connect(stream_protocol::endpoint(path.string()));
+  for (int i = 0; i < 100 && server.offsets.size() < 2; i++) {
+    io_context.run_for(50ms);
+  }
+  connection->send_control(Control{ControlCommand::stop, 0});
+  io_context.stop();
+
+  // the second connection asks for the first byte the player does not have
+  REQUIRE(server.offsets == std::vector<std::uint64_t>{0, 10000});
+  fs::remove(path);
+}
+
+} // namespace am
@@ -0,0 +1,362 @@
+#include "broadcast.hpp"
+#include "catalog.hpp"
+#include "media-cache.hpp"
+#include "mp3-frame.hpp"
+#include "mp3-index.hpp"
+#include "mp3.hpp"
+#include "pacer.hpp"
+#include "track-cache.hpp"
+#include "util.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace am {
+
+namespace {
+
+// MPEG 1 layer 3, 128 kbps, 44100 Hz, stereo, no padding: 417 bytes
+constexpr char frame_128k[] = {'\xFF', '\xFB', '\x90', '\x00'};
+
+std::vector<char> frames(std::size_t count, std::size_t offset) {
+  std::vector<char> data(offset + count * 417, 0);
+  for (std::size_t i = 0; i < count; i++) {
+    std::copy(std::begin(frame_128k), std::end(frame_128k),
+              data.begin() + offset + i * 417);
+  }
+  return data;
+}
+
+} // namespace
+
+TEST_CASE("Mp3 frame header is parsed", "[Mp3Frame]") {
+  auto header = parse_frame_header(frame_128k);
+  REQUIRE(header);
+  REQUIRE(header->version == 10);
+  REQUIRE(header->layer == 3);
+  REQUIRE(header->bitrate_kbps == 128);
+  REQUIRE(header->sample_rate == 44100);
+  REQUIRE(header->frame_bytes == 417);
+  REQUIRE(header->byte_rate() == 16000);
+
+  constexpr char not_a_frame[] = {'\xFF', '\xFB', '\xF0', '\x00'};
+  REQUIRE_FALSE(parse_frame_header(not_a_frame));
+}
+
+TEST_CASE("Mp3 frames are found after tags", "[Mp3Frame]") {
+  auto data = frames(3, 30);
+  // a sync word without a following frame is skipped
+  data[5] = '\xFF';
+  data[6] = '\xFB';
+  data[7] = '\x90';
+  REQUIRE(find_frame(data, 0) == 30);
+
+  std::vector<char> tag{'I', 'D', '3', 4, 0, 0, 0, 0, 1, 0};
+  REQUIRE(id3v2_size(tag) == 10 + 128);
+  REQUIRE(id3v2_size(data) == 0);
+}
+
+TEST_CASE("Mp3 seeks to frame boundaries", "[Mp3]") {
+  using namespace std::chrono_literals;
+  // 100 bytes of ID3v2 tag, then 100 frames of 417 bytes
+  auto data = frames(100, 100);
+  std::vector<char> tag{'I', 'D', '3', 4, 0, 0, 0, 0, 0, 90};
+  std::copy(tag.begin(), tag.end(), data.begin());
+  auto path = fs::temp_directory_path() / "mp3_test_seek.mp3";
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+
+  MediaCache cache;
+  auto mp3 = *Mp3::create(cache, path);
+  REQUIRE(mp3.audio_start() == 100);
+  // 417 bytes per 1152 samples at 44100 Hz
+  REQUIRE(mp3.byte_rate() == 15963);
+  REQUIRE(mp3.duration() == 2612ms);
+  REQUIRE(mp3.frame_at_byte(0) == 0);
+  REQUIRE(mp3.frame_at_byte(50) == 100);
+  REQUIRE(mp3.frame_at_byte(101) == 100 + 417);
+  REQUIRE(mp3.frame_at_byte(100 + 417 * 3) == 100 + 417 * 3);
+  REQUIRE(mp3.frame_at_byte(data.size() + 10) == data.size());
+  REQUIRE(mp3.frame_at_time(0ms) == 0);
+  // a frame lasts 26.1ms, 100ms plays the 4th one
+  REQUIRE(mp3.frame_at_time(100ms) == 100 + 417 * 3);
+  REQUIRE(mp3.frame_at_time(10s) == data.size());
+  fs::remove(path);
+  fs::remove(Mp3Index::sidecar_path(path));
+}
+
+TEST_CASE("Mp3Index sidecar is reused until the track changes",
+          "[Mp3Index]") {
+  auto data = frames(10, 0);
+  auto path = fs::temp_directory_path() / "mp3_test_index.mp3";
+  auto sidecar = Mp3Index::sidecar_path(path);
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  fs::remove(sidecar);
+
+  auto source = Mp3IndexSource::of(path, data.size());
+  REQUIRE_FALSE(Mp3Index::load(sidecar, source));
+  auto track = MediaFile::open(path);
+  auto built = Mp3Index::load_or_build(*track);
+  REQUIRE(built);
+  REQUIRE(built->frame_count() == 10);
+  REQUIRE(fs::exists(sidecar));
+
+  auto loaded = Mp3Index::load(sidecar, source);
+  REQUIRE(loaded);
+  REQUIRE(loaded->frame_count() == 10);
+  REQUIRE(loaded->entries()[9].offset == 9 * 417);
+  REQUIRE(loaded->duration() == built->duration());
+  // the tag servers send is kept along
+  ContentHash hash;
+  hash.update(data);
+  REQUIRE(built->etag() == hash.tag());
+  REQUIRE(loaded->etag() == hash.tag());
+  for (auto changed : {&Mp3IndexSource::mtime, &Mp3IndexSource::ctime}) {
+    auto other = source;
+    other.*changed += 1;
+    REQUIRE_FALSE(Mp3Index::load(sidecar, other));
+  }
+  auto other = source;
+  other.size += 1;
+  REQUIRE_FALSE(Mp3Index::load(sidecar, other));
+  other = source;
+  other.inode += 1;
+  REQUIRE_FALSE(Mp3Index::load(sidecar, other));
+  fs::remove(path);
+  fs::remove(sidecar);
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+TEST_CASE("Mp3Index sidecar is stale after a rewrite keeping the mtime",
+          "[Mp3Index]") {
+  using namespace std::chrono_literals;
+  auto data = frames(10, 0);
+  auto path = fs::temp_directory_path() / "mp3_test_rewrite.mp3";
+  auto sidecar = Mp3Index::sidecar_path(path);
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  fs::remove(sidecar);
+  auto built = Mp3Index::load_or_build(*MediaFile::open(path));
+  REQUIRE(built);
+
+  // what cp -p does: other bytes of the same size, the old mtime put back.
+  // the ctime may tick only every few ms
+  std::this_thread::sleep_for(20ms);
+  auto mtime = fs::last_write_time(path);
+  data[417 * 5 + 100] = 1;
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  fs::last_write_time(path, mtime);
+
+  auto rebuilt = Mp3Index::load_or_build(*MediaFile::open(path));
+  REQUIRE(rebuilt);
+  ContentHash hash;
+  hash.update(data);
+  REQUIRE(rebuilt->etag() == hash.tag());
+  REQUIRE(rebuilt->etag() != built->etag());
+  fs::remove(path);
+  fs::remove(sidecar);
+}
+#endif
+
+TEST_CASE("Mp3Index skips the Xing frame", "[Mp3Index]") {
+  auto data = frames(5, 0);
+  // Xing after 32 bytes of stereo MPEG 1 side information, 4 frames
+  const char xing[] = {'X', 'i', 'n', 'g', 0, 0, 0, 1, 0, 0, 0, 4};
+  std::copy(std::begin(xing), std::end(xing), data.begin() + 4 + 32);
+  auto path = fs::temp_directory_path() / "mp3_test_xing.mp3";
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+
+  auto track = MediaFile::open(path);
+  auto header = parse_frame_header(data);
+  REQUIRE(vbr_header_frames(data, *header) == 4u);
+  auto index = Mp3Index::build(*track, Mp3IndexSource{track->size(), 0, 0, 0});
+  REQUIRE(index);
+  REQUIRE(index->frame_count() == 4);
+  REQUIRE(index->audio_start() == 417);
+  fs::remove(path);
+}
+
+TEST_CASE("Catalog finds tracks by name and id", "[Catalog]") {
+  auto dir = fs::temp_directory_path() / "mp3_test_catalog";
+  fs::remove_all(dir);
+  fs::create_directories(dir / "album");
+  for (auto name : {"b.mp3", "album/a.MP3", "notes.txt"}) {
+    std::ofstream(dir / name) << "x";
+  }
+
+  auto catalog = Catalog::scan(dir);
+  REQUIRE(catalog.size() == 2);
+  REQUIRE(catalog.by_id(0)->name == "album/a");
+  REQUIRE(catalog.by_id(1)->name == "b");
+  REQUIRE(catalog.by_id(2) == nullptr);
+  REQUIRE(catalog.find("b")->path == dir / "b.mp3");
+  REQUIRE(catalog.find("0")->name == "album/a");
+  REQUIRE(catalog.find("notes") == nullptr);
+  REQUIRE(catalog.find("12x") == nullptr);
+  fs::remove_all(dir);
+}
+
+TEST_CASE("Broadcast releases frame aligned chunks in real time",
+          "[Broadcast]") {
+  using namespace std::chrono_literals;
+  auto dir = fs::temp_directory_path() / "mp3_test_broadcast";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  auto data = frames(100, 0);
+  std::ofstream(dir / "a.mp3", std::ios::binary).write(data.data(), data.size());
+
+  asio::io_context io_context;
+  MediaCache cache;
+  auto catalog = Catalog::scan(dir);
+  // a second into the channel, 26ms frames give 4 frames per chunk
+  auto epoch = Broadcast::clock::now() - 1s;
+  Broadcast broadcast(io_context, cache, catalog, epoch);
+  REQUIRE(broadcast.start(epoch + 1s));
+  REQUIRE(broadcast.live_edge() == 10);
+  auto chunk = broadcast.chunk(3);
+  REQUIRE(chunk);
+  REQUIRE(chunk->bytes.size() == 4 * 417);
+  REQUIRE(chunk->bytes[0] == data[3 * 4 * 417]);
+  REQUIRE_FALSE(broadcast.chunk(10));
+  REQUIRE(broadcast.join_position(0ms) == 10);
+  REQUIRE(broadcast.join_position(300ms) == 7);
+  REQUIRE(broadcast.join_position(10s) == 0);
+
+  bool released = false;
+  broadcast.wait([&released]() { released = true; });
+  io_context.run_one();
+  REQUIRE(released);
+  // the timer releases what is due when it runs, a slow run may be later
+  REQUIRE(broadcast.live_edge() >= 11);
+  broadcast.stop();
+  fs::remove_all(dir);
+}
+
+TEST_CASE("Pacer keeps the lead", "[Pacer]") {
+  using namespace std::chrono_literals;
+  PacingOptions options{PacingMode::app, 2000ms, 0};
+  Pacer::clock::time_point start{};
+  Pacer pacer(16000, options, start);
+
+  REQUIRE(pacer.allowance(0, start) == 32000);
+  REQUIRE(pacer.allowance(32000, start) == 0);
+  REQUIRE(pacer.allowance(32000, start + 1s) == 16000);
+  REQUIRE(pacer.ready_at(0) == start);
+  // the next chunk of 4096 bytes, 256ms of audio
+  auto wait = pacer.ready_at(32000) - start;
+  REQUIRE(wait > 255ms);
+  REQUIRE(wait <= 256ms);
+}
+
+TEST_CASE("Pacer does not count paused time", "[Pacer]") {
+  using namespace std::chrono_literals;
+  PacingOptions options{PacingMode::app, 2000ms, 0};
+  Pacer::clock::time_point start{};
+  Pacer pacer(16000, options, start);
+
+  pacer.pause(start + 1s);
+  pacer.resume(start + 5s);
+  // 1s played before the pause, none while paused
+  REQUIRE(pacer.allowance(32000, start + 5s) == 16000);
+  REQUIRE(pacer.allowance(32000, start + 6s) == 32000);
+}
+
+// a track cache in a fresh directory, with a download whose tag is known
+struct TrackCacheFixture {
+  TrackCacheFixture()
+      : dir(fs::temp_directory_path() / "mp3_test_track_cache")
+      , data(frames(20, 0)) {
+    fs::remove_all(dir);
+    ContentHash hash;
+    hash.update(data);
+    tag = hash.tag();
+  }
+  ~TrackCacheFixture() { fs::remove_all(dir); }
+
+  fs::path dir;
+  std::vector<char> data;
+  std::string tag;
+};
+
+TEST_CASE("TrackCache keeps a complete download", "[TrackCache]") {
+  TrackCacheFixture fixture;
+  TrackCache cache(fixture.dir);
+  REQUIRE(cache.lookup("host", "a").empty());
+
+  auto writer = cache.store("host", "a", fixture.tag, fixture.data.size());
+  REQUIRE(writer);
+  // arrives in pieces, as reads from the socket do
+  std::span<const char> bytes = fixture.data;
+  writer->append(bytes.first(1000));
+  REQUIRE_FALSE(writer->done());
+  writer->append(bytes.subspan(1000));
+  REQUIRE(writer->done());
+  writer.reset();
+
+  REQUIRE(cache.lookup("host", "a") == fixture.tag);
+  REQUIRE(cache.lookup("other", "a").empty());
+  auto file = cache.open(fixture.tag);
+  REQUIRE(file);
+  std::vector<char> read(fixture.data.size() + 1);
+  REQUIRE(std::fread(read.data(), 1, read.size(), file.get()) ==
+          fixture.data.size());
+  read.pop_back();
+  REQUIRE(read == fixture.data);
+}
+
+TEST_CASE("TrackCache drops a download that does not match its tag",
+          "[TrackCache]") {
+  TrackCacheFixture fixture;
+  TrackCache cache(fixture.dir);
+  auto writer = cache.store("host", "a", fixture.tag, fixture.data.size());
+  REQUIRE(writer);
+  fixture.data[500] ^= 1;
+  writer->append(fixture.data);
+  REQUIRE_FALSE(writer->done());
+  writer.reset();
+
+  REQUIRE(cache.lookup("host", "a").empty());
+  REQUIRE_FALSE(cache.open(fixture.tag));
+  REQUIRE(fs::is_empty(fixture.dir / "names"));
+  REQUIRE_FALSE(fs::exists(fixture.dir / (fixture.tag + ".mp3.part")));
+}
+
+TEST_CASE("TrackCacheWriter dropped early removes its part file",
+          "[TrackCache]") {
+  TrackCacheFixture fixture;
+  TrackCache cache(fixture.dir);
+  auto part = fixture.dir / (fixture.tag + ".mp3.part");
+  auto writer = cache.store("host", "a", fixture.tag, fixture.data.size());
+  REQUIRE(writer);
+  writer->append(std::span<const char>(fixture.data).first(1000));
+  REQUIRE(fs::exists(part));
+  writer.reset();
+
+  REQUIRE_FALSE(fs::exists(part));
+  REQUIRE(cache.lookup("host", "a").empty());
+}
+
+TEST_CASE("TrackCache refuses tags that are no content hash", "[TrackCache]") {
+  TrackCacheFixture fixture;
+  TrackCache cache(fixture.dir);
+  // tag sized, but no lowercase hex
+  std::string upper(ContentHash::tag_size, 'A');
+  std::string climbing = "../../../etc/passwd";
+  climbing.resize(ContentHash::tag_size, '/');
+  // a 64 bit tag of the hash used before
+  std::string_view short_tag = "0123456789abcdef";
+  for (std::string_view tag :
+       {std::string_view(), short_tag, std::string_view(upper),
+        std::string_view(climbing)}) {
+    REQUIRE_FALSE(cache.store("host", "a", std::string(tag), 10));
+    REQUIRE_FALSE(cache.open(tag));
+  }
+  REQUIRE_FALSE(fs::exists(fixture.dir));
+}
+
+} // namespace am
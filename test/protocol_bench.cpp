@@ -0,0 +1,286 @@
+#include "protocol-system.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+
+Micro benchmarks of the protocol's hot data structures, printed as JSON:
+
+  protocol_bench [--filter=SUBSTRING] [--min-time-ms=N] > bench.json
+
+every benchmark runs its operation in batches sized to take about a tenth of
+min time, and reports nanoseconds per operation of the fastest, median and
+mean batch, plus bytes per second where an operation moves bytes. compare
+the medians of two runs on the same machine to spot regressions
+
+ */
+
+namespace am {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// keeps the compiler from dropping a computation whose result is unused
+template <typename T> void keep(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "r"(&value) : "memory");
+#else
+  static const void *volatile sink;
+  sink = &value;
+#endif
+}
+
+struct BenchResult {
+  std::string name;
+  // moved by one operation, 0 if it moves none
+  std::size_t bytes;
+  std::uint64_t batch;
+  // per operation, one entry per batch
+  std::vector<double> ns;
+};
+
+class BenchRunner {
+public:
+  static constexpr std::size_t batches = 10;
+
+  BenchRunner(std::chrono::milliseconds min_time, std::string filter)
+      : min_time_(min_time)
+      , filter_(std::move(filter)) {}
+
+  template <typename Op>
+  void run(std::string name, std::size_t bytes, Op &&op) {
+    if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+      return;
+    }
+    auto time_batch = [&op](std::uint64_t batch) {
+      auto started = Clock::now();
+      for (std::uint64_t i = 0; i < batch; i++) {
+        op();
+      }
+      return Clock::now() - started;
+    };
+    // doubles the batch until it takes long enough to time, warming up
+    std::uint64_t batch = 1;
+    while (time_batch(batch) < min_time_ / batches && batch < (1ull << 40)) {
+      batch *= 2;
+    }
+    BenchResult result{std::move(name), bytes, batch, {}};
+    for (std::size_t i = 0; i < batches; i++) {
+      auto elapsed = std::chrono::duration<double, std::nano>(time_batch(batch));
+      result.ns.push_back(elapsed.count() / static_cast<double>(batch));
+    }
+    results_.push_back(std::move(result));
+  }
+
+  void write_json(std::ostream &out) const;
+
+private:
+  std::chrono::milliseconds min_time_;
+  std::string filter_;
+  std::vector<BenchResult> results_;
+};
+
+// names are ours, but keep the output valid whatever they hold
+std::string json_string(std::string_view value) {
+  std::string res = "\"";
+  for (auto c : value) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+    }
+    res += static_cast<unsigned char>(c) < 0x20 ? ' ' : c;
+  }
+  return res + '"';
+}
+
+void BenchRunner::write_json(std::ostream &out) const {
+  out << "{\n  \"context\": {\"page_size\": " << system_page_size()
+      << ", \"min_time_ms\": " << min_time_.count() << ", \"build\": "
+#if defined(NDEBUG)
+      << json_string("release")
+#else
+      << json_string("debug")
+#endif
+#if defined(__VERSION__)
+      << ", \"compiler\": " << json_string(__VERSION__)
+#endif
+      << "},\n  \"benchmarks\": [";
+  for (std::size_t i = 0; i < results_.size(); i++) {
+    auto &result = results_[i];
+    auto sorted = result.ns;
+    std::sort(sorted.begin(), sorted.end());
+    auto mean = std::accumulate(sorted.begin(), sorted.end(), 0.0) /
+                static_cast<double>(sorted.size());
+    auto median = sorted[sorted.size() / 2];
+    out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(result.name)
+        << ", \"batch\": " << result.batch << ", \"batches\": " << sorted.size()
+        << ", \"ns_per_op_min\": " << sorted.front()
+        << ", \"ns_per_op_median\": " << median
+        << ", \"ns_per_op_mean\": " << mean;
+    if (result.bytes > 0) {
+      out << ", \"bytes_per_op\": " << result.bytes
+          << ", \"bytes_per_second\": "
+          << static_cast<std::uint64_t>(result.bytes * 1e9 / median);
+    }
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+constexpr std::size_t ring_size = 64 * 1024;
+
+// chunks of odd sizes drift over the end of the ring, so copies split at
+// every wrap point they meet
+void bench_memcpy(BenchRunner &runner) {
+  for (std::size_t chunk : {61, 1441, 16381}) {
+    RingBuffer ring(ring_size, 0, ring_size);
+    std::vector<char> in(chunk, 'a');
+    std::vector<char> out(chunk);
+    runner.run("ring_buffer/memcpy_in_out/" + std::to_string(chunk), chunk,
+               [&]() {
+                 ring.memcpy_in(in.data(), chunk);
+                 ring.memcpy_out(out.data(), chunk);
+                 keep(out);
+               });
+  }
+}
+
+// views of a half full ring, moving around it so both the one and the two
+// part views are taken
+void bench_views(BenchRunner &runner) {
+  constexpr std::size_t step = 1441;
+  RingBuffer ring(ring_size, 0, ring_size);
+  ring.consume(ring.capacity() / 2);
+  runner.run("ring_buffer/prepared_data", 0, [&]() {
+    auto prepared = ring.prepared();
+    auto data = ring.data();
+    keep(prepared);
+    keep(data);
+    ring.consume(step);
+    ring.commit(step);
+  });
+}
+
+void bench_peek(BenchRunner &runner) {
+  {
+    // starting at 2 so every capacity / 4 ints one straddles the wrap point
+    RingBuffer ring(ring_size, 0, ring_size);
+    ring.consume(2);
+    ring.commit(2);
+    runner.run("ring_buffer/peek_int", sizeof(int), [&]() {
+      ring.consume(sizeof(int));
+      auto value = ring.peek_int();
+      keep(value);
+      ring.commit(sizeof(int));
+    });
+  }
+  {
+    // a whole mp3 frame, what the player hands to minimp3
+    constexpr int frame = 1441;
+    RingBuffer ring(ring_size, 0, ring_size);
+    runner.run("ring_buffer/peek_linear_span/" + std::to_string(frame), frame,
+               [&]() {
+                 ring.consume(frame);
+                 auto span = ring.peek_linear_span(frame);
+                 keep(span);
+                 ring.commit(frame);
+               });
+  }
+}
+
+// a ring full of mp3 messages of message bytes each, envelope included.
+// message divides the capacity, so the bytes committed from the front are
+// the same as those consumed again at the back and the stream never ends
+void bench_decoder(BenchRunner &runner, WireVersion version,
+                   std::size_t message) {
+  auto name = std::string("decoder/try_read/v") +
+              std::to_string(static_cast<int>(version)) + "/" +
+              std::to_string(message);
+  Encoder encoder{version};
+  RingBuffer ring(ring_size, 0, ring_size);
+  encoder.fill_envelope(Envelope{2, message}, ring);
+  auto payload = message - ring.ready_size();
+  ring.reset();
+  while (ring.ready_write_size() >= message) {
+    encoder.fill_envelope(Envelope{2, payload}, ring);
+    ring.consume(payload);
+  }
+  if (ring.ready_write_size() != 0 || ring.ready_size() % message != 0) {
+    std::cerr << name << ": messages do not tile the ring" << std::endl;
+    std::exit(1);
+  }
+  Decoder decoder{};
+  decoder._version = version;
+  runner.run(name, message, [&]() {
+    if (!decoder.try_read(ring)) {
+      std::cerr << name << ": no message" << std::endl;
+      std::exit(1);
+    }
+    ring.commit(decoder._envelope.message_size);
+    decoder.reset();
+    ring.consume(message);
+  });
+}
+
+void bench_linear_mem(BenchRunner &runner) {
+  for (std::size_t size : {ring_size, std::size_t{1} << 20}) {
+    runner.run("linear_mem_info/create/" + std::to_string(size), 0, [&]() {
+      LinearMemInfo info(size);
+      keep(info.p1_);
+    });
+    // the same size comes back from the pool's free list after the first
+    runner.run("linear_mem_pool/acquire/" + std::to_string(size), 0, [&]() {
+      auto handle = LinearMemPool::instance().acquire(size);
+      keep(handle->p1_);
+    });
+  }
+}
+
+} // namespace
+
+} // namespace am
+
+int main(int argc, char **argv) {
+  std::chrono::milliseconds min_time{200};
+  std::string filter;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--filter=")) {
+      filter = arg.substr(9);
+    } else if (arg.starts_with("--min-time-ms=")) {
+      min_time = std::chrono::milliseconds(
+          std::strtoul(argv[i] + 14, nullptr, 10));
+    } else {
+      std::cerr << "Usage: protocol_bench [--filter=SUBSTRING] "
+                   "[--min-time-ms=N]"
+                << std::endl
+                << "  runs the benchmarks whose name holds SUBSTRING, each "
+                   "for about N ms (200)"
+                << std::endl;
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+  am::BenchRunner runner(min_time, filter);
+  am::bench_memcpy(runner);
+  am::bench_views(runner);
+  am::bench_peek(runner);
+  for (auto version : {am::WireVersion::v1, am::WireVersion::v2}) {
+    for (std::size_t message : {64, 1024}) {
+      am::bench_decoder(runner, version, message);
+    }
+  }
+  am::bench_linear_mem(runner);
+  runner.write_json(std::cout);
+  return 0;
+}
@@ -1,12 +1,28 @@
+#include "client-protocol.hpp"
+#include "metrics.hpp"
 #include "protocol-system.hpp"
 #include "protocol.hpp"
+#include "shm-ring.hpp"
+#include "slab.hpp"
+#include "udp-stream.hpp"
+#include "util.hpp"
 
 #include <catch2/catch_all.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers.hpp>
 #include <catch2/matchers/catch_matchers_predicate.hpp>
 #include <catch2/matchers/catch_matchers_quantifiers.hpp>
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#  include <poll.h>
+#  include <unistd.h>
+#endif
 
 namespace am {
 
@@ -23,6 +39,35 @@ TEST_CASE("LinnearArray works", "[LinnearArray]") {
                                              "equal to zero")));
 }
 
+TEST_CASE("LinearMemInfo mirrors", "[LinearMemInfo]") {
+  LinearMemInfo info(100);
+  REQUIRE(info.p2_ == info.p1_ + info.len_);
+  info.p1_[5] = 'a';
+  REQUIRE(info.p2_[5] == 'a');
+  info.p2_[info.len_ - 1] = 'b';
+  REQUIRE(info.p1_[info.len_ - 1] == 'b');
+}
+
+TEST_CASE("LinearMemPool recycles mappings", "[LinearMemPool]") {
+  auto &pool = LinearMemPool::instance();
+  REQUIRE(LinearMemPool::size_class(1) == system_page_size());
+  REQUIRE(LinearMemPool::size_class(3 * system_page_size()) ==
+          4 * system_page_size());
+
+  char *first = nullptr;
+  {
+    auto info = pool.acquire(5 * system_page_size());
+    REQUIRE(info->len_ == 8 * system_page_size());
+    first = info->p1_;
+  }
+  auto hits = pool.hits();
+  auto misses = pool.misses();
+  auto info = pool.acquire(7 * system_page_size());
+  REQUIRE(info->p1_ == first);
+  REQUIRE(pool.hits() == hits + 1);
+  REQUIRE(pool.misses() == misses);
+}
+
 TEST_CASE("RingBuffer works", "[RingBuffer]") {
   using namespace Catch::Matchers;
 
@@ -41,4 +86,354 @@ TEST_CASE("RingBuffer works", "[RingBuffer]") {
   REQUIRE(prepared.count() == 2);
 }
 
+TEST_CASE("RingBuffer grows keeping data", "[RingBuffer]") {
+  size_t pagesize = system_page_size();
+
+  RingBuffer buf(100, 20000, 40000);
+  REQUIRE(buf.capacity() == pagesize);
+  // put the filled sequence across the wrap point
+  buf.consume(pagesize - 2);
+  buf.commit(pagesize - 2);
+  const char msg[] = "hello";
+  buf.memcpy_in(msg, sizeof(msg));
+
+  buf.reserve(pagesize + 1);
+  REQUIRE(buf.capacity() == 2 * pagesize);
+  REQUIRE(buf.ready_size() == sizeof(msg));
+  REQUIRE(buf.ready_write_size() == 2 * pagesize - sizeof(msg));
+  char out[sizeof(msg)];
+  buf.memcpy_out(out, sizeof(out));
+  REQUIRE(std::string_view(out) == "hello");
+
+  buf.reserve(100);
+  REQUIRE(buf.capacity() == 2 * pagesize);
+}
+
+#if defined(__linux__)
+TEST_CASE("ShmRing carries bytes to a RingBuffer that adopted it",
+          "[ShmRing]") {
+  auto writer = ShmRing::create(100);
+  REQUIRE(writer);
+  auto size = writer->size();
+  REQUIRE(size == system_page_size());
+  // the other process gets its own descriptors
+  ShmRing::Fds fds{};
+  for (std::size_t i = 0; i < fds.size(); i++) {
+    fds[i] = ::dup(writer->fds()[i]);
+  }
+  auto reader = ShmRing::open(fds, size);
+  REQUIRE(reader);
+  REQUIRE(writer->writable() == 0);
+
+  // what the input held before stays in front of the ring's bytes
+  RingBuffer input(100, 20000, 40000);
+  const char held[] = "held";
+  input.memcpy_in(held, sizeof(held));
+  input.adopt(reader->take_data());
+  REQUIRE(input.capacity() == size);
+  std::uint64_t seen = 0;
+  reader->release(seen - input.ready_size());
+  REQUIRE(writer->writable() == size - sizeof(held));
+
+  auto room = writer->write_span();
+  std::memset(room.data(), 'a', room.size());
+  writer->commit_write(room.size());
+  REQUIRE(writer->writable() == 0);
+  REQUIRE(writer->writer_wait());
+
+  REQUIRE_FALSE(reader->reader_wait(seen));
+  input.consume(reader->written() - seen);
+  seen = reader->written();
+  char out[sizeof(held)];
+  input.memcpy_out(out, sizeof(out));
+  REQUIRE(std::string_view(out) == "held");
+  auto filled = input.peek_linear_span(static_cast<int>(input.ready_size()));
+  REQUIRE(std::all_of(filled.begin(), filled.end(),
+                      [](char c) { return c == 'a'; }));
+  input.commit(input.ready_size());
+  reader->release(seen - input.ready_size());
+  // the waiting writer was woken
+  pollfd space{writer->space_ready_fd(), POLLIN, 0};
+  REQUIRE(::poll(&space, 1, 0) == 1);
+  ShmRing::drain_eventfd(writer->space_ready_fd());
+  REQUIRE(writer->writable() == size);
+
+  // across the end of the ring, linear through the mirror
+  const std::string wrapped = "wrapped around the end";
+  room = writer->write_span();
+  std::memcpy(room.data(), wrapped.data(), wrapped.size());
+  writer->commit_write(wrapped.size());
+  writer->finish();
+  REQUIRE(reader->finished());
+  input.consume(reader->written() - seen);
+  auto tail = input.peek_linear_span(static_cast<int>(input.ready_size()));
+  REQUIRE(std::string_view(tail.data(), tail.size()) == wrapped);
+}
+#endif
+
+TEST_CASE("ContentHash tags bytes however they are split",
+          "[ContentHash]") {
+  // SHA-256 test vectors
+  REQUIRE(ContentHash{}.tag() ==
+          "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  ContentHash one;
+  one.update(std::string_view("abc"));
+  REQUIRE(one.tag() ==
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  ContentHash two_blocks;
+  two_blocks.update(std::string_view(
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"));
+  REQUIRE(two_blocks.tag() ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  ContentHash million;
+  const std::string thousand(1000, 'a');
+  for (int i = 0; i < 1000; i++) {
+    million.update(thousand);
+  }
+  REQUIRE(million.tag() ==
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+  const std::string track = "ID3 and some frames after it";
+  ContentHash whole;
+  whole.update(track);
+  ContentHash parts;
+  parts.update(std::string_view(track).substr(0, 5));
+  REQUIRE(parts.tag() != whole.tag());
+  parts.update(std::string_view(track).substr(5));
+  REQUIRE(parts.tag() == whole.tag());
+  REQUIRE(whole.tag() != one.tag());
+}
+
+TEST_CASE("Histogram percentiles are within a factor of two",
+          "[Metric]") {
+  MetricHistogramValue<long> histogram;
+  REQUIRE(histogram.percentile(50) == 0);
+  for (long value = 1; value <= 100; value++) {
+    histogram.add(value);
+  }
+  REQUIRE(histogram.count() == 100);
+  // 50 is in the bucket of 32 to 63
+  REQUIRE(histogram.percentile(50) == 63);
+  REQUIRE(histogram.percentile(99) == 100);
+  REQUIRE(histogram.percentile(0) == 1);
+  histogram.add(-5);
+  REQUIRE(histogram.percentile(0) == 0);
+  histogram.reset();
+  REQUIRE(histogram.count() == 0);
+}
+
+TEST_CASE("Slab reuses erased slots", "[Slab]") {
+  int values[3] = {1, 2, 3};
+  Slab<int> slab;
+  auto a = slab.insert(&values[0]);
+  auto b = slab.insert(&values[1]);
+  REQUIRE(slab.size() == 2);
+  slab.erase(a);
+  REQUIRE(slab.size() == 1);
+  auto c = slab.insert(&values[2]);
+  REQUIRE(c == a);
+
+  std::vector<int> seen;
+  slab.for_each([&](int &value) {
+    seen.push_back(value);
+    // erasing while walking skips the erased entry
+    slab.erase(b);
+  });
+  REQUIRE(seen == std::vector<int>{3});
+  REQUIRE(slab.size() == 1);
+}
+
+TEST_CASE("v1 envelopes keep the host order int layout", "[Envelope]") {
+  RingBuffer buf(100, 20000, 40000);
+  Encoder encoder;
+  REQUIRE(encoder.fill_envelope(Envelope{5, 12}, buf));
+  REQUIRE(buf.ready_size() == envelope_v1_size);
+  int raw[2];
+  buf.memcpy_out(raw, sizeof(raw));
+  REQUIRE(raw[0] == 5);
+  REQUIRE(raw[1] == 12);
+
+  // sizes past INT_MAX need v2
+  REQUIRE_FALSE(encoder.fill_envelope(Envelope{2, 1ull << 32}, buf));
+  REQUIRE(buf.ready_size() == 0);
+}
+
+TEST_CASE("v2 envelopes carry 64 bit sizes as varints", "[Envelope]") {
+  RingBuffer buf(100, 20000, 40000);
+  Encoder encoder;
+  encoder._version = WireVersion::v2;
+  REQUIRE(encoder.fill_envelope(Envelope{2, 5ull << 32}, buf));
+  REQUIRE(buf.ready_size() == 6);
+  auto fields = encoder.fields(buf);
+  fields.put_size(1ull << 40);
+  fields.put_int(-2);
+  REQUIRE(buf.ready_size() == 6 + 8 + 4);
+
+  // the envelope arrives one byte at a time
+  RingBuffer in(100, 20000, 40000);
+  Decoder decoder;
+  decoder._version = WireVersion::v2;
+  std::vector<char> bytes(buf.ready_size());
+  buf.memcpy_out(bytes.data(), bytes.size());
+  for (std::size_t i = 0; i < 5; i++) {
+    in.memcpy_in(&bytes[i], 1);
+    REQUIRE_FALSE(decoder.try_read(in));
+  }
+  in.memcpy_in(bytes.data() + 5, bytes.size() - 5);
+  REQUIRE(decoder.try_read(in));
+  REQUIRE(decoder._envelope.message_type == 2);
+  REQUIRE(decoder._envelope.message_size == 5ull << 32);
+  auto reader = decoder.fields(in);
+  REQUIRE(reader.get_size() == 1ull << 40);
+  REQUIRE(reader.get_int() == -2);
+}
+
+TEST_CASE("v2 decoder fails on overlong varints", "[Envelope]") {
+  RingBuffer in(100, 20000, 40000);
+  Decoder decoder;
+  decoder._version = WireVersion::v2;
+  std::vector<char> bytes(15, static_cast<char>(0x80));
+  in.memcpy_in(bytes.data(), bytes.size());
+  REQUIRE_FALSE(decoder.try_read(in));
+  REQUIRE(decoder.failed());
+}
+
+TEST_CASE("Client decoder fails on a message it cannot buffer",
+          "[ClientDecoder]") {
+  RingBuffer in(100, 20000, 40000);
+  bool error = false;
+  ClientDecoder decoder([](buffers_2<std::string_view>) {},
+                        [](RangeReply) {},
+                        [](buffers_2<bytes_view>) -> std::size_t { return 0; },
+                        [&error](std::string) { error = true; });
+  Encoder encoder;
+  REQUIRE(encoder.fill_envelope(
+      Envelope{7, ClientDecoder::max_buffer_size + 1}, in));
+  decoder.try_read_client(in);
+  REQUIRE(decoder.failed());
+  REQUIRE_FALSE(error);
+  REQUIRE(in.capacity() < ClientDecoder::max_buffer_size);
+}
+
+TEST_CASE("UDP datagrams round trip", "[Udp]") {
+  UdpRequest request{UdpRequestKind::request, 1, 1ull << 33, 1ull << 63,
+                     "track"};
+  auto decoded = UdpRequest::decode(request.encode());
+  REQUIRE(decoded);
+  REQUIRE(decoded->unit == 1);
+  REQUIRE(decoded->offset == 1ull << 33);
+  REQUIRE(decoded->cookie == 1ull << 63);
+  REQUIRE(decoded->track == "track");
+
+  // the answer to an unverified request is smaller than the request
+  auto cookie = UdpPacket::make_cookie(42).encode();
+  REQUIRE(cookie.size() < UdpRequest::header_size);
+  auto cookie_back = UdpPacket::decode(cookie);
+  REQUIRE(cookie_back);
+  REQUIRE(cookie_back->kind == UdpPacketKind::cookie);
+  REQUIRE(cookie_back->cookie() == 42);
+  cookie.pop_back();
+  REQUIRE_FALSE(UdpPacket::decode(cookie));
+
+  UdpPacket packet{7, UdpPacketKind::data, 4, 3, {'a', 'b', 'c'}};
+  auto bytes = packet.encode();
+  REQUIRE(bytes.size() == UdpPacket::header_size + 3);
+  auto back = UdpPacket::decode(bytes);
+  REQUIRE(back);
+  REQUIRE(back->seq == 7);
+  REQUIRE(back->payload == packet.payload);
+  // a data packet's length must match its payload
+  bytes.pop_back();
+  REQUIRE_FALSE(UdpPacket::decode(bytes));
+}
+
+// packets for count payloads of different lengths, the end packet last
+static std::vector<UdpPacket> udp_stream(std::uint8_t group, std::size_t count,
+                                         std::vector<std::string> &payloads) {
+  FecEncoder encoder(group);
+  std::vector<UdpPacket> packets;
+  for (std::size_t i = 0; i < count; i++) {
+    payloads.push_back(std::string(100 + i % 50, static_cast<char>('a' + i % 26)));
+    for (auto &packet : encoder.add(payloads.back())) {
+      packets.push_back(std::move(packet));
+    }
+  }
+  if (auto parity = encoder.flush()) {
+    packets.push_back(std::move(*parity));
+  }
+  packets.push_back(UdpPacket{encoder.next_seq(), UdpPacketKind::end, 0, 0, {}});
+  return packets;
+}
+
+TEST_CASE("JitterBuffer reorders and restores one loss per group",
+          "[JitterBuffer]") {
+  std::vector<std::string> payloads;
+  auto packets = udp_stream(4, 10, payloads);
+  // data 0..3, parity, data 4..7, parity, data 8..9, parity, end
+  REQUIRE(packets.size() == 14);
+  JitterBuffer buffer(8);
+  std::string out;
+  auto sink = [&out](std::span<const char> bytes) {
+    out.append(bytes.begin(), bytes.end());
+    return true;
+  };
+  // 1 comes after 2, 5 and the last data packet are lost
+  std::vector<std::size_t> order{0, 2, 1, 3, 4, 5, 7, 8, 9, 10, 12, 13};
+  for (auto i : order) {
+    buffer.add(packets[i]);
+    buffer.drain(sink);
+  }
+  std::string expected;
+  for (auto &payload : payloads) {
+    expected += payload;
+  }
+  REQUIRE(out == expected);
+  REQUIRE(buffer.stats().recovered == 2);
+  REQUIRE(buffer.stats().lost == 0);
+  REQUIRE(buffer.finished());
+}
+
+TEST_CASE("JitterBuffer holds payloads its sink refuses", "[JitterBuffer]") {
+  std::vector<std::string> payloads;
+  auto packets = udp_stream(0, 3, payloads);
+  JitterBuffer buffer(8);
+  for (auto &packet : packets) {
+    buffer.add(packet);
+  }
+  REQUIRE(buffer.drain([](std::span<const char>) { return false; }) == 0);
+  REQUIRE(buffer.drain([](std::span<const char>) { return true; }) ==
+          payloads[0].size() + payloads[1].size() + payloads[2].size());
+  REQUIRE(buffer.finished());
+}
+
+TEST_CASE("Parity keeps most of the stream at 1 to 5 percent loss",
+          "[JitterBuffer]") {
+  auto loss = GENERATE(0.01, 0.03, 0.05);
+  // the same packets are lost with and without parity
+  auto lost_with = [loss](std::uint8_t group) {
+    std::mt19937 random(42);
+    std::bernoulli_distribution drop(loss);
+    std::vector<std::string> payloads;
+    auto packets = udp_stream(group, 5000, payloads);
+    JitterBuffer buffer(16);
+    std::size_t delivered = 0;
+    for (auto &packet : packets) {
+      if (packet.kind == UdpPacketKind::end || !drop(random)) {
+        buffer.add(packet);
+      }
+      buffer.drain([&](std::span<const char> bytes) {
+        delivered++;
+        return true;
+      });
+    }
+    REQUIRE(buffer.finished());
+    REQUIRE(delivered + buffer.stats().lost == payloads.size());
+    return buffer.stats().lost;
+  };
+  auto plain = lost_with(0);
+  auto protected_ = lost_with(4);
+  REQUIRE(plain > 0);
+  REQUIRE(protected_ * 4 < plain);
+}
+
 } // namespace am
@@ -0,0 +1,258 @@
+#include <asio.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/use_awaitable.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+extern char **environ;
+
+namespace am {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// MPEG 1 layer 3, 128 kbps, 44100 Hz, stereo, no padding: 417 bytes
+constexpr char frame_128k[] = {'\xFF', '\xFB', '\x90', '\x00'};
+
+std::vector<char> frames(std::size_t count) {
+  std::vector<char> data(count * 417, 0);
+  for (std::size_t i = 0; i < count; i++) {
+    std::copy(std::begin(frame_128k), std::end(frame_128k),
+              data.begin() + i * 417);
+  }
+  return data;
+}
+
+// asio-server on a free port and a unix socket, stopped when it goes away
+class ServerProcess {
+public:
+  ServerProcess(const fs::path &media_dir, const fs::path &unix_path) {
+    std::vector<std::string> args{ASIO_SERVER_PATH, "--port=0",
+                                  "--media-dir=" + media_dir.string(),
+                                  "--default-track=a",
+                                  "--unix=" + unix_path.string()};
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    if (posix_spawn(&pid_, argv[0], nullptr, nullptr, argv.data(), environ) !=
+        0) {
+      pid_ = 0;
+    }
+  }
+
+  ~ServerProcess() {
+    if (pid_ > 0) {
+      ::kill(pid_, SIGTERM);
+      ::waitpid(pid_, nullptr, 0);
+    }
+  }
+
+  bool running() const { return pid_ > 0; }
+
+private:
+  pid_t pid_{};
+};
+
+// a v1 envelope, two ints in host order
+std::pair<int, int> read_envelope(asio::local::stream_protocol::socket &socket) {
+  int envelope[2];
+  asio::read(socket, asio::buffer(envelope, sizeof(envelope)));
+  return {envelope[0], envelope[1]};
+}
+
+// a v1 track request (6)
+void write_track_request(asio::local::stream_protocol::socket &socket,
+                         const std::string &name, asio::error_code &ec) {
+  int envelope[2] = {6, static_cast<int>(name.size())};
+  asio::write(socket, asio::buffer(envelope, sizeof(envelope)), ec);
+  if (!ec) {
+    asio::write(socket, asio::buffer(name), ec);
+  }
+}
+
+// a hello (9) offering v2 and no capabilities, in v1 framing like every hello
+void write_hello(asio::local::stream_protocol::socket &socket) {
+  int envelope[2] = {9, 8};
+  // two little endian u32, the version and the capabilities
+  const char fields[8] = {2, 0, 0, 0, 0, 0, 0, 0};
+  asio::write(socket, asio::buffer(envelope, sizeof(envelope)));
+  asio::write(socket, asio::buffer(fields, sizeof(fields)));
+}
+
+// skips v1 messages until the answer to a hello, false if none came in time
+bool read_hello_answer(asio::local::stream_protocol::socket &socket,
+                       asio::io_context &io_context,
+                       std::chrono::milliseconds timeout) {
+  bool answered = false;
+  auto reader = [&socket, &answered]() -> asio::awaitable<void> {
+    while (true) {
+      int envelope[2];
+      co_await asio::async_read(socket,
+                                asio::buffer(envelope, sizeof(envelope)),
+                                asio::use_awaitable);
+      std::vector<char> payload(envelope[1]);
+      co_await asio::async_read(socket, asio::buffer(payload),
+                                asio::use_awaitable);
+      if (envelope[0] == 9) {
+        answered = true;
+        co_return;
+      }
+    }
+  };
+  io_context.restart();
+  asio::co_spawn(io_context, reader(), asio::detached);
+  io_context.run_for(timeout);
+  socket.close();
+  io_context.run();
+  return answered;
+}
+
+// the server on a media directory holding track a, until the test ends
+struct ServerFixture {
+  ServerFixture()
+      : dir(fs::temp_directory_path() / "server_test")
+      , data(frames(100))
+      , unix_path(dir / "server.sock") {
+    using namespace std::chrono_literals;
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::ofstream(dir / "a.mp3", std::ios::binary)
+        .write(data.data(), data.size());
+    server.emplace(dir, unix_path);
+    for (int i = 0; i < 100 && !fs::exists(unix_path); i++) {
+      std::this_thread::sleep_for(50ms);
+    }
+  }
+
+  ~ServerFixture() {
+    server.reset();
+    fs::remove_all(dir);
+  }
+
+  asio::local::stream_protocol::socket connect() {
+    asio::local::stream_protocol::socket socket(io_context);
+    socket.connect(asio::local::stream_protocol::endpoint(unix_path.string()));
+    return socket;
+  }
+
+  fs::path dir;
+  std::vector<char> data;
+  fs::path unix_path;
+  std::optional<ServerProcess> server{};
+  asio::io_context io_context{};
+};
+
+} // namespace
+
+TEST_CASE_METHOD(ServerFixture, "Server streams to a v1 client that sends nothing",
+                 "[Server]") {
+  REQUIRE(server->running());
+  REQUIRE(fs::exists(unix_path));
+
+  // a client from before hellos and range requests, it only reads
+  auto socket = connect();
+  auto [type, size] = read_envelope(socket);
+  REQUIRE(type == 1);
+  std::string time(size, '\0');
+  asio::read(socket, asio::buffer(time));
+
+  std::tie(type, size) = read_envelope(socket);
+  REQUIRE(type == 2);
+  REQUIRE(static_cast<std::size_t>(size) == data.size());
+  std::vector<char> mp3(size);
+  asio::read(socket, asio::buffer(mp3));
+  REQUIRE(mp3 == data);
+}
+
+TEST_CASE_METHOD(ServerFixture, "Server survives oversized unknown track names",
+                 "[Server]") {
+  REQUIRE(server->running());
+  REQUIRE(fs::exists(unix_path));
+
+  SECTION("a long name comes back cut in the error") {
+    auto socket = connect();
+    asio::error_code ec;
+    write_track_request(socket, std::string(4000, 'x'), ec);
+    REQUIRE(!ec);
+    auto [type, size] = read_envelope(socket);
+    REQUIRE(type == 1);
+    std::string time(size, '\0');
+    asio::read(socket, asio::buffer(time));
+
+    std::tie(type, size) = read_envelope(socket);
+    REQUIRE(type == 7);
+    REQUIRE(size < 100);
+    std::string error(size, '\0');
+    asio::read(socket, asio::buffer(error));
+    REQUIRE(error.starts_with("unknown track xxx"));
+    REQUIRE(error.ends_with("..."));
+  }
+
+  SECTION("a name over the limit closes the connection") {
+    auto socket = connect();
+    asio::error_code ec;
+    // the server may close before taking all of it
+    write_track_request(socket, std::string(200000, 'x'), ec);
+    std::vector<char> rest(4096);
+    std::size_t received = 0;
+    while (!ec) {
+      received += socket.read_some(asio::buffer(rest), ec);
+    }
+    REQUIRE(received < rest.size());
+  }
+
+  // and goes on serving
+  auto socket = connect();
+  auto [type, size] = read_envelope(socket);
+  REQUIRE(type == 1);
+}
+
+TEST_CASE_METHOD(ServerFixture, "Server answers a hello sent after the time",
+                 "[Server]") {
+  using namespace std::chrono_literals;
+  REQUIRE(server->running());
+  REQUIRE(fs::exists(unix_path));
+
+  // a client with the track cached waits for the answer before it asks for
+  // a range, the server must not wait for that range
+  SECTION("once the time arrived") {
+    auto socket = connect();
+    auto [type, size] = read_envelope(socket);
+    REQUIRE(type == 1);
+    std::string time(size, '\0');
+    asio::read(socket, asio::buffer(time));
+    write_hello(socket);
+    REQUIRE(read_hello_answer(socket, io_context, 2s));
+  }
+
+  SECTION("while the time is being sent") {
+    for (int i = 0; i < 200; i++) {
+      auto socket = connect();
+      auto at = std::chrono::steady_clock::now() +
+                std::chrono::nanoseconds(i * 250);
+      while (std::chrono::steady_clock::now() < at) {
+      }
+      write_hello(socket);
+      REQUIRE(read_hello_answer(socket, io_context, 2s));
+    }
+  }
+}
+
+} // namespace am